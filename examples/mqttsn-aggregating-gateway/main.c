@@ -0,0 +1,758 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * mqttsn-aggregating-gateway/main.c
+ *
+ * MQTT-SN aggregating gateway.  Unlike the simple gateway, which relays each
+ * node's MQTT-SN session to the broker, this terminates MQTT-SN from the nodes
+ * (\see mqttsn-gateway.h) and holds a single session with the broker on their
+ * behalf.
+ *
+ * Each topic in the gateway's table is registered (or subscribed) with the broker
+ * once, and publishes from the broker are fanned out to all subscribing nodes.
+ * QoS 1 publishes from nodes are tracked here and acknowledged to the node when
+ * the broker acknowledges them.
+ *
+ * With -l the gateway runs without a broker, passing publishes straight between
+ * its own nodes.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "common.h"
+#include "tinymac.h"
+#include "tinymac-store.h"
+#include "tinyloop.h"
+#include "mqttsn.h"
+#include "mqttsn-gateway.h"
+#include "phy.h"
+
+#define MAX_INFLIGHT		32
+#define MAX_BROKER_PACKET	255
+#define BROKER_ADDR			"127.0.0.1"
+#define BROKER_PORT			1883
+#define BROKER_KEEP_ALIVE	30		/* seconds */
+#define STORE_PATH			"tinyhan-aggregator.db"
+
+typedef enum {
+	brokerDisconnected = 0,
+	brokerConnecting,
+	brokerConnected,
+} broker_state_t;
+
+/*! Broker session */
+typedef struct {
+	int						sock;
+	broker_state_t			state;
+	uint16_t				next_id;		/*< Last message ID used */
+	time_t					t_retry;		/*< Time to (re-)send CONNECT */
+	time_t					next_ping;		/*< Time to send next PINGREQ */
+	time_t					t_last_rx;		/*< Time anything was last heard from the broker */
+	char					client_id[24];
+} broker_t;
+
+/*! Broker state for an entry in the gateway's topic table */
+typedef struct {
+	uint16_t				broker_id;		/*< Broker's topic ID, or 0 if not yet known */
+	uint16_t				msg_id;			/*< REGISTER/SUBSCRIBE in progress, or 0 */
+	time_t					t_retry;		/*< Time to re-send the request */
+	boolean_t				subscribed;		/*< Subscription accepted by the broker */
+} topic_t;
+
+/*! QoS 1 publish from a node awaiting PUBACK from the broker */
+typedef struct {
+	uint16_t				msg_id;			/*< Message ID to broker, or 0 if unused */
+	mqttsn_gw_ref_t			ref;			/*< Originating publish */
+	uint8_t					topic;			/*< Index in topic table */
+	uint8_t					n_retries;		/*< Retries remaining */
+	uint8_t					size;			/*< Payload size */
+	boolean_t				retain;			/*< Broker should retain the publish */
+	time_t					t_retry;		/*< Time to re-send, or 0 if not yet sent */
+	char					data[MQTTSN_MAX_PACKET];
+} inflight_t;
+
+static tinyloop_t *loop;
+static volatile boolean_t dump = FALSE;
+static boolean_t local = FALSE;
+static broker_t broker;
+static topic_t topics[MQTTSN_GW_MAX_TOPICS];
+static inflight_t inflight[MAX_INFLIGHT];
+
+static void break_handler(int signum)
+{
+	tinyloop_stop(loop);
+}
+
+static void dump_handler(int signum)
+{
+	dump = TRUE;
+}
+
+static topic_t* topic_find_broker_id(uint16_t id)
+{
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		if (mqttsn_gw_topic(n, NULL, NULL) && topics[n].broker_id == id) {
+			return &topics[n];
+		}
+	}
+	return NULL;
+}
+
+static topic_t* topic_find_msg_id(uint16_t msg_id)
+{
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		if (mqttsn_gw_topic(n, NULL, NULL) && topics[n].msg_id == msg_id) {
+			return &topics[n];
+		}
+	}
+	return NULL;
+}
+
+#define TOPIC_INDEX(topic)				((unsigned int)((topic) - topics))
+
+/*
+ * Broker side
+ */
+
+static uint16_t broker_next_id(void)
+{
+	if (++broker.next_id == 0) {
+		broker.next_id = 1;
+	}
+	return broker.next_id;
+}
+
+static void broker_send(char *buf, uint8_t msg_type, size_t size)
+{
+	mqttsn_header_t *hdr = (mqttsn_header_t*)buf;
+
+	hdr->length = size;
+	hdr->msg_type = msg_type;
+	if (send(broker.sock, buf, size, 0) < 0 && errno != ECONNREFUSED) {
+		perror("send");
+	}
+}
+
+static void broker_connect(void)
+{
+	char buf[sizeof(mqttsn_connect_t) + sizeof(broker.client_id)];
+	mqttsn_connect_t *connect = (mqttsn_connect_t*)buf;
+	size_t len = strlen(broker.client_id);
+
+	/* Clean session - all topics are registered again once connected */
+	connect->flags = MQTTSN_FLAG_CLEAN_SESSION;
+	connect->protocol_id = MQTTSN_PROTOCOL_ID;
+	connect->duration = mqttsn_htons(BROKER_KEEP_ALIVE);
+	memcpy(connect->client_id, broker.client_id, len);
+	broker_send(buf, MQTTSN_CONNECT, sizeof(mqttsn_connect_t) + len);
+
+	broker.state = brokerConnecting;
+	broker.t_retry = time(NULL) + MQTTSN_T_RETRY;
+}
+
+/*! Send a QoS 1 publish from a node on to the broker */
+static void inflight_send(inflight_t *entry, boolean_t dup)
+{
+	char buf[sizeof(mqttsn_publish_t) + MQTTSN_MAX_PACKET];
+	mqttsn_publish_t *publish = (mqttsn_publish_t*)buf;
+
+	publish->flags = MQTTSN_FLAG_QOS_1 | MQTTSN_FLAG_TOPIC_ID_NORM | (dup ? MQTTSN_FLAG_DUP : 0) |
+			(entry->retain ? MQTTSN_FLAG_RETAIN : 0);
+	publish->topic_id = mqttsn_htons(topics[entry->topic].broker_id);
+	publish->msg_id = mqttsn_htons(entry->msg_id);
+	memcpy(publish->data, entry->data, entry->size);
+	broker_send(buf, MQTTSN_PUBLISH, sizeof(mqttsn_publish_t) + entry->size);
+
+	entry->t_retry = time(NULL) + MQTTSN_T_RETRY;
+}
+
+/*! Issue the next REGISTER or SUBSCRIBE needed for a topic, if any */
+static void topic_update(topic_t *topic)
+{
+	char buf[sizeof(mqttsn_subscribe_t) + MQTTSN_GW_MAX_TOPIC_NAME];
+	boolean_t published, subscribed;
+	const char *name;
+	size_t len;
+
+	name = mqttsn_gw_topic(TOPIC_INDEX(topic), &published, &subscribed);
+	if (!name || broker.state != brokerConnected || topic->msg_id) {
+		/* Not connected or a request is already in progress */
+		return;
+	}
+	len = strlen(name);
+
+	if (subscribed && !topic->subscribed) {
+		mqttsn_subscribe_t *subscribe = (mqttsn_subscribe_t*)buf;
+
+		topic->msg_id = broker_next_id();
+		subscribe->flags = MQTTSN_FLAG_QOS_1 | MQTTSN_FLAG_TOPIC_ID_NORM;
+		subscribe->msg_id = mqttsn_htons(topic->msg_id);
+		memcpy(subscribe->topic.topic_name, name, len);
+		broker_send(buf, MQTTSN_SUBSCRIBE, offsetof(mqttsn_subscribe_t, topic) + len);
+	} else if (published && !topic->broker_id) {
+		mqttsn_register_t *reg = (mqttsn_register_t*)buf;
+
+		topic->msg_id = broker_next_id();
+		reg->topic_id = 0;
+		reg->msg_id = mqttsn_htons(topic->msg_id);
+		memcpy(reg->topic_name, name, len);
+		broker_send(buf, MQTTSN_REGISTER, sizeof(mqttsn_register_t) + len);
+	} else {
+		return;
+	}
+	topic->t_retry = time(NULL) + MQTTSN_T_RETRY;
+}
+
+/*! Called when the broker has assigned an ID to a topic */
+static void topic_registered(topic_t *topic)
+{
+	unsigned int n;
+
+	/* Send any publishes that were waiting for it */
+	for (n = 0; n < MAX_INFLIGHT; n++) {
+		if (inflight[n].msg_id && inflight[n].topic == TOPIC_INDEX(topic) && !inflight[n].t_retry) {
+			inflight_send(&inflight[n], FALSE);
+		}
+	}
+}
+
+static void broker_lost(void)
+{
+	unsigned int n;
+
+	ERROR("broker session lost\n");
+	broker.state = brokerDisconnected;
+	broker.t_retry = time(NULL);
+
+	/* The new session starts clean, so topic IDs must be obtained again and
+	 * unacknowledged publishes sent again once they have been */
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		topics[n].broker_id = 0;
+		topics[n].msg_id = 0;
+		topics[n].subscribed = FALSE;
+	}
+	for (n = 0; n < MAX_INFLIGHT; n++) {
+		inflight[n].t_retry = 0;
+		inflight[n].n_retries = MQTTSN_N_RETRY;
+	}
+}
+
+static void broker_connack_handler(const char *buf, size_t size)
+{
+	const mqttsn_connack_t *connack = (const mqttsn_connack_t*)buf;
+	unsigned int n;
+
+	if (size < sizeof(mqttsn_connack_t) || broker.state != brokerConnecting) {
+		return;
+	}
+	if (connack->return_code != MQTTSN_RC_ACCEPTED) {
+		ERROR("connack return code: 0x%02X\n", connack->return_code);
+		return;
+	}
+
+	INFO("connected to broker\n");
+	broker.state = brokerConnected;
+	broker.next_ping = time(NULL) + BROKER_KEEP_ALIVE;
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		topic_update(&topics[n]);
+	}
+}
+
+static void broker_regack_handler(const char *buf, size_t size)
+{
+	const mqttsn_regack_t *regack = (const mqttsn_regack_t*)buf;
+	topic_t *topic;
+
+	if (size < sizeof(mqttsn_regack_t)) {
+		return;
+	}
+	topic = topic_find_msg_id(mqttsn_ntohs(regack->msg_id));
+	if (!topic) {
+		ERROR("regack id mismatch\n");
+		return;
+	}
+
+	if (regack->return_code != MQTTSN_RC_ACCEPTED) {
+		/* Leave the request outstanding so it is retried after a while */
+		ERROR("registration of %s not accepted: %u\n", mqttsn_gw_topic(TOPIC_INDEX(topic), NULL, NULL),
+				regack->return_code);
+		topic->t_retry = time(NULL) + MQTTSN_T_WAIT;
+		return;
+	}
+	topic->msg_id = 0;
+	topic->broker_id = mqttsn_ntohs(regack->topic_id);
+	TRACE("registered topic ID 0x%04X for %s\n", topic->broker_id, mqttsn_gw_topic(TOPIC_INDEX(topic), NULL, NULL));
+	topic_registered(topic);
+	topic_update(topic);
+}
+
+static void broker_suback_handler(const char *buf, size_t size)
+{
+	const mqttsn_suback_t *suback = (const mqttsn_suback_t*)buf;
+	topic_t *topic;
+
+	if (size < sizeof(mqttsn_suback_t)) {
+		return;
+	}
+	topic = topic_find_msg_id(mqttsn_ntohs(suback->msg_id));
+	if (!topic) {
+		ERROR("suback id mismatch\n");
+		return;
+	}
+
+	if (suback->return_code != MQTTSN_RC_ACCEPTED) {
+		ERROR("subscription to %s not accepted: %u\n", mqttsn_gw_topic(TOPIC_INDEX(topic), NULL, NULL),
+				suback->return_code);
+		topic->t_retry = time(NULL) + MQTTSN_T_WAIT;
+		return;
+	}
+	topic->msg_id = 0;
+	topic->subscribed = TRUE;
+	topic->broker_id = mqttsn_ntohs(suback->topic_id);
+	TRACE("subscribed topic ID 0x%04X for %s\n", topic->broker_id, mqttsn_gw_topic(TOPIC_INDEX(topic), NULL, NULL));
+	topic_registered(topic);
+	topic_update(topic);
+}
+
+static void broker_publish_handler(const char *buf, size_t size)
+{
+	const mqttsn_publish_t *publish = (const mqttsn_publish_t*)buf;
+	topic_t *topic;
+
+	if (size < sizeof(mqttsn_publish_t)) {
+		return;
+	}
+	topic = ((publish->flags & MQTTSN_FLAG_TOPIC_ID_MASK) == MQTTSN_FLAG_TOPIC_ID_NORM) ?
+			topic_find_broker_id(mqttsn_ntohs(publish->topic_id)) : NULL;
+
+	if ((publish->flags & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS_1) {
+		mqttsn_puback_t puback;
+
+		/* We take responsibility for delivery as soon as it gets here */
+		puback.topic_id = publish->topic_id;
+		puback.msg_id = publish->msg_id;
+		puback.return_code = topic ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_INVALID_TOPIC;
+		broker_send((char*)&puback, MQTTSN_PUBACK, sizeof(puback));
+	}
+	if (!topic) {
+		ERROR("publish: unknown topic ID\n");
+		return;
+	}
+	mqttsn_gw_deliver(TOPIC_INDEX(topic), publish->data, size - sizeof(mqttsn_publish_t),
+			(publish->flags & MQTTSN_FLAG_RETAIN) ? TRUE : FALSE);
+}
+
+static void broker_puback_handler(const char *buf, size_t size)
+{
+	const mqttsn_puback_t *puback = (const mqttsn_puback_t*)buf;
+	uint16_t msg_id;
+	unsigned int n;
+
+	if (size < sizeof(mqttsn_puback_t)) {
+		return;
+	}
+	msg_id = mqttsn_ntohs(puback->msg_id);
+	for (n = 0; n < MAX_INFLIGHT; n++) {
+		inflight_t *entry = &inflight[n];
+
+		if (entry->msg_id == msg_id && entry->t_retry) {
+			/* Pass the result back to the node that published */
+			mqttsn_gw_puback(&entry->ref, puback->return_code);
+			entry->msg_id = 0;
+			return;
+		}
+	}
+	ERROR("puback id mismatch\n");
+}
+
+static void broker_handler(int fd, uint32_t events, void *arg)
+{
+	char buf[MAX_BROKER_PACKET];
+	const mqttsn_header_t *hdr = (const mqttsn_header_t*)buf;
+	int size;
+
+	size = recv(fd, buf, sizeof(buf), 0);
+	if (size < 0) {
+		if (errno != ECONNREFUSED) {
+			/* (Refused just means the broker isn't running) */
+			perror("recv");
+		}
+		return;
+	}
+	if (size < (int)sizeof(mqttsn_header_t) || hdr->length < sizeof(mqttsn_header_t) || hdr->length > size) {
+		/* Short, or uses the 3 byte length form which we never need */
+		return;
+	}
+	size = hdr->length;
+	broker.t_last_rx = time(NULL);
+
+	switch (hdr->msg_type) {
+	case MQTTSN_CONNACK:
+		broker_connack_handler(buf, size);
+		break;
+	case MQTTSN_REGISTER: {
+		/* Only sent for wildcard subscriptions, which nodes can't make */
+		mqttsn_regack_t regack;
+		const mqttsn_register_t *reg = (const mqttsn_register_t*)buf;
+
+		if (size >= sizeof(mqttsn_register_t)) {
+			regack.topic_id = reg->topic_id;
+			regack.msg_id = reg->msg_id;
+			regack.return_code = MQTTSN_RC_NOT_SUPPORTED;
+			broker_send((char*)&regack, MQTTSN_REGACK, sizeof(regack));
+		}
+	} break;
+	case MQTTSN_REGACK:
+		broker_regack_handler(buf, size);
+		break;
+	case MQTTSN_SUBACK:
+		broker_suback_handler(buf, size);
+		break;
+	case MQTTSN_PUBLISH:
+		broker_publish_handler(buf, size);
+		break;
+	case MQTTSN_PUBACK:
+		broker_puback_handler(buf, size);
+		break;
+	case MQTTSN_PINGREQ: {
+		mqttsn_pingresp_t pingresp;
+
+		broker_send((char*)&pingresp, MQTTSN_PINGRESP, sizeof(pingresp));
+	} break;
+	case MQTTSN_PINGRESP:
+		break;
+	case MQTTSN_DISCONNECT:
+		broker_lost();
+		break;
+	default:
+		ERROR("unexpected message type 0x%02X from broker\n", hdr->msg_type);
+	}
+}
+
+/*
+ * Gateway backend
+ */
+
+static void broker_topic_added(void *arg, unsigned int index, const char *name)
+{
+	topic_update(&topics[index]);
+}
+
+static void broker_subscribe(void *arg, unsigned int index, const char *name)
+{
+	topic_update(&topics[index]);
+}
+
+static int broker_publish(void *arg, unsigned int index, const char *name, int qos, boolean_t retain,
+		const mqttsn_gw_ref_t *ref, const char *data, size_t size)
+{
+	topic_t *topic = &topics[index];
+
+	if (qos > 0) {
+		inflight_t *entry = NULL;
+		unsigned int n;
+
+		for (n = 0; n < MAX_INFLIGHT; n++) {
+			if (inflight[n].msg_id && inflight[n].ref.addr == ref->addr && inflight[n].ref.msg_id == ref->msg_id) {
+				/* Retry from the node of a publish we already have */
+				return 0;
+			}
+			if (!inflight[n].msg_id && !entry) {
+				entry = &inflight[n];
+			}
+		}
+		if (!entry || size > sizeof(entry->data)) {
+			return -1;
+		}
+
+		entry->msg_id = broker_next_id();
+		entry->ref = *ref;
+		entry->topic = index;
+		entry->n_retries = MQTTSN_N_RETRY;
+		entry->size = size;
+		entry->retain = retain;
+		entry->t_retry = 0;
+		memcpy(entry->data, data, size);
+		if (broker.state == brokerConnected && topic->broker_id) {
+			inflight_send(entry, FALSE);
+		}
+	} else if (topic->broker_id && broker.state == brokerConnected) {
+		/* QoS 0 - forward if we can, otherwise it is lost */
+		char out[sizeof(mqttsn_publish_t) + MQTTSN_MAX_PACKET];
+		mqttsn_publish_t *fwd = (mqttsn_publish_t*)out;
+
+		if (size > MQTTSN_MAX_PACKET) {
+			return -1;
+		}
+		fwd->flags = MQTTSN_FLAG_QOS_0 | MQTTSN_FLAG_TOPIC_ID_NORM | (retain ? MQTTSN_FLAG_RETAIN : 0);
+		fwd->topic_id = mqttsn_htons(topic->broker_id);
+		fwd->msg_id = 0;
+		memcpy(fwd->data, data, size);
+		broker_send(out, MQTTSN_PUBLISH, sizeof(mqttsn_publish_t) + size);
+	}
+	return 0;
+}
+
+static void broker_publish_id(void *arg, uint8_t id_type, uint16_t topic_id, const char *data, size_t size)
+{
+	char out[sizeof(mqttsn_publish_t) + MQTTSN_MAX_PACKET];
+	mqttsn_publish_t *fwd = (mqttsn_publish_t*)out;
+
+	/* Pre-defined and short topic IDs mean the same to the broker, so these are
+	 * forwarded as they are on our session */
+	if (broker.state != brokerConnected || size > MQTTSN_MAX_PACKET) {
+		return;
+	}
+	fwd->flags = MQTTSN_FLAG_QOS_0 | id_type;
+	fwd->topic_id = mqttsn_htons(topic_id);
+	fwd->msg_id = 0;
+	memcpy(fwd->data, data, size);
+	broker_send(out, MQTTSN_PUBLISH, sizeof(mqttsn_publish_t) + size);
+}
+
+/*! Timeouts for the broker session, topic requests and publishes in flight */
+static void broker_periodic(void *arg)
+{
+	time_t now = time(NULL);
+	unsigned int n;
+
+	if (broker.state != brokerConnected) {
+		if (now >= broker.t_retry) {
+			broker_connect();
+		}
+		return;
+	}
+
+	/* Keep the session alive and give up on it if the broker stops answering */
+	if (now >= broker.next_ping) {
+		mqttsn_pingreq_t pingreq;
+
+		broker_send((char*)&pingreq, MQTTSN_PINGREQ, sizeof(pingreq));
+		broker.next_ping = now + BROKER_KEEP_ALIVE;
+	}
+	if (now - broker.t_last_rx > BROKER_KEEP_ALIVE + MQTTSN_T_RETRY * MQTTSN_N_RETRY) {
+		broker_lost();
+		return;
+	}
+
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		topic_t *topic = &topics[n];
+
+		if (topic->msg_id && now >= topic->t_retry) {
+			/* Re-send request */
+			topic->msg_id = 0;
+			topic_update(topic);
+		}
+	}
+
+	for (n = 0; n < MAX_INFLIGHT; n++) {
+		inflight_t *entry = &inflight[n];
+
+		if (entry->msg_id && entry->t_retry && now >= entry->t_retry) {
+			if (entry->n_retries) {
+				entry->n_retries--;
+				inflight_send(entry, TRUE);
+			} else {
+				mqttsn_gw_puback(&entry->ref, MQTTSN_RC_CONGESTION);
+				entry->msg_id = 0;
+			}
+		}
+	}
+}
+
+static const mqttsn_gw_backend_t broker_backend = {
+	.topic_added = broker_topic_added,
+	.subscribe = broker_subscribe,
+	.publish = broker_publish,
+	.publish_id = broker_publish_id,
+	.periodic = broker_periodic,
+};
+
+/*
+ * Node side
+ */
+
+static int node_send(uint8_t addr, const char *buf, size_t size)
+{
+	return tinymac_send(addr, tinymacType_MQTTSN, buf, size, 0, NULL);
+}
+
+static void rx_handler(const tinymac_node_t *node, uint8_t type, const char *buf, size_t size)
+{
+	if (type == tinymacType_MQTTSN) {
+		mqttsn_gw_handler(node->addr, buf, size);
+	}
+}
+
+static void dereg_handler(const tinymac_node_t *node)
+{
+	mqttsn_gw_node_lost(node->addr);
+}
+
+static void dump_broker(void)
+{
+	static const char *states[] = { "disconnected", "connecting", "connected" };
+	unsigned int n, count;
+
+	printf("Broker %s as %s\n", states[broker.state], broker.client_id);
+	printf("ID   Broker Sub\n");
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		if (mqttsn_gw_topic(n, NULL, NULL)) {
+			printf("%04X %04X   %s\n", n + 1, topics[n].broker_id, topics[n].subscribed ? "yes" : "no");
+		}
+	}
+	for (n = 0, count = 0; n < MAX_INFLIGHT; n++) {
+		if (inflight[n].msg_id) {
+			count++;
+		}
+	}
+	printf("%u publishes in flight\n", count);
+}
+
+static void phy_handler(int fd, uint32_t events, void *arg)
+{
+	phy_event_handler();
+}
+
+static void tick_handler(void *arg)
+{
+	tinymac_tick_handler(NULL);
+	mqttsn_gw_periodic();
+
+	if (dump) {
+		dump = FALSE;
+		tinymac_dump_nodes();
+		mqttsn_gw_dump();
+		if (!local) {
+			dump_broker();
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction new_sa, old_sa;
+	struct sockaddr_in sa;
+	int opt;
+	tinymac_params_t params = {
+			.coordinator = TRUE,
+			.beacon_interval = 3,
+			.beacon_offset = 0,
+	};
+
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		switch (opt) {
+		case 'l':
+			local = TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	loop = tinyloop_create();
+	if (!loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return 1;
+	}
+
+	/* Trap break */
+	new_sa.sa_handler = break_handler;
+	sigemptyset(&new_sa.sa_mask);
+	new_sa.sa_flags = 0;
+	sigaction(SIGINT, &new_sa, &old_sa);
+
+	/* Dump node and topic tables on SIGUSR1 */
+	new_sa.sa_handler = dump_handler;
+	sigaction(SIGUSR1, &new_sa, NULL);
+
+	/* Initialise comms */
+	srand(time(NULL) + getpid());
+	phy_init();
+	params.uuid = rand();
+	if (tinymac_store_open(STORE_PATH) < 0) {
+		fprintf(stderr, "Unable to open node store - registrations will not be retained\n");
+	}
+	tinymac_init(&params);
+	tinymac_register_recv_cb(rx_handler);
+	tinymac_register_dereg_cb(dereg_handler);
+	tinymac_permit_attach(TRUE);
+	mqttsn_gw_init(node_send, local ? &mqttsn_gw_local_backend : &broker_backend, NULL);
+
+	/* watch tinymac PHY fd */
+	if (tinyloop_add_fd(loop, phy_get_fd(), TINYLOOP_IN, phy_handler, NULL) < 0) {
+		return 1;
+	}
+
+	/* One socket for the whole network */
+	broker.sock = -1;
+	if (!local) {
+		snprintf(broker.client_id, sizeof(broker.client_id), "tinyhan-%08X", (unsigned int)params.uuid);
+		broker.sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (broker.sock < 0) {
+			perror("socket");
+			return 1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = inet_addr(BROKER_ADDR);
+		sa.sin_port = htons(BROKER_PORT);
+		if (connect(broker.sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+			perror("connect");
+			return 1;
+		}
+		if (tinyloop_add_fd(loop, broker.sock, TINYLOOP_IN, broker_handler, NULL) < 0) {
+			return 1;
+		}
+	}
+
+	/* Periodic MAC and session handler */
+	if (tinyloop_set_tick(loop, TINYMAC_TICK_MS, tick_handler, NULL) < 0) {
+		return 1;
+	}
+
+	if (tinyloop_run(loop) < 0) {
+		return 1;
+	}
+
+	if (broker.sock >= 0) {
+		close(broker.sock);
+	}
+	tinyloop_destroy(loop);
+	tinymac_store_close();
+
+	sigaction(SIGINT, &old_sa, NULL);
+
+	return 0;
+}
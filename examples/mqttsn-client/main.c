@@ -27,17 +27,14 @@
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/timerfd.h>
-#include <sys/epoll.h>
 
 #include "common.h"
 #include "tinymac.h"
+#include "tinyloop.h"
 #include "phy.h"
 #include "mqttsn-client.h"
 
-#define MAX_EVENTS		4
-
-static volatile int quit = 0;
+static tinyloop_t *loop;
 
 static const mqttsn_c_topic_t topics[] = {
 #if 1
@@ -55,32 +52,83 @@ mqttsn_c_t *ctx = &_ctx;
 
 static void break_handler(int signum)
 {
-	quit = 1;
+	tinyloop_stop(loop);
+}
+
+static void client_deadline(void *arg);
+
+/* Wake when the client next has a retry or keep-alive due */
+static void client_schedule(void)
+{
+	uint32_t ms = mqttsn_c_next_deadline(ctx);
+
+	if (ms == MQTTSN_C_NO_DEADLINE) {
+		tinyloop_set_deadline(loop, 0, NULL, NULL);
+	} else {
+		tinyloop_set_deadline(loop, ms ? ms : 1, client_deadline, NULL);
+	}
+}
+
+static void client_deadline(void *arg)
+{
+	mqttsn_c_handler(ctx, NULL, 0);
+	client_schedule();
 }
 
 static void rx_handler(const tinymac_node_t *node, uint8_t type, const char *buf, size_t size)
 {
 	if (type == tinymacType_MQTTSN) {
 		mqttsn_c_handler(ctx, buf, size);
+		client_schedule();
 	}
 }
 
-static int packet_send(const char *buf, size_t size)
+/* Header and payload go to the MAC as separate fragments, so publishes are not copied */
+static int packet_send(const phy_buf_t *bufs, unsigned int nbufs)
 {
-	return tinymac_send(0, tinymacType_MQTTSN, buf, size, 0, NULL);
+	return tinymac_sendv(0, tinymacType_MQTTSN, bufs, nbufs, 0, NULL);
+}
+
+static void phy_handler(int fd, uint32_t events, void *arg)
+{
+	phy_event_handler();
+}
+
+static void tick_handler(void *arg)
+{
+	tinymac_tick_handler(NULL);
+
+#if 0
+	switch (mqttsn_c_get_state(ctx)) {
+	case mqttsnDisconnected:
+			mqttsn_c_connect(ctx);
+		break;
+	case mqttsnConnected:
+			mqttsn_c_publish(ctx, 0, 0, "hello", 5);
+			mqttsn_c_publish(ctx, 1, 0, "world", 5);
+			mqttsn_c_publish(ctx, 2, 1, "qos", 3);
+		break;
+	default:
+		break;
+	}
+	client_schedule();
+#endif
 }
 
 int main(void)
 {
 	struct sigaction new_sa, old_sa;
 	char idstr[10];
-	struct epoll_event ev, events[MAX_EVENTS];
-	int epoll_fd, timer_fd;
-	struct itimerspec its;
 	tinymac_params_t params = {
 			.flags = /* TINYMAC_ATTACH_FLAGS_SLEEPY | */ 5, /* specify hearbeat interval */
 	};
 
+	loop = tinyloop_create();
+	if (!loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return 1;
+	}
+
 	new_sa.sa_handler = break_handler;
 	sigemptyset(&new_sa.sa_mask);
 	new_sa.sa_flags = 0;
@@ -93,86 +141,27 @@ int main(void)
 	tinymac_init(&params);
 	tinymac_register_recv_cb(rx_handler);
 	snprintf(idstr, sizeof(idstr), "test%04X", (uint16_t)(params.uuid & 0xffff));
-	mqttsn_c_init(ctx, idstr, topics, packet_send);
+	mqttsn_c_init(ctx, idstr, topics, NULL);
+	mqttsn_c_set_sendv_callback(ctx, packet_send);
 	mqttsn_c_connect(ctx);
-
-	/* Set up epoll */
-	epoll_fd = epoll_create(ARRAY_SIZE(events));
-	if (epoll_fd < 0) {
-		perror("epoll_create");
-		return 1;
-	}
+	client_schedule();
 
 	/* watch tinymac PHY fd */
-	ev.events = EPOLLIN;
-	ev.data.u32 = 0;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, phy_get_fd(), &ev) < 0) {
-		perror("epoll_ctl");
+	if (tinyloop_add_fd(loop, phy_get_fd(), TINYLOOP_IN, phy_handler, NULL) < 0) {
 		return 1;
 	}
 
-	/* Create a timer fd for periodic handler */
-	timer_fd = timerfd_create(CLOCK_REALTIME, 0);
-	if (timer_fd < 0) {
-		perror("timerfd_create");
+	/* Periodic handler */
+	if (tinyloop_set_tick(loop, TINYMAC_TICK_MS, tick_handler, NULL) < 0) {
 		return 1;
 	}
-	its.it_interval.tv_sec = 0;
-	its.it_interval.tv_nsec = 1000000ull * TINYMAC_TICK_MS;
-	its.it_value = its.it_interval;
-	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
-		perror("timerfd_settime");
-		return 1;
-	}
-	ev.events = EPOLLIN;
-	ev.data.u32 = 1;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
-		perror("epoll_ctl");
-		return 1;
-	}
-
-	while (!quit) {
-		int n, nfds;
-
-		/* Wait for event */
-		nfds = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
-		if (nfds < 0) {
-			perror("epoll_wait");
-			return 1;
-		}
-
-		for (n = 0; n < nfds; n++) {
-			if (events[n].data.u32 == 0) {
-				/* PHY event */
-				phy_event_handler();
-			} else if (events[n].data.u32 == 1) {
-				/* tick */
-				char dummy[8];
-				read(timer_fd, dummy, sizeof(dummy));
-
-				tinymac_tick_handler(NULL);
 
-				mqttsn_c_handler(ctx, NULL, 0); /* periodic call */
-
-#if 0
-				switch (mqttsn_c_get_state(ctx)) {
-				case mqttsnDisconnected:
-						mqttsn_c_connect(ctx);
-					break;
-				case mqttsnConnected:
-						mqttsn_c_publish(ctx, 0, 0, "hello", 5);
-						mqttsn_c_publish(ctx, 1, 0, "world", 5);
-						mqttsn_c_publish(ctx, 2, 1, "qos", 3);
-					break;
-				default:
-					break;
-				}
-#endif
-			}
-		}
+	if (tinyloop_run(loop) < 0) {
+		return 1;
 	}
 
 	mqttsn_c_disconnect(ctx, 0);
+	tinyloop_destroy(loop);
 	sigaction(SIGINT, &old_sa, NULL);
 
 	return 0;
@@ -21,189 +21,436 @@
  *
  * Protocol demo implementing MQTT-SN on the PC simulator
  *
+ * The radio and MAC run on the main thread.  Broker traffic is handled by a
+ * number of worker threads, each of which owns the broker sockets for a shard
+ * of the nodes (address modulo number of workers).  Packets from the nodes pass
+ * to each worker through a single-producer single-consumer ring, and the workers
+ * post the broker's replies to the MAC command queue (\see tinymac_post_send),
+ * so a slow broker socket never delays the MAC.
+ *
+ * Each node gets its own UDP socket, connected to the broker, so the broker sees
+ * a distinct client address per node.  Sockets are opened when nodes register (or
+ * on their first packet if they were restored from the node store) and closed
+ * when they deregister.
+ *
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <sys/timerfd.h>
-#include <sys/epoll.h>
 
 #include "common.h"
 #include "tinymac.h"
+#include "tinymac-queue.h"
+#include "tinymac-store.h"
+#include "tinytrace.h"
+#include "tinyloop.h"
+#include "tinyring.h"
 #include "phy.h"
 
-#define MAX_EVENTS			16
 #define MAX_DEVICES 		256
-#define MAX_PAYLOAD			1024
+#define MAX_WORKERS			16
+#define DEFAULT_WORKERS		2
 #define BROKER_ADDR			"127.0.0.1"
 #define BROKER_PORT			1883
 #define DEVICE_PORT_BASE	11000
+#define STORE_PATH			"tinyhan-gateway.db"
+#define TRACE_PATH			"tinyhan-gateway.trace"
+#define TRACE_RECORDS		4096
+
+/* Ring buffer types used to control the broker sockets (not MAC packet types) */
+#define RING_OPEN			0xfe
+#define RING_CLOSE			0xff
 
-static volatile boolean_t quit = FALSE;
-static int socks[MAX_DEVICES];
+typedef struct {
+	pthread_t				thread;
+	tinyloop_t				*loop;
+	int						wake_fd;		/*< Signalled when to_worker becomes non-empty */
+	tinyring_t				to_worker;		/*< Packets from devices, for the broker */
+	unsigned int			dropped_up;		/*< Packets lost because to_worker was full */
+	unsigned int			dropped_down;	/*< Packets lost because the MAC queue was full or they were too big */
+} worker_t;
+
+static tinyloop_t *loop;
+static volatile boolean_t dump = FALSE;
+static int socks[MAX_DEVICES];		/* Owned by the worker for each address */
+static struct sockaddr_in broker_sa;
+static worker_t workers[MAX_WORKERS];
+static unsigned int nworkers = DEFAULT_WORKERS;
 
 static void break_handler(int signum)
 {
-	quit = TRUE;
+	tinyloop_stop(loop);
 }
 
-static void rx_handler(const tinymac_node_t *node, uint8_t type, const char *buf, size_t size)
+static void dump_handler(int signum)
+{
+	dump = TRUE;
+}
+
+static void wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0) {
+		perror("write");
+	}
+}
+
+static void clear_wake(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0) {
+		/* Spurious */
+	}
+}
+
+/*
+ * Worker threads
+ */
+
+static void worker_broker_handler(int fd, uint32_t events, void *arg);
+
+static void worker_close(worker_t *worker, uint8_t addr)
+{
+	if (socks[addr] >= 0) {
+		tinyloop_remove_fd(worker->loop, socks[addr]);
+		close(socks[addr]);
+		socks[addr] = -1;
+	}
+}
+
+static int worker_open(worker_t *worker, uint8_t addr)
 {
 	struct sockaddr_in sa;
+	int sock;
+
+	/* Start a new session with the broker if the address has been re-used */
+	worker_close(worker, addr);
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* Fixed port per address, so the broker sees the same client if we restart */
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = INADDR_ANY;
+	sa.sin_port = htons(DEVICE_PORT_BASE + addr);
+	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*)&broker_sa, sizeof(broker_sa)) < 0) {
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+	if (tinyloop_add_fd(worker->loop, sock, TINYLOOP_IN, worker_broker_handler, (void*)(uintptr_t)addr) < 0) {
+		close(sock);
+		return -1;
+	}
+	socks[addr] = sock;
+	return 0;
+}
 
-	if (type == tinymacType_MQTTSN) {
-		memset(&sa, 0, sizeof(sa));
-		sa.sin_family = AF_INET;
-		sa.sin_addr.s_addr = inet_addr(BROKER_ADDR);
-		sa.sin_port = htons(BROKER_PORT);
+static void worker_ring_handler(int fd, uint32_t events, void *arg)
+{
+	worker_t *worker = (worker_t*)arg;
+	tinyring_buf_t *buf;
 
-		/* UDP send to broker */
-		sendto(socks[node->addr], buf, size, 0, (struct sockaddr*)&sa, sizeof(sa));
+	clear_wake(fd);
+	while ((buf = tinyring_peek(&worker->to_worker))) {
+		switch (buf->type) {
+		case RING_OPEN:
+			worker_open(worker, buf->addr);
+			break;
+		case RING_CLOSE:
+			worker_close(worker, buf->addr);
+			break;
+		default:
+			/* UDP send to broker */
+			if (socks[buf->addr] >= 0 || worker_open(worker, buf->addr) == 0) {
+				send(socks[buf->addr], buf->data, buf->size, 0);
+			}
+		}
+		tinyring_pop(&worker->to_worker);
 	}
 }
 
-int main(void)
+static void worker_broker_handler(int fd, uint32_t events, void *arg)
+{
+	worker_t *worker = &workers[(uintptr_t)arg % nworkers];
+	char data[TINYMAC_MAX_PAYLOAD];
+	int size;
+
+	size = recv(fd, data, sizeof(data), MSG_TRUNC);
+	if (size < 0) {
+		if (errno != ECONNREFUSED) {
+			/* (Refused just means the broker isn't running) */
+			perror("recv");
+		}
+		return;
+	}
+	if (size > (int)sizeof(data) ||
+			tinymac_post_send((uint8_t)(uintptr_t)arg, tinymacType_MQTTSN, data, size, 0, NULL) < 0) {
+		/* Too big for the MAC, or the radio thread is behind - discard */
+		__atomic_fetch_add(&worker->dropped_down, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void* worker_thread(void *arg)
+{
+	worker_t *worker = (worker_t*)arg;
+
+	tinyloop_run(worker->loop);
+	return NULL;
+}
+
+/*
+ * Radio thread
+ */
+
+static void post_control(uint8_t addr, uint8_t type)
+{
+	worker_t *worker = &workers[addr % nworkers];
+	tinyring_buf_t *buf;
+
+	buf = tinyring_alloc(&worker->to_worker);
+	if (!buf) {
+		/* Lost opens are recovered on the next packet, and lost closes
+		 * when the address is re-used */
+		worker->dropped_up++;
+		return;
+	}
+	buf->addr = addr;
+	buf->type = type;
+	buf->size = 0;
+	if (tinyring_push(&worker->to_worker)) {
+		wake(worker->wake_fd);
+	}
+}
+
+static void reg_handler(const tinymac_node_t *node)
+{
+	post_control(node->addr, RING_OPEN);
+}
+
+static void dereg_handler(const tinymac_node_t *node)
+{
+	post_control(node->addr, RING_CLOSE);
+}
+
+static void rx_handler(const tinymac_node_t *node, uint8_t type, const char *data, size_t size)
+{
+	worker_t *worker = &workers[node->addr % nworkers];
+	tinyring_buf_t *buf;
+
+	if (type != tinymacType_MQTTSN) {
+		return;
+	}
+
+	buf = tinyring_alloc(&worker->to_worker);
+	if (!buf || size > sizeof(buf->data)) {
+		/* Worker is behind - discard rather than hold up the MAC */
+		worker->dropped_up++;
+		return;
+	}
+	buf->addr = node->addr;
+	buf->type = type;
+	buf->size = (uint16_t)size;
+	memcpy(buf->data, data, size);
+	if (tinyring_push(&worker->to_worker)) {
+		wake(worker->wake_fd);
+	}
+}
+
+static void queue_handler(int fd, uint32_t events, void *arg)
+{
+	/* Relay packets posted by the workers to devices */
+	tinymac_queue_handler();
+}
+
+static void phy_handler(int fd, uint32_t events, void *arg)
+{
+	phy_event_handler();
+}
+
+static void tick_handler(void *arg)
+{
+	tinymac_tick_handler(NULL);
+
+	if (dump) {
+		unsigned int n;
+
+		dump = FALSE;
+		tinymac_dump_nodes();
+		for (n = 0; n < nworkers; n++) {
+			printf("Worker %u: dropped %u up, %u down\n", n, workers[n].dropped_up,
+					__atomic_load_n(&workers[n].dropped_down, __ATOMIC_RELAXED));
+		}
+	}
+}
+
+static int worker_init(worker_t *worker)
+{
+	worker->loop = tinyloop_create();
+	if (!worker->loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return -1;
+	}
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wake_fd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	tinyring_init(&worker->to_worker);
+
+	if (tinyloop_add_fd(worker->loop, worker->wake_fd, TINYLOOP_IN, worker_ring_handler, worker) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
 {
 	struct sigaction new_sa, old_sa;
+	sigset_t sigs, old_sigs;
 	unsigned int n;
-	struct sockaddr_in sa;
-	struct epoll_event ev, events[MAX_EVENTS];
-	int epoll_fd, timer_fd;
-	struct itimerspec its;
+	int opt;
 	tinymac_params_t params = {
 			.coordinator = TRUE,
 			.beacon_interval = 3,
 			.beacon_offset = 0,
 	};
 
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-w workers]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nworkers < 1 || nworkers > MAX_WORKERS) {
+		fprintf(stderr, "Number of workers must be 1 to %u\n", MAX_WORKERS);
+		return 1;
+	}
+
+	loop = tinyloop_create();
+	if (!loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return 1;
+	}
+
 	/* Trap break */
 	new_sa.sa_handler = break_handler;
 	sigemptyset(&new_sa.sa_mask);
 	new_sa.sa_flags = 0;
 	sigaction(SIGINT, &new_sa, &old_sa);
 
+	/* Dump node table on SIGUSR1 */
+	new_sa.sa_handler = dump_handler;
+	sigaction(SIGUSR1, &new_sa, NULL);
+
 	/* Initialise comms */
 	srand(time(NULL) + getpid());
 	phy_init();
 	params.uuid = rand();
+	if (tinytrace_open(TRACE_PATH, TRACE_RECORDS) < 0) {
+		fprintf(stderr, "Unable to open trace buffer\n");
+	}
+	if (tinymac_store_open(STORE_PATH) < 0) {
+		fprintf(stderr, "Unable to open node store - registrations will not be retained\n");
+	}
 	tinymac_init(&params);
 	tinymac_register_recv_cb(rx_handler);
+	tinymac_register_reg_cb(reg_handler);
+	tinymac_register_dereg_cb(dereg_handler);
 	tinymac_permit_attach(TRUE);
 
-	/* Set up epoll */
-	epoll_fd = epoll_create(ARRAY_SIZE(events));
-	if (epoll_fd < 0) {
-		perror("epoll_create");
+	/* watch tinymac PHY fd */
+	if (tinyloop_add_fd(loop, phy_get_fd(), TINYLOOP_IN, phy_handler, NULL) < 0) {
 		return 1;
 	}
 
-	/* watch tinymac PHY fd */
-	ev.events = EPOLLIN;
-	ev.data.u32 = MAX_DEVICES + 0;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, phy_get_fd(), &ev) < 0) {
-		perror("epoll_ctl");
+	/* and the command queue that the workers post to */
+	if (tinymac_queue_init() < 0 ||
+			tinyloop_add_fd(loop, tinymac_queue_get_fd(), TINYLOOP_IN, queue_handler, NULL) < 0) {
 		return 1;
 	}
 
-	/* Bind a UDP socket for each device we will be gating, for
-	 * replies from the broker */
-	memset(&sa, 0, sizeof(sa));
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = INADDR_ANY;
-	for (n = 0; n < MAX_DEVICES; n++) {
-		sa.sin_port = htons(DEVICE_PORT_BASE + n);
-
-		socks[n] = socket(AF_INET, SOCK_DGRAM, 0);
-		if (socks[n] < 0) {
-			perror("socket");
+	for (n = 0; n < nworkers; n++) {
+		if (worker_init(&workers[n]) < 0) {
 			return 1;
 		}
+	}
 
-		if (bind(socks[n], (struct sockaddr*)&sa, sizeof(sa)) < 0) {
-			perror("bind");
-			return 1;
-		}
+	memset(&broker_sa, 0, sizeof(broker_sa));
+	broker_sa.sin_family = AF_INET;
+	broker_sa.sin_addr.s_addr = inet_addr(BROKER_ADDR);
+	broker_sa.sin_port = htons(BROKER_PORT);
+
+	/* Broker sockets are opened by the workers as nodes appear */
+	for (n = 0; n < MAX_DEVICES; n++) {
+		socks[n] = -1;
+	}
 
-		/* Watch for events */
-		ev.events = EPOLLIN;
-		ev.data.u32 = n;
-		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socks[n], &ev) < 0) {
-			perror("epoll_ctl");
+	/* Start workers with signals blocked so they are delivered to this thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+	for (n = 0; n < nworkers; n++) {
+		if (pthread_create(&workers[n].thread, NULL, worker_thread, &workers[n]) != 0) {
+			fprintf(stderr, "Unable to start worker\n");
 			return 1;
 		}
 	}
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
 
-	/* Create a timer fd for periodic handler */
-	timer_fd = timerfd_create(CLOCK_REALTIME, 0);
-	if (timer_fd < 0) {
-		perror("timerfd_create");
-		return 1;
-	}
-	its.it_interval.tv_sec = 0;
-	its.it_interval.tv_nsec = 1000000ull * TINYMAC_TICK_MS;
-	its.it_value = its.it_interval;
-	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
-		perror("timerfd_settime");
+	/* Periodic MAC handler */
+	if (tinyloop_set_tick(loop, TINYMAC_TICK_MS, tick_handler, NULL) < 0) {
 		return 1;
 	}
-	ev.events = EPOLLIN;
-	ev.data.u32 = MAX_DEVICES + 1;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
-		perror("epoll_ctl");
+
+	if (tinyloop_run(loop) < 0) {
 		return 1;
 	}
 
-	while (!quit) {
-		int n, nfds;
-
-		/* Wait for event */
-		nfds = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), -1);
-		if (nfds < 0) {
-			perror("epoll_wait");
-			return 1;
-		}
-
-		for (n = 0; n < nfds; n++) {
-			if (events[n].data.u32 < MAX_DEVICES) {
-				/* Incoming data from broker */
-				char payload[MAX_PAYLOAD];
-				struct sockaddr_in rxsa;
-				socklen_t addrlen = sizeof(rxsa);
-				int size;
-
-				/* Relay to device */
-				memset(&sa, 0, sizeof(sa));
-				size = recvfrom(socks[events[n].data.u32], payload, sizeof(payload), 0, (struct sockaddr*)&rxsa, &addrlen);
-				if (size < 0) {
-					perror("recvfrom");
-					return 1;
-				}
-				tinymac_send((uint8_t)events[n].data.u32, tinymacType_MQTTSN, payload, size, 0, NULL);
-			} else if (events[n].data.u32 == MAX_DEVICES + 0) {
-				/* PHY event */
-				phy_event_handler();
-			} else if (events[n].data.u32 == MAX_DEVICES + 1) {
-				/* tick */
-				char dummy[8];
-				read(timer_fd, dummy, sizeof(dummy));
-
-				tinymac_tick_handler(NULL);
-			}
-		}
+	/* Stop workers */
+	for (n = 0; n < nworkers; n++) {
+		tinyloop_stop(workers[n].loop);
+		pthread_join(workers[n].thread, NULL);
 	}
 
 	/* Close sockets */
 	for (n = 0; n < MAX_DEVICES; n++) {
-		close(socks[n]);
+		worker_close(&workers[n % nworkers], n);
+	}
+	for (n = 0; n < nworkers; n++) {
+		tinyloop_destroy(workers[n].loop);
+		close(workers[n].wake_fd);
 	}
-	/* Terminate ticker */
-	close(timer_fd);
+	tinyloop_destroy(loop);
+	tinymac_queue_close();
+	tinymac_store_close();
+	tinytrace_close();
 
 	sigaction(SIGINT, &old_sa, NULL);
 
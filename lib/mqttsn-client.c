@@ -28,6 +28,9 @@
 #include "common.h"
 #include "mqttsn-client.h"
 
+/*! reg_inflight index for a free slot */
+#define MQTTSN_REG_FREE				0xffff
+
 #ifdef DEBUG
 // for debugging state changes
 static const char *states[] = {
@@ -35,23 +38,120 @@ static const char *states[] = {
 	"CONNECTING",
 	"REGISTERING",
 	"CONNECTED",
-	"BUSY",
 	"DISCONNECTING",
+	"ASLEEP",
+	"AWAKE",
 };
 #endif
 
-static int mqttsn_send(mqttsn_c_t *ctx, uint8_t msg_type, size_t size, int do_retry)
+#if defined(__linux__) || defined(__APPLE__)
+static uint32_t mqttsn_default_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000u + (uint32_t)(ts.tv_nsec / 1000000l);
+}
+#else
+static uint32_t mqttsn_default_clock(void)
+{
+	return get_seconds() * 1000u;
+}
+#endif
+
+/* Time from the client clock that will be reached in ms milliseconds.  0 is reserved
+ * to mean no retry is pending. */
+static uint32_t mqttsn_deadline(mqttsn_c_t *ctx, uint32_t ms)
+{
+	uint32_t t = ctx->cb_clock() + ms;
+
+	return t ? t : 1;
+}
+
+/* Test whether a deadline has passed, allowing for the clock wrapping */
+static int mqttsn_expired(uint32_t now, uint32_t t)
+{
+	return (int32_t)(now - t) >= 0;
+}
+
+/* Time remaining until deadline t, or until next if that is sooner */
+static uint32_t mqttsn_earliest(uint32_t now, uint32_t t, uint32_t next)
+{
+	uint32_t remaining = mqttsn_expired(now, t) ? 0 : t - now;
+
+	return (remaining < next) ? remaining : next;
+}
+
+static int mqttsn_transmit(mqttsn_c_t *ctx, char *buf, size_t size)
 {
-	mqttsn_header_t *hdr = (mqttsn_header_t*)ctx->message;
+	if (ctx->cb_sendv) {
+		phy_buf_t frag = { buf, size };
+
+		return ctx->cb_sendv(&frag, 1);
+	}
+	return ctx->cb_send(buf, size);
+}
+
+static int mqttsn_send_buf(mqttsn_c_t *ctx, char *buf, uint8_t msg_type, size_t size)
+{
+	mqttsn_header_t *hdr = (mqttsn_header_t*)buf;
 
 	hdr->length = size;
 	hdr->msg_type = msg_type;
+	ctx->next_ping = mqttsn_deadline(ctx, MQTTSN_KEEP_ALIVE * 1000u);
+	return mqttsn_transmit(ctx, buf, size);
+}
+
+/* Send a PUBLISH whose payload may be somewhere other than after its header.  buf
+ * must have room for the whole message, where it is assembled if the send callback
+ * can't take fragments. */
+static int mqttsn_send_publish(mqttsn_c_t *ctx, char *buf, const char *data, size_t size)
+{
+	mqttsn_publish_t *publish = (mqttsn_publish_t*)buf;
+
+	publish->header.length = sizeof(mqttsn_publish_t) + size;
+	publish->header.msg_type = MQTTSN_PUBLISH;
+	ctx->next_ping = mqttsn_deadline(ctx, MQTTSN_KEEP_ALIVE * 1000u);
+	if (ctx->cb_sendv) {
+		phy_buf_t bufs[] = {
+				{ buf, sizeof(mqttsn_publish_t) },
+				{ (char*)data, size },
+		};
+
+		return ctx->cb_sendv(bufs, ARRAY_SIZE(bufs));
+	}
+	if (data != publish->data) {
+		memcpy(publish->data, data, size);
+	}
+	return ctx->cb_send(buf, publish->header.length);
+}
+
+static int mqttsn_send(mqttsn_c_t *ctx, uint8_t msg_type, size_t size, int do_retry)
+{
 	if (do_retry) {
 		ctx->n_retries = MQTTSN_N_RETRY;
-		ctx->t_retry = get_seconds() + MQTTSN_T_RETRY;
+		ctx->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
+	}
+	return mqttsn_send_buf(ctx, ctx->message, msg_type, size);
+}
+
+/* Complete all publishes awaiting PUBACK */
+static void mqttsn_inflight_flush(mqttsn_c_t *ctx, mqttsn_c_result_t result)
+{
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+		mqttsn_c_inflight_t *inflight = &ctx->inflight[n];
+
+		if (inflight->msg_id) {
+			uint16_t msg_id = inflight->msg_id;
+
+			inflight->msg_id = 0;
+			if (ctx->cb_puback) {
+				ctx->cb_puback(ctx, msg_id, result);
+			}
+		}
 	}
-	ctx->next_ping = get_seconds() + MQTTSN_KEEP_ALIVE;
-	return ctx->cb_send(ctx->message, size);
 }
 
 static void mqttsn_to_state(mqttsn_c_t *ctx, mqttsn_c_state_t state)
@@ -60,6 +160,10 @@ static void mqttsn_to_state(mqttsn_c_t *ctx, mqttsn_c_state_t state)
 	/* Abort pending sends */
 	ctx->n_retries = 0;
 	ctx->t_retry = 0;
+	if (state == mqttsnDisconnected || state == mqttsnAsleep) {
+		/* Nothing more will be acknowledged in this state */
+		mqttsn_inflight_flush(ctx, mqttsnError);
+	}
 	TRACE("--> %s\n", states[(int)state]);
 }
 
@@ -79,29 +183,147 @@ static void mqttsn_connack_handler(mqttsn_c_t *ctx, const char *buf, size_t size
 	}
 
 	if (connack->return_code == MQTTSN_RC_ACCEPTED) {
+		unsigned int n;
+
 		ctx->count = 0;
-		if (ctx->is_registered)
+		for (n = 0; n < MQTTSN_MAX_REG_INFLIGHT; n++) {
+			ctx->reg_inflight[n].index = MQTTSN_REG_FREE;
+		}
+		if (ctx->is_registered) {
 			mqttsn_to_state(ctx, mqttsnConnected);
-		else
+		} else {
+			/* New session - topic IDs will be reassigned */
+			memset(ctx->topic_hash, 0, sizeof(ctx->topic_hash));
 			mqttsn_to_state(ctx, mqttsnRegistering);
+		}
 	} else {
 		ERROR("connack return code: 0x%02X\n", connack->return_code);
 		mqttsn_to_state(ctx, mqttsnDisconnected);
 	}
 }
 
-/* TODO: Implement this for re-registration after a disconnect (sleeping).
- * Also required for support of wildcard subscriptions */
+/* Slot in topic_hash at which to start looking for a topic ID.  IDs handed out by
+ * gateways tend to be sequential and short topic IDs are pairs of characters, so mix
+ * the bits before reducing. */
+static unsigned int mqttsn_topic_hash(uint16_t topic_id)
+{
+	return (((uint32_t)topic_id * 0x9e3779b1u) >> 16) % MQTTSN_TOPIC_HASH_LEN;
+}
+
+/* Add a subscription to the lookup table once its topic ID is known */
+static void mqttsn_topic_hash_add(mqttsn_c_t *ctx, unsigned int index)
+{
+	unsigned int slot = mqttsn_topic_hash(ctx->topic_ids[index]);
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_TOPIC_HASH_LEN; n++) {
+		uint16_t entry = ctx->topic_hash[slot];
+
+		if (entry == 0 || entry == index + 1) {
+			ctx->topic_hash[slot] = index + 1;
+			return;
+		}
+		slot = (slot + 1) % MQTTSN_TOPIC_HASH_LEN;
+	}
+	ERROR("topic hash full\n");
+}
+
+/* Find the subscription with the specified topic ID, or return -1 */
+static int mqttsn_topic_hash_find(mqttsn_c_t *ctx, uint16_t topic_id)
+{
+	unsigned int slot = mqttsn_topic_hash(topic_id);
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_TOPIC_HASH_LEN; n++) {
+		uint16_t entry = ctx->topic_hash[slot];
+
+		if (entry == 0) {
+			break;
+		}
+		if (ctx->topic_ids[entry - 1] == topic_id) {
+			return entry - 1;
+		}
+		slot = (slot + 1) % MQTTSN_TOPIC_HASH_LEN;
+	}
+	return -1;
+}
+
+/* Rebuild the lookup table after a subscription's topic ID has changed */
+static void mqttsn_topic_hash_rebuild(mqttsn_c_t *ctx)
+{
+	uint16_t old[MQTTSN_TOPIC_HASH_LEN];
+	unsigned int n;
+
+	memcpy(old, ctx->topic_hash, sizeof(old));
+	memset(ctx->topic_hash, 0, sizeof(ctx->topic_hash));
+	for (n = 0; n < MQTTSN_TOPIC_HASH_LEN; n++) {
+		if (old[n]) {
+			mqttsn_topic_hash_add(ctx, old[n] - 1);
+		}
+	}
+}
+
+/* The gateway tells us the topic ID it will use for one of our subscriptions.  This
+ * happens when it has reassigned IDs, for example while we were asleep.
+ * TODO: Also required for support of wildcard subscriptions */
 static void mqttsn_register_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
-	ERROR("REGISTER handler not implemented\n");
+	mqttsn_register_t *reg = (mqttsn_register_t*)buf;
+	mqttsn_regack_t regack;
+	size_t len;
+	unsigned int n;
+
+	if (size < sizeof(mqttsn_register_t)) {
+		ERROR("register: invalid size\n");
+		return;
+	}
+	len = size - sizeof(mqttsn_register_t);
+
+	regack.topic_id = reg->topic_id;
+	regack.msg_id = reg->msg_id;
+	regack.return_code = MQTTSN_RC_INVALID_TOPIC;
+	for (n = 0; n < MQTTSN_MAX_CLIENT_TOPICS && ctx->topics[n].topic; n++) {
+		const mqttsn_c_topic_t *topic = &ctx->topics[n];
+
+		if ((topic->flags & MQTTSN_REG_SUBSCRIBE) &&
+				!(topic->flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT)) &&
+				strlen(topic->topic) == len && memcmp(topic->topic, reg->topic_name, len) == 0) {
+			TRACE("registered topic ID 0x%04X for SUBSCRIBE %s (%u)\n", mqttsn_ntohs(reg->topic_id), topic->topic, n);
+			ctx->topic_ids[n] = mqttsn_ntohs(reg->topic_id);
+			mqttsn_topic_hash_rebuild(ctx);
+			mqttsn_topic_hash_add(ctx, n);
+			regack.return_code = MQTTSN_RC_ACCEPTED;
+			break;
+		}
+	}
+	if (regack.return_code != MQTTSN_RC_ACCEPTED) {
+		ERROR("register: unknown topic %.*s\n", (int)len, reg->topic_name);
+	}
+	mqttsn_send_buf(ctx, (char*)&regack, MQTTSN_REGACK, sizeof(regack));
+}
+
+/* Find the registration awaiting an ack with the specified msg_id (the topic index) */
+static mqttsn_c_reg_inflight_t* mqttsn_reg_find(mqttsn_c_t *ctx, uint16_t msg_id)
+{
+	unsigned int n;
+
+	if (ctx->state != mqttsnRegistering || msg_id == MQTTSN_REG_FREE) {
+		return NULL;
+	}
+	for (n = 0; n < MQTTSN_MAX_REG_INFLIGHT; n++) {
+		if (ctx->reg_inflight[n].index == msg_id) {
+			return &ctx->reg_inflight[n];
+		}
+	}
+	return NULL;
 }
 
 /* TODO: Merge REGACK and SUBACK handlers */
 static void mqttsn_regack_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
-	mqttsn_register_t *reg = (mqttsn_register_t*)ctx->message;
 	mqttsn_regack_t *regack = (mqttsn_regack_t*)buf;
+	mqttsn_c_reg_inflight_t *reg;
+	uint16_t msg_id;
 
 	/* Validation */
 	if (size < sizeof(mqttsn_regack_t)) {
@@ -109,67 +331,61 @@ static void mqttsn_regack_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 		return;
 	}
 
-	if (ctx->state != mqttsnBusy || reg->header.msg_type != MQTTSN_REGISTER) {
-		ERROR("regack in invalid state\n");
-		return;
-	}
-
-	if (regack->msg_id != reg->msg_id) {
+	/* Acks may arrive in any order */
+	msg_id = mqttsn_ntohs(regack->msg_id);
+	reg = mqttsn_reg_find(ctx, msg_id);
+	if (!reg || (ctx->topics[msg_id].flags & MQTTSN_REG_SUBSCRIBE)) {
 		ERROR("regack id mismatch\n");
 		return;
 	}
 
 	if (regack->return_code == MQTTSN_RC_ACCEPTED) {
 		uint16_t topic_id = mqttsn_ntohs(regack->topic_id);
-		uint16_t msg_id = mqttsn_ntohs(regack->msg_id);
-		/* Update registry - msg_id is already validated against the transmitted value, and
-		 * we already checked that that was a REGISTER request */
-		TRACE("registered topic ID 0x%04X for PUBLISH %s (%u)\n", topic_id, reg->topic_name, msg_id);
+		/* Update registry - msg_id is the index of the topic */
+		TRACE("registered topic ID 0x%04X for PUBLISH %s (%u)\n", topic_id, ctx->topics[msg_id].topic, msg_id);
 		ctx->topic_ids[msg_id] = topic_id;
 	} else {
 		ERROR("registration not accepted: %u\n", regack->return_code);
 		// FIXME: retry?
 	}
 
-	/* Register next topic */
-	mqttsn_to_state(ctx, mqttsnRegistering);
+	/* Free the slot for the next topic */
+	reg->index = MQTTSN_REG_FREE;
 }
 
 static void mqttsn_suback_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
-	mqttsn_subscribe_t *subscribe = (mqttsn_subscribe_t*)ctx->message;
 	mqttsn_suback_t *suback = (mqttsn_suback_t*)buf;
+	mqttsn_c_reg_inflight_t *reg;
+	uint16_t msg_id;
 
 	if (size < sizeof(mqttsn_suback_t)) {
 		ERROR("suback: invalid size\n");
 		return;
 	}
 
-	if (ctx->state != mqttsnBusy || subscribe->header.msg_type != MQTTSN_SUBSCRIBE) {
-		ERROR("suback in invalid state\n");
-		return;
-	}
-
-	if (suback->msg_id != subscribe->msg_id) {
+	msg_id = mqttsn_ntohs(suback->msg_id);
+	reg = mqttsn_reg_find(ctx, msg_id);
+	if (!reg || !(ctx->topics[msg_id].flags & MQTTSN_REG_SUBSCRIBE)) {
 		ERROR("suback id mismatch\n");
 		return;
 	}
 
 	if (suback->return_code == MQTTSN_RC_ACCEPTED) {
-		uint16_t topic_id = mqttsn_ntohs(suback->topic_id);
-		uint16_t msg_id = mqttsn_ntohs(suback->msg_id);
-		/* Update registry - msg_id is already validated against the transmitted value, and
-		 * we already checked that that was a SUBSCRIBE request */
+		/* Update registry - msg_id is the index of the topic */
 		/* FIXME: QoS returned in SUBACK may not be the same as that requested */
-		TRACE("registered topic ID 0x%04X for SUBSCRIBE %s (%u)\n", topic_id, subscribe->topic.topic_name, msg_id);
-		ctx->topic_ids[msg_id] = topic_id;
+		if (!(ctx->topics[msg_id].flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT))) {
+			ctx->topic_ids[msg_id] = mqttsn_ntohs(suback->topic_id);
+		}
+		mqttsn_topic_hash_add(ctx, msg_id);
+		TRACE("registered topic ID 0x%04X for SUBSCRIBE %s (%u)\n", ctx->topic_ids[msg_id], ctx->topics[msg_id].topic, msg_id);
 	} else {
 		ERROR("subscription not accepted: %u\n", suback->return_code);
 		// FIXME: retry?
 	}
 
-	/* Register next topic */
-	mqttsn_to_state(ctx, mqttsnRegistering);
+	/* Free the slot for the next topic */
+	reg->index = MQTTSN_REG_FREE;
 }
 
 static void mqttsn_publish_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
@@ -187,10 +403,19 @@ static void mqttsn_publish_handler(mqttsn_c_t *ctx, const char *buf, size_t size
 	msg_id = mqttsn_ntohs(publish->msg_id);
 
 	/* Find subscribed topic ID in registry */
-	for (subscription = 0; subscription < MQTTSN_MAX_CLIENT_TOPICS; subscription++)
-		if (ctx->topic_ids[subscription] == topic_id && (ctx->topics[subscription].flags & MQTTSN_REG_SUBSCRIBE))
-			break;
-	if (subscription == MQTTSN_MAX_CLIENT_TOPICS) {
+	subscription = mqttsn_topic_hash_find(ctx, topic_id);
+
+	if ((publish->flags & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS_1) {
+		/* Acknowledge, otherwise the gateway keeps it buffered while we sleep */
+		mqttsn_puback_t puback;
+
+		puback.topic_id = publish->topic_id;
+		puback.msg_id = mqttsn_htons(msg_id);
+		puback.return_code = (subscription < 0) ? MQTTSN_RC_INVALID_TOPIC : MQTTSN_RC_ACCEPTED;
+		mqttsn_send_buf(ctx, (char*)&puback, MQTTSN_PUBACK, sizeof(puback));
+	}
+
+	if (subscription < 0) {
 		ERROR("publish: unknown subscription ID\n");
 		return;
 	}
@@ -205,23 +430,27 @@ static void mqttsn_publish_handler(mqttsn_c_t *ctx, const char *buf, size_t size
 
 static void mqttsn_puback_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
-	mqttsn_publish_t *publish = (mqttsn_publish_t*)ctx->message;
 	mqttsn_puback_t *puback = (mqttsn_puback_t*)buf;
+	uint16_t msg_id;
+	unsigned int n;
 
 	if (size < sizeof(mqttsn_puback_t)) {
 		ERROR("puback: invalid size\n");
 		return;
 	}
 
-	if (ctx->state != mqttsnBusy) {
-		ERROR("puback in invalid state\n");
-		return;
+	/* Acks may arrive in any order */
+	msg_id = mqttsn_ntohs(puback->msg_id);
+	for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+		if (msg_id && ctx->inflight[n].msg_id == msg_id) {
+			break;
+		}
 	}
-
-	if (puback->msg_id != publish->msg_id /*|| puback->topic_id != publish->topic_id */) {
+	if (n == MQTTSN_MAX_INFLIGHT) {
 		ERROR("puback id mismatch\n");
 		return;
 	}
+	ctx->inflight[n].msg_id = 0;
 
 	if (puback->return_code != MQTTSN_RC_ACCEPTED) {
 		ERROR("publish not accepted: %u\n", puback->return_code);
@@ -230,58 +459,140 @@ static void mqttsn_puback_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 
 	/* Call back to application */
 	if (ctx->cb_puback) {
-		ctx->cb_puback(ctx, puback->msg_id, (puback->return_code == MQTTSN_RC_ACCEPTED) ? mqttsnOK : mqttsnError);
+		ctx->cb_puback(ctx, msg_id, (puback->return_code == MQTTSN_RC_ACCEPTED) ? mqttsnOK : mqttsnError);
 	}
-
-	mqttsn_to_state(ctx, mqttsnConnected);
 }
 
 static void mqttsn_disconnect_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
-	mqttsn_to_state(ctx, mqttsnDisconnected);
+	if (ctx->state == mqttsnDisconnecting && ctx->sleep_duration) {
+		/* Gateway has agreed to hold the session - wake before it gives up on us */
+		mqttsn_to_state(ctx, mqttsnAsleep);
+		ctx->next_ping = mqttsn_deadline(ctx, ctx->sleep_duration * 1000u);
+	} else {
+		if (ctx->state != mqttsnDisconnecting) {
+			/* Gateway has dropped the session (e.g. it restarted), so our topic
+			 * IDs mean nothing to it any more */
+			ctx->is_registered = 0;
+		}
+		mqttsn_to_state(ctx, mqttsnDisconnected);
+	}
+}
+
+static void mqttsn_pingresp_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
+{
+	if (ctx->state == mqttsnAwake) {
+		/* Everything buffered for us has been delivered */
+		mqttsn_to_state(ctx, mqttsnAsleep);
+		ctx->next_ping = mqttsn_deadline(ctx, ctx->sleep_duration * 1000u);
+	}
 }
 
-static void mqttsn_register(mqttsn_c_t *ctx, uint16_t msg_id, const char *topic)
+/* Send REGISTER or SUBSCRIBE for the topic at the specified index.  The msg_id is
+ * the index, and retries are built again from the topic table. */
+static void mqttsn_register(mqttsn_c_t *ctx, unsigned int index, int dup)
 {
-	mqttsn_register_t *reg = (mqttsn_register_t*)ctx->message;
+	const mqttsn_c_topic_t *topic = &ctx->topics[index];
+	char message[MQTTSN_MAX_PACKET];
+	size_t len;
+
+	if (topic->flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT)) {
+		len = 0;
+	} else {
+		len = strlen(topic->topic);
+		if (sizeof(mqttsn_register_t) + len > MQTTSN_MAX_PACKET) {
+			ERROR("Topic too long: %s\n", topic->topic);
+			return;
+		}
+	}
 
-	// FIXME: Check state?
+	if (topic->flags & MQTTSN_REG_SUBSCRIBE) {
+		mqttsn_subscribe_t *subscribe = (mqttsn_subscribe_t*)message;
+
+		TRACE("SUBSCRIBE: %s\n", topic->topic);
+		subscribe->flags = (topic->flags & MQTTSN_REG_QOS_MASK) ? MQTTSN_FLAG_QOS_1 : MQTTSN_FLAG_QOS_0;
+		subscribe->flags |= dup ? MQTTSN_FLAG_DUP : 0;
+		subscribe->msg_id = mqttsn_htons(index);
+		if (topic->flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT)) {
+			/* Subscribe by ID */
+			subscribe->flags |= (topic->flags & MQTTSN_REG_PREDEFINED) ?
+					MQTTSN_FLAG_TOPIC_ID_PRE : MQTTSN_FLAG_TOPIC_ID_SHORT;
+			subscribe->topic.topic_id = mqttsn_htons(ctx->topic_ids[index]);
+			len = sizeof(subscribe->topic.topic_id);
+		} else {
+			memcpy(subscribe->topic.topic_name, topic->topic, len);
+		}
+		mqttsn_send_buf(ctx, message, MQTTSN_SUBSCRIBE, offsetof(mqttsn_subscribe_t, topic) + len);
+	} else {
+		mqttsn_register_t *reg = (mqttsn_register_t*)message;
 
-	TRACE("REGISTER: %s\n", topic);
-	mqttsn_to_state(ctx, mqttsnBusy);
-	reg->topic_id = 0;
-	reg->msg_id = mqttsn_htons(msg_id);
-	strcpy(reg->topic_name, topic); // FIXME: bounds checking
-	mqttsn_send(ctx, MQTTSN_REGISTER, sizeof(mqttsn_register_t) + strlen(topic), 1);
+		TRACE("REGISTER: %s\n", topic->topic);
+		reg->topic_id = 0;
+		reg->msg_id = mqttsn_htons(index);
+		memcpy(reg->topic_name, topic->topic, len);
+		mqttsn_send_buf(ctx, message, MQTTSN_REGISTER, sizeof(mqttsn_register_t) + len);
+	}
 }
 
-static void mqttsn_subscribe(mqttsn_c_t *ctx, uint16_t msg_id, const char *topic, int qos)
+/* Keep up to MQTTSN_MAX_REG_INFLIGHT registrations going until the table is done */
+static void mqttsn_registration(mqttsn_c_t *ctx)
 {
-	mqttsn_subscribe_t *subscribe = (mqttsn_subscribe_t*)ctx->message;
+	unsigned int n, busy = 0;
+
+	for (n = 0; n < MQTTSN_MAX_REG_INFLIGHT; n++) {
+		mqttsn_c_reg_inflight_t *reg = &ctx->reg_inflight[n];
 
-	// FIXME: Check state?
+		/* Fill free slots with the next topics needing registration */
+		while (reg->index == MQTTSN_REG_FREE && ctx->count < MQTTSN_MAX_CLIENT_TOPICS &&
+				ctx->topics[ctx->count].topic != NULL) {
+			const mqttsn_c_topic_t *topic = &ctx->topics[ctx->count];
 
-	TRACE("SUBSCRIBE: %s\n", topic);
-	mqttsn_to_state(ctx, mqttsnBusy);
-	subscribe->flags = qos ? MQTTSN_FLAG_QOS_1 : MQTTSN_FLAG_QOS_0;
-	subscribe->msg_id = mqttsn_htons(msg_id);
-	strcpy(subscribe->topic.topic_name, topic); // FIXME: bounds checking
-	mqttsn_send(ctx, MQTTSN_SUBSCRIBE, sizeof(mqttsn_subscribe_t) + strlen(topic), 1);
+			if ((topic->flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT)) &&
+					!(topic->flags & MQTTSN_REG_SUBSCRIBE)) {
+				/* Nothing to send */
+				ctx->count++;
+				continue;
+			}
+			reg->index = ctx->count++;
+			reg->n_retries = MQTTSN_N_RETRY;
+			reg->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
+			mqttsn_register(ctx, reg->index, 0);
+		}
 
-	/* Set DUP bit in case we retry */
-	subscribe->flags |= MQTTSN_FLAG_DUP;
+		if (reg->index != MQTTSN_REG_FREE) {
+			busy++;
+		}
+	}
+
+	if (!busy) {
+		/* All done */
+		ctx->count = 0;
+		ctx->is_registered = 1;
+		mqttsn_to_state(ctx, mqttsnConnected);
+	}
 }
 
 int mqttsn_c_init(mqttsn_c_t *ctx, const char *client_id,
 	const mqttsn_c_topic_t *topics, mqttsn_c_send_callback_t cb_send)
 {
+	unsigned int n;
+
 	/* Initialise MQTT-SN state */
 	memset(ctx, 0, sizeof(mqttsn_c_t));
 	strncpy(ctx->client_id, client_id, sizeof(ctx->client_id));
 	ctx->cb_send = cb_send;
+	ctx->cb_clock = mqttsn_default_clock;
 
-	/* Initialise registration/subscription dictionary */
+	/* Initialise registration/subscription dictionary.  Pre-defined and short
+	 * topic IDs are known without registering. */
 	ctx->topics = topics;
+	for (n = 0; n < MQTTSN_MAX_CLIENT_TOPICS && topics[n].topic; n++) {
+		if (topics[n].flags & MQTTSN_REG_PREDEFINED) {
+			ctx->topic_ids[n] = topics[n].id;
+		} else if (topics[n].flags & MQTTSN_REG_SHORT) {
+			ctx->topic_ids[n] = ((uint16_t)(uint8_t)topics[n].topic[0] << 8) | (uint8_t)topics[n].topic[1];
+		}
+	}
 
 	return 0;
 }
@@ -296,19 +607,92 @@ void mqttsn_c_set_puback_callback(mqttsn_c_t *ctx, mqttsn_c_puback_callback_t cb
 	ctx->cb_puback = cb;
 }
 
+void mqttsn_c_set_clock(mqttsn_c_t *ctx, mqttsn_c_clock_t cb)
+{
+	ctx->cb_clock = cb ? cb : mqttsn_default_clock;
+}
+
+void mqttsn_c_set_sendv_callback(mqttsn_c_t *ctx, mqttsn_c_sendv_callback_t cb)
+{
+	ctx->cb_sendv = cb;
+}
+
+unsigned int mqttsn_c_publish_window(mqttsn_c_t *ctx)
+{
+	unsigned int n, count = 0;
+
+	for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+		if (!ctx->inflight[n].msg_id) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Remove entry n from the outbound queue */
+static void mqttsn_queue_remove(mqttsn_c_t *ctx, unsigned int n)
+{
+	ctx->n_queued--;
+	memmove(&ctx->queue[n], &ctx->queue[n + 1], (ctx->n_queued - n) * sizeof(mqttsn_c_queued_t));
+}
+
+/* Send queued publishes, oldest first, for as long as the client can take them */
+static void mqttsn_queue_drain(mqttsn_c_t *ctx)
+{
+	while (ctx->n_queued && ctx->state == mqttsnConnected) {
+		mqttsn_c_queued_t *queued = &ctx->queue[0];
+
+		if (queued->qos > 0 && !mqttsn_c_publish_window(ctx)) {
+			/* Wait for a PUBACK */
+			break;
+		}
+		if (!mqttsn_c_publish(ctx, queued->index, queued->qos, queued->data, queued->size)) {
+			break;
+		}
+		mqttsn_queue_remove(ctx, 0);
+	}
+}
+
+uint32_t mqttsn_c_next_deadline(mqttsn_c_t *ctx)
+{
+	uint32_t now = ctx->cb_clock();
+	uint32_t next = MQTTSN_C_NO_DEADLINE;
+	unsigned int n;
+
+	if (ctx->t_retry) {
+		next = mqttsn_earliest(now, ctx->t_retry, next);
+	}
+	for (n = 0; ctx->state == mqttsnRegistering && n < MQTTSN_MAX_REG_INFLIGHT; n++) {
+		if (ctx->reg_inflight[n].index != MQTTSN_REG_FREE) {
+			next = mqttsn_earliest(now, ctx->reg_inflight[n].t_retry, next);
+		}
+	}
+	for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+		if (ctx->inflight[n].msg_id) {
+			next = mqttsn_earliest(now, ctx->inflight[n].t_retry, next);
+		}
+	}
+	if (ctx->state == mqttsnConnected || ctx->state == mqttsnAsleep) {
+		next = mqttsn_earliest(now, ctx->next_ping, next);
+	}
+	return next;
+}
+
 void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 {
 	mqttsn_header_t *hdr;
+	uint32_t now = ctx->cb_clock();
+	unsigned int n;
 
 	hdr = (mqttsn_header_t*)ctx->message;
-	if (ctx->t_retry && get_seconds() >= ctx->t_retry) {
+	if (ctx->t_retry && mqttsn_expired(now, ctx->t_retry)) {
 		/* Re-send pending message */
 		if (ctx->n_retries) {
 			ctx->n_retries--;
-			ctx->t_retry = get_seconds() + MQTTSN_T_RETRY;
-			ctx->next_ping = get_seconds() + MQTTSN_KEEP_ALIVE;
+			ctx->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
+			ctx->next_ping = mqttsn_deadline(ctx, MQTTSN_KEEP_ALIVE * 1000u);
 			INFO("retrying send (0x%02X), %u remaining\n", hdr->msg_type, ctx->n_retries);
-			if (ctx->cb_send(ctx->message, hdr->length) < 0) {
+			if (mqttsn_transmit(ctx, ctx->message, hdr->length) < 0) {
 				ERROR("send failed\n");
 			}
 		} else {
@@ -318,14 +702,59 @@ void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 		}
 	}
 
+	/* Re-send registrations that have not been acknowledged */
+	for (n = 0; ctx->state == mqttsnRegistering && n < MQTTSN_MAX_REG_INFLIGHT; n++) {
+		mqttsn_c_reg_inflight_t *reg = &ctx->reg_inflight[n];
+
+		if (reg->index != MQTTSN_REG_FREE && mqttsn_expired(now, reg->t_retry)) {
+			if (reg->n_retries) {
+				reg->n_retries--;
+				reg->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
+				INFO("retrying registration (%u), %u remaining\n", reg->index, reg->n_retries);
+				mqttsn_register(ctx, reg->index, 1);
+			} else {
+				/* Give up */
+				ERROR("giving up\n");
+				mqttsn_to_state(ctx, mqttsnDisconnected);
+			}
+		}
+	}
+
+	/* Re-send publishes that have not been acknowledged */
+	for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+		mqttsn_c_inflight_t *inflight = &ctx->inflight[n];
+
+		if (inflight->msg_id && mqttsn_expired(now, inflight->t_retry)) {
+			if (inflight->n_retries) {
+				inflight->n_retries--;
+				inflight->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
+				INFO("retrying publish (%u), %u remaining\n", inflight->msg_id, inflight->n_retries);
+				if (mqttsn_send_publish(ctx, inflight->message,
+						inflight->data ? inflight->data : ((mqttsn_publish_t*)inflight->message)->data,
+						inflight->size - sizeof(mqttsn_publish_t)) < 0) {
+					ERROR("send failed\n");
+				}
+			} else {
+				/* Give up - the gateway has gone */
+				ERROR("giving up\n");
+				mqttsn_to_state(ctx, mqttsnDisconnected);
+				break;
+			}
+		}
+	}
+
 	/* Client must send something at least every KEEP_ALIVE period while connected */
-	if (ctx->state == mqttsnConnected && get_seconds() >= ctx->next_ping) {
+	if (ctx->state == mqttsnConnected && mqttsn_expired(now, ctx->next_ping)) {
 		/* Send PINGREQ to keep gateway happy */
-		/* FIXME: When waking from sleep this needs to include client_id */
 		TRACE("sending PINGREQ\n");
 		mqttsn_send(ctx, MQTTSN_PINGREQ, sizeof(mqttsn_pingreq_t), 0);
 	}
 
+	/* Sleeping client must check in before its sleep duration runs out */
+	if (ctx->state == mqttsnAsleep && mqttsn_expired(now, ctx->next_ping)) {
+		mqttsn_c_wake(ctx);
+	}
+
 	/* Process inbound packet */
 	hdr = (mqttsn_header_t*)buf;
 	if (buf && size >= sizeof(mqttsn_header_t) && size >= hdr->length) {
@@ -362,6 +791,10 @@ void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 			TRACE("SUBACK\n");
 			mqttsn_suback_handler(ctx, buf, size);
 			break;
+		case MQTTSN_PINGRESP:
+			TRACE("PINGRESP\n");
+			mqttsn_pingresp_handler(ctx, buf, size);
+			break;
 #if 0
 		case MQTTSN_UNSUBACK:
 			TRACE("UNSUBACK\n");
@@ -371,9 +804,6 @@ void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 			/* FIXME: Should probably use this (and other messages) to reset a server->client timer
 			 * so we can try to reconnect (or try another gateway) */
 			break;
-		case MQTTSN_PINGRESP:
-			TRACE("PINGRESP\n");
-			break;
 #endif
 		case MQTTSN_DISCONNECT:
 			TRACE("DISCONNECT\n");
@@ -386,35 +816,26 @@ void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size)
 
 	/* Handle registrations */
 	if (ctx->state == mqttsnRegistering) {
-		const mqttsn_c_topic_t *topic = &ctx->topics[ctx->count];
-		if (topic->topic == NULL) {
-			/* All done */
-			ctx->count = 0;
-			ctx->is_registered = 1;
-			mqttsn_to_state(ctx, mqttsnConnected);
-		} else {
-			/* Register/subscribe next */
-			if (topic->flags & MQTTSN_REG_SUBSCRIBE)
-				mqttsn_subscribe(ctx, ctx->count, ctx->topics[ctx->count].topic,
-					ctx->topics[ctx->count].flags & MQTTSN_REG_QOS_MASK);
-			else
-				mqttsn_register(ctx, ctx->count, ctx->topics[ctx->count].topic);
-			ctx->count++;
-		}
+		mqttsn_registration(ctx);
 	}
+
+	/* Send anything that was queued while we couldn't */
+	mqttsn_queue_drain(ctx);
 }
 
 void mqttsn_c_connect(mqttsn_c_t *ctx)
 {
 	mqttsn_connect_t *connect = (mqttsn_connect_t*)ctx->message;
 
-	if (ctx->state != mqttsnDisconnected) {
+	if (ctx->state != mqttsnDisconnected && ctx->state != mqttsnAsleep) {
 		ERROR("Already connected\n");
 		return;
 	}
 
-	//connect->flags = (!ctx->is_registered) ? MQTTSN_FLAG_CLEAN_SESSION : 0;
-	connect->flags = 0; /* Don't clean session otherwise we won't get sent any updates that occurring while we were asleep */
+	/* Resume the session if we have one, otherwise we won't get sent any updates that
+	 * occurred while we were asleep */
+	connect->flags = (!ctx->is_registered) ? MQTTSN_FLAG_CLEAN_SESSION : 0;
+	ctx->sleep_duration = 0;
 	connect->protocol_id = MQTTSN_PROTOCOL_ID;
 	connect->duration = mqttsn_htons(MQTTSN_KEEP_ALIVE);
 	strncpy(connect->client_id, ctx->client_id, MQTTSN_MAX_PACKET - sizeof(mqttsn_connect_t));
@@ -432,18 +853,52 @@ void mqttsn_c_disconnect(mqttsn_c_t *ctx, uint16_t duration)
 		return;
 	}
 	mqttsn_to_state(ctx, mqttsnDisconnecting);
+	ctx->sleep_duration = duration;
+	if (!duration) {
+		/* Session ends, so topics must be registered again next time */
+		ctx->is_registered = 0;
+	}
 
 	disconnect->duration = mqttsn_htons(duration);
 	mqttsn_send(ctx, MQTTSN_DISCONNECT, sizeof(mqttsn_header_t) +
 		(duration ? sizeof(disconnect->duration) : 0), 1); /* duration field is only sent by sleeping clients */
 }
 
-uint16_t mqttsn_c_publish(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size)
+void mqttsn_c_wake(mqttsn_c_t *ctx)
 {
-	mqttsn_publish_t *publish = (mqttsn_publish_t*)ctx->message;
+	mqttsn_pingreq_t *pingreq = (mqttsn_pingreq_t*)ctx->message;
+	size_t len = strlen(ctx->client_id);
+
+	if (ctx->state != mqttsnAsleep) {
+		ERROR("Not asleep\n");
+		return;
+	}
+
+	/* Client ID tells the gateway which parked session to deliver */
+	memcpy(pingreq->client_id, ctx->client_id, len);
+	TRACE("sending PINGREQ (wake)\n");
+	mqttsn_to_state(ctx, mqttsnAwake);
+	mqttsn_send(ctx, MQTTSN_PINGREQ, sizeof(mqttsn_pingreq_t) + len, 1);
+}
 
-	if (ctx->state != mqttsnConnected) {
-		ERROR("Not connected or busy\n");
+static uint16_t mqttsn_publish(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size,
+		boolean_t copy)
+{
+	char message[MQTTSN_MAX_PACKET];
+	mqttsn_c_inflight_t *inflight = NULL;
+	mqttsn_publish_t *publish;
+	uint8_t topic_flags = ctx->topics[topic_index].flags;
+	unsigned int n;
+
+	if (qos < 0) {
+		/* Connectionless - only for topics whose ID is known in advance */
+		if (!(topic_flags & (MQTTSN_REG_PREDEFINED | MQTTSN_REG_SHORT))) {
+			ERROR("QoS -1 needs a pre-defined or short topic\n");
+			return 0;
+		}
+	} else if (ctx->state != mqttsnConnected) {
+		/* Topic IDs aren't known until registration has finished */
+		ERROR("Not connected\n");
 		return 0;
 	}
 
@@ -452,30 +907,137 @@ uint16_t mqttsn_c_publish(mqttsn_c_t *ctx, unsigned int topic_index, int qos, co
 		return 0;
 	}
 
-	TRACE("PUBLISH: 0x%04X = %s (qos=%d)\n", ctx->topic_ids[topic_index], data, qos);
 	if (qos > 0) {
 		/* Only if we expect to get a PUBACK back, otherwise fire and forget */
-		mqttsn_to_state(ctx, mqttsnBusy);
+		for (n = 0; n < MQTTSN_MAX_INFLIGHT; n++) {
+			if (!ctx->inflight[n].msg_id) {
+				inflight = &ctx->inflight[n];
+				break;
+			}
+		}
+		if (!inflight) {
+			ERROR("Too many publishes in flight\n");
+			return 0;
+		}
 	}
 
-	/* Send first try (the only try for QoS 0)
+	TRACE("PUBLISH: 0x%04X = %.*s (qos=%d)\n", ctx->topic_ids[topic_index], (int)size, data, qos);
+
+	/* Send first try (the only try for QoS 0 and -1)
 	 * TODO:
-	 * Support for QoS -1 with pre-defined/short topics
 	 * Support for QoS 2
 	 */
-	publish->flags = MQTTSN_FLAG_TOPIC_ID_NORM | (qos ? MQTTSN_FLAG_QOS_1 : MQTTSN_FLAG_QOS_0);
+	publish = (mqttsn_publish_t*)(inflight ? inflight->message : message);
+	if (topic_flags & MQTTSN_REG_PREDEFINED) {
+		publish->flags = MQTTSN_FLAG_TOPIC_ID_PRE;
+	} else if (topic_flags & MQTTSN_REG_SHORT) {
+		publish->flags = MQTTSN_FLAG_TOPIC_ID_SHORT;
+	} else {
+		publish->flags = MQTTSN_FLAG_TOPIC_ID_NORM;
+	}
+	publish->flags |= (qos < 0) ? MQTTSN_FLAG_QOS_M1 : (qos ? MQTTSN_FLAG_QOS_1 : MQTTSN_FLAG_QOS_0);
 	publish->topic_id = mqttsn_htons(ctx->topic_ids[topic_index]);
-	ctx->next_id++; /* Pre-increment - 0 is used to indicate failure */
+	if (++ctx->next_id == 0) {
+		/* 0 is used to indicate failure */
+		ctx->next_id = 1;
+	}
 	publish->msg_id = mqttsn_htons(ctx->next_id);
-	memcpy(publish->data, data, size);
-	mqttsn_send(ctx, MQTTSN_PUBLISH, sizeof(mqttsn_publish_t) + size, qos);
+	if (inflight && copy) {
+		/* Keep our own copy for retries */
+		memcpy(publish->data, data, size);
+		data = publish->data;
+	}
+	mqttsn_send_publish(ctx, (char*)publish, data, size);
+
+	if (inflight) {
+		inflight->msg_id = ctx->next_id;
+		inflight->data = copy ? NULL : data;
+		inflight->size = sizeof(mqttsn_publish_t) + size;
+		inflight->n_retries = MQTTSN_N_RETRY;
+		inflight->t_retry = mqttsn_deadline(ctx, MQTTSN_C_T_RETRY_MS);
 
-	/* Set DUP bit in case we retry */
-	publish->flags |= MQTTSN_FLAG_DUP;
+		/* Set DUP bit in case we retry */
+		publish->flags |= MQTTSN_FLAG_DUP;
+	}
 
-	return publish->msg_id;
+	return ctx->next_id;
+}
+
+uint16_t mqttsn_c_publish(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size)
+{
+	return mqttsn_publish(ctx, topic_index, qos, data, size, TRUE);
+}
+
+uint16_t mqttsn_c_publish_nocopy(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size)
+{
+	return mqttsn_publish(ctx, topic_index, qos, data, size, FALSE);
 }
 
 mqttsn_c_state_t mqttsn_c_get_state(mqttsn_c_t* ctx) {
 	return ctx->state;
 }
+
+int mqttsn_c_queue(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size)
+{
+	const mqttsn_c_topic_t *topic = &ctx->topics[topic_index];
+	mqttsn_c_queued_t *queued = NULL;
+	unsigned int n, depth, count = 0;
+
+	if (size > sizeof(queued->data)) {
+		ERROR("Packet too large\n");
+		return -1;
+	}
+
+	/* Send straight away if nothing is waiting ahead of us */
+	if (qos < 0 || (ctx->n_queued == 0 && ctx->state == mqttsnConnected &&
+			(qos == 0 || mqttsn_c_publish_window(ctx)))) {
+		return mqttsn_c_publish(ctx, topic_index, qos, data, size) ? 0 : -1;
+	}
+
+	if (topic->flags & MQTTSN_REG_LATEST) {
+		/* Replace any older value, keeping its place in the queue */
+		for (n = 0; n < ctx->n_queued; n++) {
+			if (ctx->queue[n].index == topic_index) {
+				queued = &ctx->queue[n];
+				break;
+			}
+		}
+	} else {
+		/* Drop the oldest value for this topic if it has too many queued */
+		depth = topic->depth ? topic->depth : MQTTSN_QUEUE_DEPTH;
+		for (n = 0; n < ctx->n_queued; n++) {
+			if (ctx->queue[n].index == topic_index) {
+				count++;
+			}
+		}
+		for (n = 0; count >= depth && n < ctx->n_queued; ) {
+			if (ctx->queue[n].index == topic_index) {
+				INFO("dropping queued publish (%u)\n", topic_index);
+				mqttsn_queue_remove(ctx, n);
+				count--;
+			} else {
+				n++;
+			}
+		}
+	}
+
+	if (!queued) {
+		if (ctx->n_queued == MQTTSN_MAX_QUEUED) {
+			/* Full - the oldest data is the least useful, but keep the only
+			 * value of a LATEST topic if we can */
+			for (n = 0; n < ctx->n_queued - 1; n++) {
+				if (!(ctx->topics[ctx->queue[n].index].flags & MQTTSN_REG_LATEST)) {
+					break;
+				}
+			}
+			INFO("dropping queued publish (%u)\n", ctx->queue[n].index);
+			mqttsn_queue_remove(ctx, n);
+		}
+		queued = &ctx->queue[ctx->n_queued++];
+		queued->index = topic_index;
+	}
+	queued->qos = qos;
+	queued->size = size;
+	memcpy(queued->data, data, size);
+	return 0;
+}
@@ -30,22 +30,32 @@
 #include <stdint.h>
 
 #include "mqttsn.h"
+#include "phy.h"
 
 #if defined(__linux__) || defined(__APPLE__)
 #include <time.h>
-#define get_seconds()		time(NULL)
 #else
 typedef uint32_t time_t;
+/* Used by the default clock unless the application supplies one */
 extern uint32_t get_seconds();
 #endif
 
+/*! Time to wait for an acknowledgement before retrying, in milliseconds */
+#ifndef MQTTSN_C_T_RETRY_MS
+#define MQTTSN_C_T_RETRY_MS			(MQTTSN_T_RETRY * 1000)
+#endif
+
+/*! Returned by \see mqttsn_c_next_deadline when no timer is running */
+#define MQTTSN_C_NO_DEADLINE		UINT32_MAX
+
 typedef enum {
 	mqttsnDisconnected = 0,
 	mqttsnConnecting,
 	mqttsnRegistering,
 	mqttsnConnected,
-	mqttsnBusy,
 	mqttsnDisconnecting,
+	mqttsnAsleep,			/*< Session parked at the gateway (\see mqttsn_c_disconnect) */
+	mqttsnAwake,			/*< Collecting publishes buffered while asleep (\see mqttsn_c_wake) */
 } mqttsn_c_state_t;
 
 typedef enum {
@@ -53,21 +63,101 @@ typedef enum {
 	mqttsnError,
 } mqttsn_c_result_t;
 
+/*! Maximum number of QoS 1 publishes awaiting PUBACK */
+#ifndef MQTTSN_MAX_INFLIGHT
+#define MQTTSN_MAX_INFLIGHT			4
+#endif
+
+/*! Maximum number of REGISTER/SUBSCRIBE requests awaiting acknowledgement */
+#ifndef MQTTSN_MAX_REG_INFLIGHT
+#define MQTTSN_MAX_REG_INFLIGHT		4
+#endif
+
+/*! Number of slots in the table used to look up subscriptions by topic ID.  This
+ * must be larger than the number of subscriptions, and lookups stay fast while it is
+ * no more than half full. */
+#ifndef MQTTSN_TOPIC_HASH_LEN
+#define MQTTSN_TOPIC_HASH_LEN		(2 * MQTTSN_MAX_CLIENT_TOPICS)
+#endif
+
+/*! Number of publishes that can wait in the outbound queue (\see mqttsn_c_queue) */
+#ifndef MQTTSN_MAX_QUEUED
+#define MQTTSN_MAX_QUEUED			4
+#endif
+
+/*! Default limit on queued publishes for each FIFO topic */
+#ifndef MQTTSN_QUEUE_DEPTH
+#define MQTTSN_QUEUE_DEPTH			2
+#endif
+
 #define MQTTSN_REG_PUBLISH			(0 << 7)
 #define MQTTSN_REG_SUBSCRIBE		(1 << 7)
+#define MQTTSN_REG_PREDEFINED		(1 << 6)
+#define MQTTSN_REG_SHORT			(1 << 5)
+#define MQTTSN_REG_LATEST			(1 << 4)
 
 #define MQTTSN_REG_QOS_MASK			(3 << 0)
 
 typedef struct {
 	const char *topic;
 	uint8_t flags;
+	uint16_t id;				/*< Topic ID if MQTTSN_REG_PREDEFINED */
+	uint8_t depth;				/*< Queued publishes allowed (0 for MQTTSN_QUEUE_DEPTH) */
 } mqttsn_c_topic_t;
 
 #define PUBLISH(topic)				{ topic, MQTTSN_REG_PUBLISH}
 #define SUBSCRIBE(topic,qos)		{ topic, MQTTSN_REG_SUBSCRIBE | ((qos) & MQTTSN_REG_QOS_MASK) }
 
+/* Topics with IDs pre-defined at the gateway.  The name is for information only.
+ * Published topics need no registration, and subscriptions are made by ID. */
+#define PUBLISH_PREDEFINED(topic,id)		{ topic, MQTTSN_REG_PUBLISH | MQTTSN_REG_PREDEFINED, id }
+#define SUBSCRIBE_PREDEFINED(topic,id,qos)	{ topic, MQTTSN_REG_SUBSCRIBE | MQTTSN_REG_PREDEFINED | ((qos) & MQTTSN_REG_QOS_MASK), id }
+
+/* Topics with two character short names, which are used in place of a topic ID */
+#define PUBLISH_SHORT(topic)				{ topic, MQTTSN_REG_PUBLISH | MQTTSN_REG_SHORT }
+#define SUBSCRIBE_SHORT(topic,qos)			{ topic, MQTTSN_REG_SUBSCRIBE | MQTTSN_REG_SHORT | ((qos) & MQTTSN_REG_QOS_MASK) }
+
+/* Queue policies for published topics (\see mqttsn_c_queue).  Only the newest
+ * value of a LATEST topic is kept, which suits topics that carry state.  Other
+ * topics keep up to depth values in order and drop the oldest. */
+#define PUBLISH_LATEST(topic)				{ topic, MQTTSN_REG_PUBLISH | MQTTSN_REG_LATEST }
+#define PUBLISH_FIFO(topic,depth)			{ topic, MQTTSN_REG_PUBLISH, 0, depth }
+
+/*! REGISTER or SUBSCRIBE awaiting REGACK or SUBACK */
+typedef struct {
+	uint16_t				index;						/*< Index in topic table, or 0xffff if this slot is free */
+	uint8_t					n_retries;					/*< Number of retries remaining */
+	uint32_t				t_retry;					/*< Timeout for current attempt (ms) */
+} mqttsn_c_reg_inflight_t;
+
+/*! Outbound QoS 1 publish awaiting PUBACK */
+typedef struct {
+	uint16_t				msg_id;						/*< Message ID, or 0 if this slot is free */
+	uint8_t					size;						/*< Size of message */
+	uint8_t					n_retries;					/*< Number of retries remaining */
+	uint32_t				t_retry;					/*< Timeout for current attempt (ms) */
+	const char				*data;						/*< Payload held by the caller, or NULL if it is in message */
+	char					message[MQTTSN_MAX_PACKET];	/*< PUBLISH message (for retries) */
+} mqttsn_c_inflight_t;
+
+/*! Publish waiting in the outbound queue */
+typedef struct {
+	uint16_t				index;						/*< Index in topic table */
+	int8_t					qos;						/*< QoS level */
+	uint8_t					size;						/*< Size of data */
+	char					data[MQTTSN_MAX_PACKET - sizeof(mqttsn_publish_t)];
+} mqttsn_c_queued_t;
+
 struct mqttsn_c;
 
+/*!
+ * Monotonic clock used for all client timing.  It must never step backwards, but
+ * may wrap.
+ *
+ * \return				Time in milliseconds from an arbitrary epoch
+ */
+typedef uint32_t (*mqttsn_c_clock_t)(void);
+
 /*!
  * Called to send an outbound packet to the network - must be implemented
  *
@@ -77,6 +167,18 @@ struct mqttsn_c;
  */
 typedef int (*mqttsn_c_send_callback_t)(const char *buf, size_t size);
 
+/*!
+ * Called to send an outbound packet given as a list of fragments, which may be
+ * passed to the MAC as they are (e.g. with tinymac_sendv).  PUBLISH is sent as the
+ * MQTT-SN header followed by the payload where it already is, so the payload is
+ * not copied into a message buffer first.
+ *
+ * \param bufs			Fragments, in order
+ * \param nbufs			Number of fragments (at most 2)
+ * \return				Number of bytes actually sent, or -ve error code
+ */
+typedef int (*mqttsn_c_sendv_callback_t)(const phy_buf_t *bufs, unsigned int nbufs);
+
 /*!
  * Called when an inbound publish is received from the gateway
  *
@@ -101,20 +203,28 @@ typedef struct mqttsn_c {
 	unsigned int			count;						/*< General purpose counter used in some states */
 	char					message[MQTTSN_MAX_PACKET];	/*< Current outgoing message (where we may retry) */
 	unsigned int			n_retries;					/*< Number of retries remaining */
-	time_t					t_retry;					/*< Timeout for current attempt */
-	time_t					next_ping;					/*< Time for next PINGRESP to satisfy keep-alive */
+	uint32_t				t_retry;					/*< Timeout for current attempt (ms), or 0 */
+	uint32_t				next_ping;					/*< Time for next PINGREQ to satisfy keep-alive (ms) */
 	uint16_t				next_id;					/*< Message ID for next message */
+	mqttsn_c_inflight_t		inflight[MQTTSN_MAX_INFLIGHT];	/*< QoS 1 publishes awaiting PUBACK */
+	mqttsn_c_queued_t		queue[MQTTSN_MAX_QUEUED];	/*< Publishes waiting to be sent, oldest first */
+	unsigned int			n_queued;					/*< Number of entries in queue */
 
 	/* Topic registry */
 	const mqttsn_c_topic_t	*topics;					/*< Pointer to application supplied topic dictionary */
 	uint16_t				topic_ids[MQTTSN_MAX_CLIENT_TOPICS];
+	uint16_t				topic_hash[MQTTSN_TOPIC_HASH_LEN];	/*< Subscription index + 1 by topic ID (0 if empty) */
+	mqttsn_c_reg_inflight_t	reg_inflight[MQTTSN_MAX_REG_INFLIGHT];	/*< Registrations awaiting acknowledgement */
 	int						is_registered;				/*< Used for skipping registration if we were asleep */
+	uint16_t				sleep_duration;				/*< Sleep period requested on DISCONNECT (s), or 0 */
 
 	/* Config */
 	char					client_id[MQTTSN_MAX_CLIENT_ID];	/*< Client ID sent on connect */
 
 	/* Callbacks */
+	mqttsn_c_clock_t				cb_clock;
 	mqttsn_c_send_callback_t		cb_send;
+	mqttsn_c_sendv_callback_t		cb_sendv;
 	mqttsn_c_publish_callback_t	cb_publish;
 	mqttsn_c_puback_callback_t		cb_puback;
 } mqttsn_c_t;
@@ -125,7 +235,8 @@ typedef struct mqttsn_c {
  * \param	ctx			Pointer to driver context
  * \param	client_id	Pointer to string to be used as client ID when connecting
  * \param	topics		Pointer to array of topics for publish/subscribe
- * \param	cb_send		Callback to send an outgoing packet
+ * \param	cb_send		Callback to send an outgoing packet (may be NULL if
+ * 						\see mqttsn_c_set_sendv_callback is used instead)
  * \return				0 on success or -ve error code
  */
 int mqttsn_c_init(mqttsn_c_t *ctx, const char *client_id,
@@ -135,8 +246,37 @@ void mqttsn_c_set_publish_callback(mqttsn_c_t *ctx, mqttsn_c_publish_callback_t
 void mqttsn_c_set_puback_callback(mqttsn_c_t *ctx, mqttsn_c_puback_callback_t cb);
 
 /*!
- * State machine - must be called at minimum 1 second intervals or
- * when a new packet arrives
+ * Replace the clock used for retries and keep-alive.  The default is CLOCK_MONOTONIC
+ * on hosts, or get_seconds() on other targets.
+ */
+void mqttsn_c_set_clock(mqttsn_c_t *ctx, mqttsn_c_clock_t cb);
+
+/*!
+ * Send through a scatter-gather callback instead of the one given to
+ * \see mqttsn_c_init, which may then be NULL.  Pass NULL to go back to it.
+ */
+void mqttsn_c_set_sendv_callback(mqttsn_c_t *ctx, mqttsn_c_sendv_callback_t cb);
+
+/*!
+ * Returns the number of QoS 1 publishes that may be made before the in-flight
+ * window is full
+ */
+unsigned int mqttsn_c_publish_window(mqttsn_c_t *ctx);
+
+/*!
+ * Returns the time until a retry or keep-alive is next due, so the caller can sleep
+ * until then instead of polling.  This changes whenever the client sends, so ask
+ * again after each call into the client.
+ *
+ * \return				Milliseconds until \see mqttsn_c_handler must be called
+ * 						(0 if it is already due), or MQTTSN_C_NO_DEADLINE
+ */
+uint32_t mqttsn_c_next_deadline(mqttsn_c_t *ctx);
+
+/*!
+ * State machine - must be called when a new packet arrives, and when the time
+ * given by \see mqttsn_c_next_deadline has passed (or else at intervals no longer
+ * than the retry period)
  *
  * \param	ctx			Pointer to driver context
  * \param	buf			Pointer to incoming packet buffer (may be NULL if periodic call)
@@ -150,17 +290,73 @@ void mqttsn_c_handler(mqttsn_c_t *ctx, const char *buf, size_t size);
  */
 mqttsn_c_state_t mqttsn_c_get_state(mqttsn_c_t *ctx);
 
+/*!
+ * Connect to the gateway.  A client that has registered its topics before (including
+ * one that is asleep) resumes its session, otherwise it starts a clean one.
+ */
 void mqttsn_c_connect(mqttsn_c_t *ctx);
+
+/*!
+ * Disconnect from the gateway.  With a non-zero duration the session is parked at
+ * the gateway, which buffers publishes for us, and the client goes to mqttsnAsleep
+ * once the gateway agrees.  While asleep the client wakes by itself when the duration
+ * has passed (\see mqttsn_c_next_deadline) to keep the session alive.
+ *
+ * \param ctx			Pointer to driver context
+ * \param duration		Sleep duration in seconds, or 0 to end the session
+ */
 void mqttsn_c_disconnect(mqttsn_c_t *ctx, uint16_t duration);
 
 /*!
+ * Wake a sleeping client to collect buffered publishes.  This sends PINGREQ with the
+ * client ID, and the gateway replies with any buffered publishes followed by PINGRESP,
+ * at which point the client goes back to sleep.  To publish, connect instead.
+ */
+void mqttsn_c_wake(mqttsn_c_t *ctx);
+
+/*!
+ * Publish to a registered topic.  Up to MQTTSN_MAX_INFLIGHT QoS 1 publishes may
+ * be awaiting PUBACK at once, and completion of each is reported through the
+ * puback callback (\see mqttsn_c_set_puback_callback) in whatever order the
+ * gateway acknowledges them.
+ *
+ * QoS -1 publishes need no connection, so a sensor can send a reading without
+ * connecting first.  They are only possible for pre-defined and short topics.
+ *
  * \param ctx			Pointer to driver context
  * \param topic_index	Index of topic in registration table (supplied on init)
- * \param qos			QoS level (0 or 1) FIXME: support -1 and 2?
+ * \param qos			QoS level (-1, 0 or 1) FIXME: support 2?
  * \param data			Content to publish
  * \param size			Size of content
- * \return				Assigned message ID (serial number)
+ * \return				Assigned message ID (serial number), or 0 if not connected
+ * 						or the in-flight window is full
  */
 uint16_t mqttsn_c_publish(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size);
 
+/*!
+ * As \see mqttsn_c_publish, but a QoS 1 payload is not copied for retries.  The
+ * caller must keep the data unchanged until the puback callback has reported the
+ * result for the returned message ID.  With a sendv callback
+ * (\see mqttsn_c_set_sendv_callback) the payload is then never copied by the client.
+ */
+uint16_t mqttsn_c_publish_nocopy(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size);
+
+/*!
+ * Publish to a registered topic, or queue the publish if that cannot be done now
+ * because the client is not connected or the in-flight window is full.  Queued
+ * publishes are sent in order as soon as the client is connected again, subject
+ * to the topic's queue policy (\see PUBLISH_LATEST, \see PUBLISH_FIFO).  When the
+ * queue is full the oldest entry is dropped, preferring FIFO topics.
+ *
+ * Completion of QoS 1 publishes is reported through the puback callback as usual.
+ *
+ * \param ctx			Pointer to driver context
+ * \param topic_index	Index of topic in registration table (supplied on init)
+ * \param qos			QoS level (-1, 0 or 1).  QoS -1 is never queued.
+ * \param data			Content to publish
+ * \param size			Size of content
+ * \return				0 if sent or queued, or -ve error code
+ */
+int mqttsn_c_queue(mqttsn_c_t *ctx, unsigned int topic_index, int qos, const char *data, size_t size);
+
 #endif /* CLIENT_H_ */
@@ -0,0 +1,722 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * mqttsn-gateway.c
+ *
+ * MQTT-SN gateway engine
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "mqttsn.h"
+#include "mqttsn-gateway.h"
+
+typedef enum {
+	mqttsnGwDisconnected = 0,
+	mqttsnGwActive,
+	mqttsnGwAsleep,
+	mqttsnGwAwake,
+} mqttsn_gw_node_state_t;
+
+/*! Entry in the shared topic table.  Nodes use index + 1 as the topic ID. */
+typedef struct {
+	char					name[MQTTSN_GW_MAX_TOPIC_NAME];	/*< Empty if unused */
+	boolean_t				published;		/*< A node has registered this topic */
+	uint32_t				subscribers[MQTTSN_GW_MAX_NODES / 32];	/*< Bitmap of subscribing node addresses */
+} mqttsn_gw_topic_t;
+
+/*! Per-node MQTT-SN session */
+typedef struct {
+	mqttsn_gw_node_state_t	state;
+	uint16_t				duration;		/*< Asleep: sleep duration (s) */
+	uint32_t				t_expire;		/*< Asleep: time by which the node must wake */
+	uint8_t					n_held;			/*< Publishes held for the node */
+	char					client_id[MQTTSN_MAX_CLIENT_ID + 1];
+} mqttsn_gw_node_t;
+
+/*! Publish held for a sleeping node */
+typedef struct {
+	uint8_t					addr;			/*< Destination node */
+	uint8_t					size;			/*< Size of message, or 0 if unused */
+	uint32_t				seq;			/*< Order of arrival */
+	char					message[TINYMAC_MAX_PAYLOAD];	/*< Complete PUBLISH message */
+} mqttsn_gw_buffered_t;
+
+typedef struct {
+	mqttsn_gw_send_callback_t	cb_send;
+	const mqttsn_gw_backend_t	*backend;
+	void						*arg;
+	uint32_t					next_seq;
+	mqttsn_gw_topic_t			topics[MQTTSN_GW_MAX_TOPICS];
+	mqttsn_gw_node_t			nodes[MQTTSN_GW_MAX_NODES];
+	mqttsn_gw_buffered_t		buffered[MQTTSN_GW_MAX_BUFFERED];
+} mqttsn_gw_t;
+
+static mqttsn_gw_t mqttsn_gw_;
+static mqttsn_gw_t *mqttsn_gw = &mqttsn_gw_;
+
+#define TOPIC_INDEX(topic)				((unsigned int)((topic) - mqttsn_gw->topics))
+#define TOPIC_LOCAL_ID(topic)			(TOPIC_INDEX(topic) + 1)
+
+/*! Monotonic time in seconds, for sleep timeouts */
+static uint32_t mqttsn_gw_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec;
+}
+
+/*
+ * Topic table
+ */
+
+static boolean_t topic_has_subscribers(const mqttsn_gw_topic_t *topic)
+{
+	unsigned int n;
+
+	for (n = 0; n < ARRAY_SIZE(topic->subscribers); n++) {
+		if (topic->subscribers[n]) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static boolean_t topic_is_subscriber(const mqttsn_gw_topic_t *topic, uint8_t addr)
+{
+	return (topic->subscribers[addr / 32] & (1u << (addr % 32))) ? TRUE : FALSE;
+}
+
+static void topic_set_subscriber(mqttsn_gw_topic_t *topic, uint8_t addr, boolean_t subscribe)
+{
+	if (subscribe) {
+		topic->subscribers[addr / 32] |= (1u << (addr % 32));
+	} else {
+		topic->subscribers[addr / 32] &= ~(1u << (addr % 32));
+	}
+}
+
+/*! Find a topic by name, optionally adding it if it isn't in the table */
+static mqttsn_gw_topic_t* topic_find_name(const char *name, size_t len, boolean_t add)
+{
+	mqttsn_gw_topic_t *free_topic = NULL;
+	unsigned int n;
+
+	if (len == 0 || len >= MQTTSN_GW_MAX_TOPIC_NAME) {
+		return NULL;
+	}
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		mqttsn_gw_topic_t *topic = &mqttsn_gw->topics[n];
+
+		if (topic->name[0] == '\0') {
+			if (!free_topic) {
+				free_topic = topic;
+			}
+		} else if (strncmp(topic->name, name, len) == 0 && topic->name[len] == '\0') {
+			return topic;
+		}
+	}
+	if (add && free_topic) {
+		memset(free_topic, 0, sizeof(mqttsn_gw_topic_t));
+		memcpy(free_topic->name, name, len);
+		return free_topic;
+	}
+	return NULL;
+}
+
+static mqttsn_gw_topic_t* topic_find_local_id(uint16_t id)
+{
+	if (id == 0 || id > MQTTSN_GW_MAX_TOPICS || mqttsn_gw->topics[id - 1].name[0] == '\0') {
+		return NULL;
+	}
+	return &mqttsn_gw->topics[id - 1];
+}
+
+/*
+ * Node side
+ */
+
+static int node_send(uint8_t addr, char *buf, uint8_t msg_type, size_t size)
+{
+	mqttsn_header_t *hdr = (mqttsn_header_t*)buf;
+
+	hdr->length = size;
+	hdr->msg_type = msg_type;
+	return mqttsn_gw->cb_send(addr, buf, size);
+}
+
+static void node_puback(uint8_t addr, uint16_t topic_id, uint16_t msg_id, uint8_t return_code)
+{
+	mqttsn_puback_t puback;
+
+	puback.topic_id = mqttsn_htons(topic_id);
+	puback.msg_id = msg_id;
+	puback.return_code = return_code;
+	node_send(addr, (char*)&puback, MQTTSN_PUBACK, sizeof(puback));
+}
+
+/*! Hold a publish for a sleeping node, dropping the oldest held publish if full */
+static void node_buffer(uint8_t addr, const char *buf, size_t size)
+{
+	mqttsn_gw_buffered_t *entry = NULL;
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_GW_MAX_BUFFERED; n++) {
+		mqttsn_gw_buffered_t *b = &mqttsn_gw->buffered[n];
+
+		if (!b->size) {
+			entry = b;
+			break;
+		}
+		if (!entry || (int32_t)(b->seq - entry->seq) < 0) {
+			entry = b;
+		}
+	}
+	if (entry->size) {
+		INFO("dropping held publish for node %02X\n", entry->addr);
+		mqttsn_gw->nodes[entry->addr].n_held--;
+	}
+	mqttsn_gw->nodes[addr].n_held++;
+	entry->addr = addr;
+	entry->size = size;
+	entry->seq = mqttsn_gw->next_seq++;
+	memcpy(entry->message, buf, size);
+}
+
+/*!
+ * Send what is held for a node, oldest first, for as long as the node can take it.
+ * A sleepy tinymac node only takes one packet per poll, so the rest stay held and
+ * are sent from \see mqttsn_gw_periodic.
+ *
+ * \return			TRUE once nothing is held
+ */
+static boolean_t node_flush(uint8_t addr)
+{
+	mqttsn_gw_node_t *node = &mqttsn_gw->nodes[addr];
+
+	while (node->n_held) {
+		mqttsn_gw_buffered_t *entry = NULL;
+		unsigned int n;
+
+		for (n = 0; n < MQTTSN_GW_MAX_BUFFERED; n++) {
+			mqttsn_gw_buffered_t *b = &mqttsn_gw->buffered[n];
+
+			if (b->size && b->addr == addr && (!entry || (int32_t)(b->seq - entry->seq) < 0)) {
+				entry = b;
+			}
+		}
+		if (!entry) {
+			/* Not expected - the count is out of step */
+			node->n_held = 0;
+			break;
+		}
+		if (mqttsn_gw->cb_send(addr, entry->message, entry->size) < 0) {
+			return FALSE;
+		}
+		entry->size = 0;
+		node->n_held--;
+	}
+	return TRUE;
+}
+
+/*!
+ * Finish waking a sleeping node.  PINGRESP tells the node that it has everything,
+ * so it is only sent once all the held publishes have gone.
+ */
+static void node_wake_continue(uint8_t addr)
+{
+	mqttsn_gw_node_t *node = &mqttsn_gw->nodes[addr];
+	mqttsn_pingresp_t pingresp;
+
+	if (!node_flush(addr) || node_send(addr, (char*)&pingresp, MQTTSN_PINGRESP, sizeof(pingresp)) < 0) {
+		/* Node busy - carry on from mqttsn_gw_periodic */
+		return;
+	}
+	node->state = mqttsnGwAsleep;
+	node->t_expire = mqttsn_gw_seconds() + node->duration + node->duration / 2;
+}
+
+/*! Drop a node's session, subscriptions and held publishes */
+static void node_clear(uint8_t addr)
+{
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		topic_set_subscriber(&mqttsn_gw->topics[n], addr, FALSE);
+	}
+	for (n = 0; n < MQTTSN_GW_MAX_BUFFERED; n++) {
+		if (mqttsn_gw->buffered[n].addr == addr) {
+			mqttsn_gw->buffered[n].size = 0;
+		}
+	}
+	memset(&mqttsn_gw->nodes[addr], 0, sizeof(mqttsn_gw_node_t));
+}
+
+/*
+ * Node message handlers
+ */
+
+static void node_connect_handler(uint8_t addr, const char *buf, size_t size)
+{
+	const mqttsn_connect_t *connect = (const mqttsn_connect_t*)buf;
+	mqttsn_gw_node_t *node = &mqttsn_gw->nodes[addr];
+	mqttsn_connack_t connack;
+	size_t len;
+
+	if (size < sizeof(mqttsn_connect_t)) {
+		return;
+	}
+	if (connect->flags & MQTTSN_FLAG_CLEAN_SESSION) {
+		node_clear(addr);
+	}
+	len = size - sizeof(mqttsn_connect_t);
+	if (len > MQTTSN_MAX_CLIENT_ID) {
+		len = MQTTSN_MAX_CLIENT_ID;
+	}
+	memcpy(node->client_id, connect->client_id, len);
+	node->client_id[len] = '\0';
+	node->state = mqttsnGwActive;
+	INFO("node %02X connected as %s\n", addr, node->client_id);
+
+	connack.return_code = MQTTSN_RC_ACCEPTED;
+	node_send(addr, (char*)&connack, MQTTSN_CONNACK, sizeof(connack));
+
+	/* Anything that arrived while it was asleep */
+	node_flush(addr);
+}
+
+static void node_register_handler(uint8_t addr, const char *buf, size_t size)
+{
+	const mqttsn_register_t *reg = (const mqttsn_register_t*)buf;
+	const mqttsn_gw_backend_t *backend = mqttsn_gw->backend;
+	mqttsn_regack_t regack;
+	mqttsn_gw_topic_t *topic;
+	boolean_t added = FALSE;
+
+	if (size < sizeof(mqttsn_register_t)) {
+		return;
+	}
+	topic = topic_find_name(reg->topic_name, size - sizeof(mqttsn_register_t), TRUE);
+
+	/* The ID is ours to assign, so there is no need to wait for the backend */
+	regack.msg_id = reg->msg_id;
+	if (topic) {
+		added = !topic->published;
+		topic->published = TRUE;
+		regack.topic_id = mqttsn_htons(TOPIC_LOCAL_ID(topic));
+		regack.return_code = MQTTSN_RC_ACCEPTED;
+	} else {
+		regack.topic_id = 0;
+		regack.return_code = (size - sizeof(mqttsn_register_t) >= MQTTSN_GW_MAX_TOPIC_NAME) ?
+				MQTTSN_RC_INVALID_TOPIC : MQTTSN_RC_CONGESTION;
+	}
+	node_send(addr, (char*)&regack, MQTTSN_REGACK, sizeof(regack));
+
+	if (added && backend->topic_added) {
+		backend->topic_added(mqttsn_gw->arg, TOPIC_INDEX(topic), topic->name);
+	}
+}
+
+static void node_subscribe_handler(uint8_t addr, const char *buf, size_t size, boolean_t subscribe)
+{
+	const mqttsn_subscribe_t *sub = (const mqttsn_subscribe_t*)buf;
+	const mqttsn_gw_backend_t *backend = mqttsn_gw->backend;
+	mqttsn_gw_topic_t *topic = NULL;
+	boolean_t first = FALSE;
+
+	if (size < offsetof(mqttsn_subscribe_t, topic)) {
+		return;
+	}
+	switch (sub->flags & MQTTSN_FLAG_TOPIC_ID_MASK) {
+	case MQTTSN_FLAG_TOPIC_ID_NORM:
+		topic = topic_find_name(sub->topic.topic_name, size - offsetof(mqttsn_subscribe_t, topic), subscribe);
+		break;
+	case MQTTSN_FLAG_TOPIC_ID_PRE:
+		if (size >= sizeof(mqttsn_subscribe_t)) {
+			topic = topic_find_local_id(mqttsn_ntohs(sub->topic.topic_id));
+		}
+		break;
+	default:
+		/* Short topic names not supported */
+		break;
+	}
+	if (topic) {
+		first = subscribe && !topic_has_subscribers(topic);
+		topic_set_subscriber(topic, addr, subscribe);
+	}
+
+	if (subscribe) {
+		mqttsn_suback_t suback;
+
+		/* Delivery to nodes is always at QoS 0 */
+		suback.flags = MQTTSN_FLAG_QOS_0;
+		suback.topic_id = topic ? mqttsn_htons(TOPIC_LOCAL_ID(topic)) : 0;
+		suback.msg_id = sub->msg_id;
+		suback.return_code = topic ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_INVALID_TOPIC;
+		node_send(addr, (char*)&suback, MQTTSN_SUBACK, sizeof(suback));
+
+		if (first && backend->subscribe) {
+			backend->subscribe(mqttsn_gw->arg, TOPIC_INDEX(topic), topic->name);
+		}
+	} else {
+		mqttsn_unsuback_t unsuback;
+
+		/* The backend subscription is kept, in case another node subscribes again */
+		unsuback.msg_id = sub->msg_id;
+		node_send(addr, (char*)&unsuback, MQTTSN_UNSUBACK, sizeof(unsuback));
+	}
+}
+
+static void node_publish_handler(uint8_t addr, const char *buf, size_t size)
+{
+	const mqttsn_publish_t *publish = (const mqttsn_publish_t*)buf;
+	const mqttsn_gw_backend_t *backend = mqttsn_gw->backend;
+	boolean_t retain = (publish->flags & MQTTSN_FLAG_RETAIN) ? TRUE : FALSE;
+	uint8_t id_type;
+	uint16_t topic_id;
+	mqttsn_gw_topic_t *topic;
+	size_t len;
+
+	if (size < sizeof(mqttsn_publish_t)) {
+		return;
+	}
+	len = size - sizeof(mqttsn_publish_t);
+	topic_id = mqttsn_ntohs(publish->topic_id);
+	id_type = publish->flags & MQTTSN_FLAG_TOPIC_ID_MASK;
+	topic = (id_type == MQTTSN_FLAG_TOPIC_ID_NORM) ? topic_find_local_id(topic_id) : NULL;
+
+	if ((publish->flags & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS_1) {
+		mqttsn_gw_ref_t ref;
+
+		if (!topic) {
+			node_puback(addr, topic_id, publish->msg_id, MQTTSN_RC_INVALID_TOPIC);
+			return;
+		}
+		ref.addr = addr;
+		ref.topic_id = topic_id;
+		ref.msg_id = publish->msg_id;
+		if (backend->publish(mqttsn_gw->arg, TOPIC_INDEX(topic), topic->name, 1, retain,
+				&ref, publish->data, len) < 0) {
+			node_puback(addr, topic_id, publish->msg_id, MQTTSN_RC_CONGESTION);
+		}
+	} else if (id_type != MQTTSN_FLAG_TOPIC_ID_NORM) {
+		/* Pre-defined and short topic IDs need no session, so a node can wake,
+		 * publish at QoS -1 and sleep */
+		if (backend->publish_id) {
+			backend->publish_id(mqttsn_gw->arg, id_type, topic_id, publish->data, len);
+		}
+	} else if (topic) {
+		/* QoS 0 - if the backend can't take it, it is lost */
+		backend->publish(mqttsn_gw->arg, TOPIC_INDEX(topic), topic->name, 0, retain,
+				NULL, publish->data, len);
+	} else {
+		/* Unknown topic ID - tell the node so that it registers again */
+		node_puback(addr, topic_id, publish->msg_id, MQTTSN_RC_INVALID_TOPIC);
+	}
+}
+
+static void node_pingreq_handler(uint8_t addr, const char *buf, size_t size)
+{
+	mqttsn_gw_node_t *node = &mqttsn_gw->nodes[addr];
+	mqttsn_pingresp_t pingresp;
+
+	if (size > sizeof(mqttsn_pingreq_t) &&
+			(node->state == mqttsnGwAsleep || node->state == mqttsnGwAwake)) {
+		/* Client ID means a sleeping node has woken to collect what we are holding
+		 * (or is asking again because the wake-up hasn't finished) */
+		node->state = mqttsnGwAwake;
+		node->t_expire = mqttsn_gw_seconds() + node->duration + node->duration / 2;
+		node_wake_continue(addr);
+		return;
+	}
+	if (node->state == mqttsnGwAsleep) {
+		/* Any sign of life from a sleeping node restarts its timer */
+		node->t_expire = mqttsn_gw_seconds() + node->duration + node->duration / 2;
+	}
+	node_send(addr, (char*)&pingresp, MQTTSN_PINGRESP, sizeof(pingresp));
+}
+
+static void node_disconnect_handler(uint8_t addr, const char *buf, size_t size)
+{
+	const mqttsn_disconnect_t *req = (const mqttsn_disconnect_t*)buf;
+	mqttsn_gw_node_t *node = &mqttsn_gw->nodes[addr];
+	mqttsn_disconnect_t disconnect;
+
+	if (size < sizeof(mqttsn_disconnect_t)) {
+		/* Leaving for good */
+		node_clear(addr);
+	} else {
+		/* Going to sleep.  Subscriptions are kept and publishes held until it wakes,
+		 * or until it has been silent for half as long again as it said. */
+		node->state = mqttsnGwAsleep;
+		node->duration = mqttsn_ntohs(req->duration);
+		node->t_expire = mqttsn_gw_seconds() + node->duration + node->duration / 2;
+		INFO("node %02X asleep for %u s\n", addr, node->duration);
+	}
+	node_send(addr, (char*)&disconnect, MQTTSN_DISCONNECT, sizeof(mqttsn_header_t));
+}
+
+/*! Whether a packet is only meaningful within a session.  QoS -1 publishes to
+ * pre-defined and short topic IDs are the exception.  A PINGREQ with a client ID
+ * is a sleeping node waking, which must not be told all is well if its session
+ * has gone. */
+static boolean_t node_needs_session(const char *buf, size_t size)
+{
+	const mqttsn_header_t *hdr = (const mqttsn_header_t*)buf;
+	const mqttsn_publish_t *publish = (const mqttsn_publish_t*)buf;
+
+	switch (hdr->msg_type) {
+	case MQTTSN_REGISTER:
+	case MQTTSN_SUBSCRIBE:
+	case MQTTSN_UNSUBSCRIBE:
+		return TRUE;
+	case MQTTSN_PUBLISH:
+		return size >= sizeof(mqttsn_publish_t) &&
+				((publish->flags & MQTTSN_FLAG_TOPIC_ID_MASK) == MQTTSN_FLAG_TOPIC_ID_NORM ||
+				(publish->flags & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS_1);
+	case MQTTSN_PINGREQ:
+		return size > sizeof(mqttsn_pingreq_t);
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Public API
+ */
+
+int mqttsn_gw_init(mqttsn_gw_send_callback_t cb_send, const mqttsn_gw_backend_t *backend, void *arg)
+{
+	if (!cb_send || !backend || !backend->publish) {
+		return -1;
+	}
+
+	memset(mqttsn_gw, 0, sizeof(mqttsn_gw_t));
+	mqttsn_gw->cb_send = cb_send;
+	mqttsn_gw->backend = backend;
+	mqttsn_gw->arg = arg;
+	return 0;
+}
+
+void mqttsn_gw_handler(uint8_t addr, const char *buf, size_t size)
+{
+	const mqttsn_header_t *hdr = (const mqttsn_header_t*)buf;
+
+	if (size < sizeof(mqttsn_header_t) || hdr->length > size || hdr->length < sizeof(mqttsn_header_t)) {
+		return;
+	}
+	size = hdr->length;
+
+	if (mqttsn_gw->nodes[addr].state == mqttsnGwDisconnected && node_needs_session(buf, size)) {
+		/* Most likely we have restarted and lost its topic IDs - make it connect and
+		 * register again rather than misroute them */
+		mqttsn_header_t disconnect;
+
+		INFO("node %02X has no session\n", addr);
+		node_send(addr, (char*)&disconnect, MQTTSN_DISCONNECT, sizeof(disconnect));
+		return;
+	}
+
+	switch (hdr->msg_type) {
+	case MQTTSN_CONNECT:
+		node_connect_handler(addr, buf, size);
+		break;
+	case MQTTSN_REGISTER:
+		node_register_handler(addr, buf, size);
+		break;
+	case MQTTSN_SUBSCRIBE:
+		node_subscribe_handler(addr, buf, size, TRUE);
+		break;
+	case MQTTSN_UNSUBSCRIBE:
+		node_subscribe_handler(addr, buf, size, FALSE);
+		break;
+	case MQTTSN_PUBLISH:
+		node_publish_handler(addr, buf, size);
+		break;
+	case MQTTSN_PINGREQ:
+		node_pingreq_handler(addr, buf, size);
+		break;
+	case MQTTSN_DISCONNECT:
+		node_disconnect_handler(addr, buf, size);
+		break;
+	case MQTTSN_PUBACK:
+	case MQTTSN_REGACK:
+		/* Publishes to nodes are QoS 0, and we never need to register with them */
+		break;
+	default:
+		ERROR("unexpected message type 0x%02X from node %02X\n", hdr->msg_type, addr);
+	}
+}
+
+void mqttsn_gw_node_lost(uint8_t addr)
+{
+	node_clear(addr);
+}
+
+void mqttsn_gw_periodic(void)
+{
+	const mqttsn_gw_backend_t *backend = mqttsn_gw->backend;
+	uint32_t now = mqttsn_gw_seconds();
+	unsigned int n;
+
+	for (n = 0; n < MQTTSN_GW_MAX_NODES; n++) {
+		mqttsn_gw_node_t *node = &mqttsn_gw->nodes[n];
+
+		if ((node->state == mqttsnGwAsleep || node->state == mqttsnGwAwake) &&
+				(int32_t)(now - node->t_expire) >= 0) {
+			INFO("node %02X did not wake - session lost\n", n);
+			node_clear(n);
+		} else if (node->state == mqttsnGwAwake) {
+			node_wake_continue(n);
+		} else if (node->state == mqttsnGwActive && node->n_held) {
+			node_flush(n);
+		}
+	}
+
+	if (backend->periodic) {
+		backend->periodic(mqttsn_gw->arg);
+	}
+}
+
+void mqttsn_gw_deliver(unsigned int index, const char *data, size_t size, boolean_t retain)
+{
+	mqttsn_gw_topic_t *topic;
+	char out[TINYMAC_MAX_PAYLOAD];
+	mqttsn_publish_t *publish = (mqttsn_publish_t*)out;
+	unsigned int n;
+
+	if (index >= MQTTSN_GW_MAX_TOPICS || mqttsn_gw->topics[index].name[0] == '\0') {
+		ERROR("deliver: unknown topic\n");
+		return;
+	}
+	topic = &mqttsn_gw->topics[index];
+	if (sizeof(mqttsn_publish_t) + size > sizeof(out)) {
+		ERROR("deliver: too large for nodes\n");
+		return;
+	}
+
+	/* Fan out to subscribers at QoS 0 */
+	publish->header.length = sizeof(mqttsn_publish_t) + size;
+	publish->header.msg_type = MQTTSN_PUBLISH;
+	publish->flags = MQTTSN_FLAG_QOS_0 | MQTTSN_FLAG_TOPIC_ID_NORM | (retain ? MQTTSN_FLAG_RETAIN : 0);
+	publish->topic_id = mqttsn_htons(TOPIC_LOCAL_ID(topic));
+	publish->msg_id = 0;
+	memcpy(publish->data, data, size);
+	for (n = 0; n < MQTTSN_GW_MAX_NODES; n++) {
+		if (topic_is_subscriber(topic, n)) {
+			const mqttsn_gw_node_t *node = &mqttsn_gw->nodes[n];
+
+			/* Held publishes must go first, and a node that is busy now gets it
+			 * from mqttsn_gw_periodic */
+			if (node->state == mqttsnGwAsleep || node->state == mqttsnGwAwake || node->n_held ||
+					mqttsn_gw->cb_send(n, out, publish->header.length) < 0) {
+				node_buffer(n, out, publish->header.length);
+			}
+		}
+	}
+}
+
+void mqttsn_gw_puback(const mqttsn_gw_ref_t *ref, uint8_t return_code)
+{
+	node_puback(ref->addr, ref->topic_id, ref->msg_id, return_code);
+}
+
+const char* mqttsn_gw_topic(unsigned int index, boolean_t *published, boolean_t *subscribed)
+{
+	mqttsn_gw_topic_t *topic;
+
+	if (index >= MQTTSN_GW_MAX_TOPICS || mqttsn_gw->topics[index].name[0] == '\0') {
+		return NULL;
+	}
+	topic = &mqttsn_gw->topics[index];
+	if (published) {
+		*published = topic->published;
+	}
+	if (subscribed) {
+		*subscribed = topic_has_subscribers(topic);
+	}
+	return topic->name;
+}
+
+int mqttsn_gw_find_topic(const char *name)
+{
+	mqttsn_gw_topic_t *topic = topic_find_name(name, strlen(name), FALSE);
+
+	return topic ? (int)TOPIC_INDEX(topic) : -1;
+}
+
+void mqttsn_gw_dump(void)
+{
+	static const char *states[] = { "disconnected", "active", "asleep", "awake" };
+	unsigned int n, m, count;
+
+	printf("ID   Subscribers Topic\n");
+	for (n = 0; n < MQTTSN_GW_MAX_TOPICS; n++) {
+		const mqttsn_gw_topic_t *topic = &mqttsn_gw->topics[n];
+
+		if (topic->name[0] == '\0') {
+			continue;
+		}
+		for (m = 0, count = 0; m < MQTTSN_GW_MAX_NODES; m++) {
+			if (topic_is_subscriber(topic, m)) {
+				count++;
+			}
+		}
+		printf("%04X %-11u %s\n", n + 1, count, topic->name);
+	}
+
+	printf("Node State        Held Client ID\n");
+	for (n = 0; n < MQTTSN_GW_MAX_NODES; n++) {
+		const mqttsn_gw_node_t *node = &mqttsn_gw->nodes[n];
+
+		if (node->state == mqttsnGwDisconnected) {
+			continue;
+		}
+		for (m = 0, count = 0; m < MQTTSN_GW_MAX_BUFFERED; m++) {
+			if (mqttsn_gw->buffered[m].size && mqttsn_gw->buffered[m].addr == n) {
+				count++;
+			}
+		}
+		printf("%02X   %-12s %-4u %s\n", n, states[node->state], count, node->client_id);
+	}
+}
+
+/*
+ * Local backend
+ */
+
+static int mqttsn_gw_local_publish(void *arg, unsigned int index, const char *name, int qos, boolean_t retain,
+		const mqttsn_gw_ref_t *ref, const char *data, size_t size)
+{
+	/* Back out to whoever has subscribed, then acknowledge */
+	mqttsn_gw_deliver(index, data, size, retain);
+	if (ref) {
+		mqttsn_gw_puback(ref, MQTTSN_RC_ACCEPTED);
+	}
+	return 0;
+}
+
+const mqttsn_gw_backend_t mqttsn_gw_local_backend = {
+	.publish = mqttsn_gw_local_publish,
+};
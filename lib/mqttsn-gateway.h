@@ -0,0 +1,203 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * mqttsn-gateway.h
+ *
+ * MQTT-SN gateway engine.  This terminates MQTT-SN sessions from the nodes on a
+ * tinymac network, which are identified by their MAC addresses.
+ *
+ * CONNECT, PINGREQ and DISCONNECT are answered here.  Topic names registered or
+ * subscribed by any node go into one shared table, and the table index + 1 is the
+ * topic ID given to every node.  Publishes from nodes are passed to a backend
+ * (\see mqttsn_gw_backend_t), which may bridge to a broker or stand in for one,
+ * and the backend passes publishes for the nodes back (\see mqttsn_gw_deliver).
+ * Publishes for sleeping nodes are held until they wake.  Packets that need a
+ * session, from nodes that have none, are answered with DISCONNECT.
+ *
+ */
+
+#ifndef MQTTSN_GATEWAY_H_
+#define MQTTSN_GATEWAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "tinymac.h"
+#include "mqttsn.h"
+
+/*! Number of topics in the shared table */
+#ifndef MQTTSN_GW_MAX_TOPICS
+#define MQTTSN_GW_MAX_TOPICS			64
+#endif
+
+/*! Longest topic name that can be registered */
+#ifndef MQTTSN_GW_MAX_TOPIC_NAME
+#define MQTTSN_GW_MAX_TOPIC_NAME		48
+#endif
+
+/*! Number of publishes that can be held for sleeping nodes (shared by all nodes) */
+#ifndef MQTTSN_GW_MAX_BUFFERED
+#define MQTTSN_GW_MAX_BUFFERED			64
+#endif
+
+/*! Number of node addresses */
+#define MQTTSN_GW_MAX_NODES				256
+
+/*! Identifies a QoS 1 publish from a node, so the result can be returned to it */
+typedef struct {
+	uint8_t					addr;		/*< Node address */
+	uint16_t				topic_id;	/*< Topic ID used by the node */
+	uint16_t				msg_id;		/*< Message ID from the node (network order) */
+} mqttsn_gw_ref_t;
+
+/*!
+ * Where publishes from nodes go.  Any callback except publish may be NULL.
+ */
+typedef struct {
+	/*!
+	 * A node has registered a new topic to publish to
+	 *
+	 * \param arg		Argument passed to \see mqttsn_gw_init
+	 * \param index		Index in topic table
+	 * \param name		Topic name
+	 */
+	void (*topic_added)(void *arg, unsigned int index, const char *name);
+
+	/*!
+	 * The first node has subscribed to a topic.  The backend should call
+	 * \see mqttsn_gw_deliver for each publish to the topic from now on.
+	 */
+	void (*subscribe)(void *arg, unsigned int index, const char *name);
+
+	/*!
+	 * Publish from a node to a registered topic.  For QoS 1 the backend must
+	 * later call \see mqttsn_gw_puback with a copy of ref.
+	 *
+	 * \param qos		QoS level (0 or 1)
+	 * \param ref		Identifies the publish for QoS 1, otherwise NULL
+	 * \return			0 if accepted or -ve if the backend is congested
+	 */
+	int (*publish)(void *arg, unsigned int index, const char *name, int qos, boolean_t retain,
+			const mqttsn_gw_ref_t *ref, const char *data, size_t size);
+
+	/*!
+	 * QoS 0 or -1 publish from a node to a pre-defined or short topic ID, whose
+	 * meaning is up to the backend
+	 *
+	 * \param id_type	MQTTSN_FLAG_TOPIC_ID_PRE or MQTTSN_FLAG_TOPIC_ID_SHORT
+	 * \param topic_id	Topic ID (host order)
+	 */
+	void (*publish_id)(void *arg, uint8_t id_type, uint16_t topic_id, const char *data, size_t size);
+
+	/*! Called from \see mqttsn_gw_periodic */
+	void (*periodic)(void *arg);
+} mqttsn_gw_backend_t;
+
+/*!
+ * Called to send a packet to a node - must be implemented
+ *
+ * \param addr		Node address
+ * \param buf		Pointer to data buffer
+ * \param size		Size of message in bytes
+ * \return			0 on success or -ve error code if the node can't take it now, in
+ * 					which case a publish is held and sent again from
+ * 					\see mqttsn_gw_periodic
+ */
+typedef int (*mqttsn_gw_send_callback_t)(uint8_t addr, const char *buf, size_t size);
+
+/*!
+ * Backend which stands in for a broker inside the gateway.  Publishes from nodes
+ * are delivered straight to subscribing nodes and acknowledged at once.
+ */
+extern const mqttsn_gw_backend_t mqttsn_gw_local_backend;
+
+/*!
+ * Initialise the gateway engine.  All sessions and topics are cleared.
+ *
+ * \param cb_send	Callback to send to a node
+ * \param backend	Backend for publishes from nodes
+ * \param arg		Passed to all backend callbacks
+ * \return			0 on success or -ve error code
+ */
+int mqttsn_gw_init(mqttsn_gw_send_callback_t cb_send, const mqttsn_gw_backend_t *backend, void *arg);
+
+/*!
+ * Handle an MQTT-SN packet from a node
+ *
+ * \param addr		Node address
+ * \param buf		Pointer to packet
+ * \param size		Size of packet
+ */
+void mqttsn_gw_handler(uint8_t addr, const char *buf, size_t size);
+
+/*!
+ * Forget a node's session, subscriptions and held publishes.  Call this when the
+ * node leaves the network.
+ */
+void mqttsn_gw_node_lost(uint8_t addr);
+
+/*!
+ * Timeouts for sleeping nodes and the backend, and sends of held publishes to nodes
+ * that were busy - must be called at least once a second
+ */
+void mqttsn_gw_periodic(void);
+
+/*!
+ * Publish to all nodes subscribed to a topic, at QoS 0.  Nodes that are asleep
+ * get it when they next wake.
+ *
+ * \param index		Index in topic table
+ * \param data		Payload
+ * \param size		Size of payload
+ * \param retain	Retain flag to pass on
+ */
+void mqttsn_gw_deliver(unsigned int index, const char *data, size_t size, boolean_t retain);
+
+/*!
+ * Return the result of a QoS 1 publish to the node that made it
+ *
+ * \param ref		As passed to the backend's publish callback
+ * \param return_code	MQTTSN_RC_ACCEPTED etc.
+ */
+void mqttsn_gw_puback(const mqttsn_gw_ref_t *ref, uint8_t return_code);
+
+/*!
+ * Look up a topic in the table
+ *
+ * \param index		Index in topic table
+ * \param published	Set if any node has registered the topic (may be NULL)
+ * \param subscribed	Set if any node is subscribed to the topic (may be NULL)
+ * \return			Topic name or NULL if the entry is unused
+ */
+const char* mqttsn_gw_topic(unsigned int index, boolean_t *published, boolean_t *subscribed);
+
+/*!
+ * Find a topic by name
+ *
+ * \return			Index in topic table or -ve if not found
+ */
+int mqttsn_gw_find_topic(const char *name);
+
+/*!
+ * Print the topic table and sessions to stdout
+ */
+void mqttsn_gw_dump(void);
+
+#endif /* MQTTSN_GATEWAY_H_ */
@@ -34,8 +34,10 @@
 
 /*! Maximum length of client ID string */
 #define MQTTSN_MAX_CLIENT_ID		16
-/*! Maximum number of publish/subscribe topics */
+/*! Maximum number of publish/subscribe topics (may be overridden for hosts) */
+#ifndef MQTTSN_MAX_CLIENT_TOPICS
 #define MQTTSN_MAX_CLIENT_TOPICS	16
+#endif
 
 #define MQTTSN_MAX_PACKET			64
 
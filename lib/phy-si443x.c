@@ -164,6 +164,8 @@ static volatile si443x_state_t phy_si443x_state;
 static volatile int phy_si443x_rssi;
 /*! Callback function invoked when a packet is received */
 static phy_recv_cb_t phy_si443x_recv_cb;
+/*! Number of packets received with a bad CRC */
+static unsigned int phy_si443x_crc_errors;
 
 #ifdef PLATFORM_STORE
 /*! Platform specific storage */
@@ -471,6 +473,8 @@ void phy_event_handler(void)
 
 		break;
 	case stateRxInvalid:
+		phy_si443x_crc_errors++;
+		/* Fall through */
 	case stateFifoError:
 		ERROR("Rx error\n");
 		phy_listen();
@@ -584,6 +588,21 @@ unsigned int phy_get_mtu(void)
 	return MAX_PACKET - 2; /* CRC takes up two bytes */
 }
 
+unsigned int phy_get_crc_errors(void)
+{
+	return phy_si443x_crc_errors;
+}
+
+int phy_get_time_us(uint32_t *us)
+{
+#ifdef PLATFORM_TIME_US
+	*us = PLATFORM_TIME_US();
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 int phy_get_fd(void)
 {
 	return 0;
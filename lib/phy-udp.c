@@ -32,10 +32,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "phy.h"
+#include "tinytrace.h"
 
 #define MULTICAST_GROUP		"239.0.0.1"
 #define UDP_PORT			10400
@@ -79,6 +81,7 @@ static const uint16_t phy_crc_table[] = {
 static int phy_sock;
 static phy_recv_cb_t phy_recv_cb = NULL;
 static boolean_t phy_listening = FALSE;
+static unsigned int phy_crc_errors = 0;
 
 static void update_crc(uint16_t *crc, const uint8_t *buf, size_t size) {
 	while (size--) {
@@ -196,7 +199,8 @@ void phy_event_handler(void)
 		update_crc(&ourcrc, payload, size - 2);
 		theircrc = (uint16_t*)&payload[size - 2];
 		if (ourcrc != *theircrc) {
-			ERROR("crc error\n");
+			TINYTRACE(PHY, TINYTRACE_ERROR, tinytraceEvent_PhyCrcError, size, 0);
+			phy_crc_errors++;
 			return;
 		}
 
@@ -248,6 +252,22 @@ unsigned int phy_get_mtu(void)
 	return MAX_PACKET - 2; /* CRC takes up two bytes */
 }
 
+unsigned int phy_get_crc_errors(void)
+{
+	return phy_crc_errors;
+}
+
+int phy_get_time_us(uint32_t *us)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		return -1;
+	}
+	*us = (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	return 0;
+}
+
 int phy_get_fd(void)
 {
 	return phy_sock;
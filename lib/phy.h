@@ -138,6 +138,21 @@ int phy_set_channel(unsigned int n);
  */
 unsigned int phy_get_mtu(void);
 
+/*!
+ * Returns the number of received packets discarded because of a bad CRC since
+ * \see phy_init
+ * \return			Error count
+ */
+unsigned int phy_get_crc_errors(void);
+
+/*!
+ * Read a free-running microsecond clock, used to time acks for the link statistics
+ *
+ * \param us		Receives the time in microseconds (wraps)
+ * \return			Zero on success or -ve if the platform has no suitable timer
+ */
+int phy_get_time_us(uint32_t *us);
+
 /*! For polling if running on an OS (for Linux port) */
 int phy_get_fd(void);
 
@@ -9,3 +9,18 @@ ifeq ($(PHY), si443x)
 OBJECTS+=phy-si443x.o
 endif
 
+ifeq ($(STORE), mmap)
+OBJECTS+=tinymac-store-mmap.o
+endif
+
+ifeq ($(LOOP), epoll)
+OBJECTS+=tinyloop-epoll.o
+endif
+
+ifeq ($(QUEUE), yes)
+OBJECTS+=tinymac-queue.o
+endif
+
+ifeq ($(TRACE), mmap)
+OBJECTS+=tinytrace-mmap.o
+endif
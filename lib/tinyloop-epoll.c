@@ -0,0 +1,297 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinyloop-epoll.c
+ *
+ * Event loop for Linux hosts using epoll.  Timers are timerfds on
+ * CLOCK_MONOTONIC so they are unaffected by changes to the wall clock.
+ *
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinyloop.h"
+
+typedef struct tinyloop_entry {
+	struct tinyloop_entry	*next;
+	int						fd;			/*< File descriptor, or -1 once removed */
+	tinyloop_fd_cb_t		cb;
+	void					*arg;
+} tinyloop_entry_t;
+
+struct tinyloop {
+	int						epoll_fd;
+	int						tick_fd;
+	int						deadline_fd;
+	int						wake_fd;	/*< eventfd used by tinyloop_stop */
+	volatile sig_atomic_t	stop;
+
+	tinyloop_timer_cb_t		tick_cb;
+	void					*tick_arg;
+	tinyloop_timer_cb_t		deadline_cb;
+	void					*deadline_arg;
+
+	tinyloop_entry_t		*entries;	/*< Watched descriptors */
+	tinyloop_entry_t		*removed;	/*< Removed during dispatch - freed after the batch */
+};
+
+static void tinyloop_tick_event(int fd, uint32_t events, void *arg)
+{
+	tinyloop_t *loop = (tinyloop_t*)arg;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return;
+	}
+
+	/* Catch up on any periods we missed.  The callback may cancel the tick. */
+	while (expirations-- && loop->tick_cb) {
+		loop->tick_cb(loop->tick_arg);
+	}
+}
+
+static void tinyloop_deadline_event(int fd, uint32_t events, void *arg)
+{
+	tinyloop_t *loop = (tinyloop_t*)arg;
+	tinyloop_timer_cb_t cb = loop->deadline_cb;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return;
+	}
+
+	/* Clear before the callback so it can set a new deadline */
+	loop->deadline_cb = NULL;
+	if (cb) {
+		cb(loop->deadline_arg);
+	}
+}
+
+static void tinyloop_wake_event(int fd, uint32_t events, void *arg)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0) {
+		/* Spurious */
+	}
+}
+
+static int tinyloop_set_timer(int fd, unsigned int ms, boolean_t periodic)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000l;
+	if (periodic) {
+		its.it_interval = its.it_value;
+	}
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	return 0;
+}
+
+tinyloop_t* tinyloop_create(void)
+{
+	tinyloop_t *loop;
+
+	loop = (tinyloop_t*)calloc(1, sizeof(tinyloop_t));
+	if (!loop) {
+		return NULL;
+	}
+	loop->tick_fd = loop->deadline_fd = loop->wake_fd = -1;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		perror("epoll_create1");
+		goto fail;
+	}
+	loop->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	loop->deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->tick_fd < 0 || loop->deadline_fd < 0) {
+		perror("timerfd_create");
+		goto fail;
+	}
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wake_fd < 0) {
+		perror("eventfd");
+		goto fail;
+	}
+
+	if (tinyloop_add_fd(loop, loop->tick_fd, TINYLOOP_IN, tinyloop_tick_event, loop) < 0 ||
+			tinyloop_add_fd(loop, loop->deadline_fd, TINYLOOP_IN, tinyloop_deadline_event, loop) < 0 ||
+			tinyloop_add_fd(loop, loop->wake_fd, TINYLOOP_IN, tinyloop_wake_event, loop) < 0) {
+		goto fail;
+	}
+	return loop;
+
+fail:
+	tinyloop_destroy(loop);
+	return NULL;
+}
+
+void tinyloop_destroy(tinyloop_t *loop)
+{
+	tinyloop_entry_t *entry;
+
+	if (!loop) {
+		return;
+	}
+
+	while ((entry = loop->entries)) {
+		loop->entries = entry->next;
+		free(entry);
+	}
+	while ((entry = loop->removed)) {
+		loop->removed = entry->next;
+		free(entry);
+	}
+	if (loop->wake_fd >= 0) {
+		close(loop->wake_fd);
+	}
+	if (loop->deadline_fd >= 0) {
+		close(loop->deadline_fd);
+	}
+	if (loop->tick_fd >= 0) {
+		close(loop->tick_fd);
+	}
+	if (loop->epoll_fd >= 0) {
+		close(loop->epoll_fd);
+	}
+	free(loop);
+}
+
+int tinyloop_add_fd(tinyloop_t *loop, int fd, uint32_t events, tinyloop_fd_cb_t cb, void *arg)
+{
+	tinyloop_entry_t *entry;
+	struct epoll_event ev;
+
+	entry = (tinyloop_entry_t*)malloc(sizeof(tinyloop_entry_t));
+	if (!entry) {
+		return -1;
+	}
+	entry->fd = fd;
+	entry->cb = cb;
+	entry->arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = entry;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		free(entry);
+		return -1;
+	}
+
+	entry->next = loop->entries;
+	loop->entries = entry;
+	return 0;
+}
+
+int tinyloop_remove_fd(tinyloop_t *loop, int fd)
+{
+	tinyloop_entry_t **pentry;
+
+	for (pentry = &loop->entries; *pentry; pentry = &(*pentry)->next) {
+		tinyloop_entry_t *entry = *pentry;
+
+		if (entry->fd == fd) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+			/* Events for this entry may still be pending in the current batch,
+			 * so mark it dead and free it later */
+			entry->fd = -1;
+			*pentry = entry->next;
+			entry->next = loop->removed;
+			loop->removed = entry;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int tinyloop_set_tick(tinyloop_t *loop, unsigned int period_ms, tinyloop_timer_cb_t cb, void *arg)
+{
+	loop->tick_cb = period_ms ? cb : NULL;
+	loop->tick_arg = arg;
+	return tinyloop_set_timer(loop->tick_fd, period_ms, TRUE);
+}
+
+int tinyloop_set_deadline(tinyloop_t *loop, unsigned int ms, tinyloop_timer_cb_t cb, void *arg)
+{
+	loop->deadline_cb = ms ? cb : NULL;
+	loop->deadline_arg = arg;
+	return tinyloop_set_timer(loop->deadline_fd, ms, FALSE);
+}
+
+int tinyloop_run(tinyloop_t *loop)
+{
+	struct epoll_event events[TINYLOOP_MAX_EVENTS];
+
+	loop->stop = 0;
+	while (!loop->stop) {
+		tinyloop_entry_t *entry;
+		int n, nfds;
+
+		nfds = epoll_wait(loop->epoll_fd, events, TINYLOOP_MAX_EVENTS, -1);
+		if (nfds < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (n = 0; n < nfds; n++) {
+			entry = (tinyloop_entry_t*)events[n].data.ptr;
+			if (entry->fd >= 0) {
+				entry->cb(entry->fd, events[n].events, entry->arg);
+			}
+		}
+
+		/* Now safe to release entries removed during the batch */
+		while ((entry = loop->removed)) {
+			loop->removed = entry->next;
+			free(entry);
+		}
+	}
+	return 0;
+}
+
+void tinyloop_stop(tinyloop_t *loop)
+{
+	uint64_t one = 1;
+
+	loop->stop = 1;
+	if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+		/* Already signalled */
+	}
+}
@@ -0,0 +1,132 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinyloop.h
+ *
+ * Event loop for host builds.  A loop watches any number of file descriptors
+ * and drives a periodic tick (normally the MAC tick) and a one-shot deadline
+ * timer, both from the monotonic clock.
+ *
+ * Each loop belongs to the thread that calls \see tinyloop_run.  A program may
+ * run several loops in different threads.  Only \see tinyloop_stop may be called
+ * on a loop from another thread (or from a signal handler).
+ *
+ */
+
+#ifndef TINYLOOP_H_
+#define TINYLOOP_H_
+
+#include <stdint.h>
+
+/*! Maximum number of events handled per wakeup */
+#define TINYLOOP_MAX_EVENTS				32
+
+/* Event flags for \see tinyloop_add_fd (same values as epoll) */
+#define TINYLOOP_IN						0x001
+#define TINYLOOP_OUT					0x004
+#define TINYLOOP_ERR					0x008
+#define TINYLOOP_HUP					0x010
+
+typedef struct tinyloop tinyloop_t;
+
+/*!
+ * Callback for file descriptor events
+ *
+ * \param fd		The file descriptor
+ * \param events	Events that occurred (TINYLOOP_IN etc.)
+ * \param arg		Argument passed to \see tinyloop_add_fd
+ */
+typedef void (*tinyloop_fd_cb_t)(int fd, uint32_t events, void *arg);
+
+/*!
+ * Callback for tick and deadline timers
+ *
+ * \param arg		Argument passed when the timer was set
+ */
+typedef void (*tinyloop_timer_cb_t)(void *arg);
+
+/*!
+ * Create an event loop
+ *
+ * \return			Pointer to the loop or NULL on error
+ */
+tinyloop_t* tinyloop_create(void);
+
+/*!
+ * Destroy an event loop.  File descriptors added to the loop are not closed.
+ */
+void tinyloop_destroy(tinyloop_t *loop);
+
+/*!
+ * Watch a file descriptor.  Each descriptor may only be added once.
+ *
+ * \param fd		File descriptor
+ * \param events	Events of interest (TINYLOOP_IN etc.).  Errors and hangups are
+ * 					always reported.
+ * \param cb		Callback to invoke when events occur
+ * \param arg		Passed to the callback
+ * \return			Zero on success or -ve error code
+ */
+int tinyloop_add_fd(tinyloop_t *loop, int fd, uint32_t events, tinyloop_fd_cb_t cb, void *arg);
+
+/*!
+ * Stop watching a file descriptor.  This may be called from any callback,
+ * including the descriptor's own, and no further events will be delivered for it.
+ *
+ * \return			Zero on success or -ve error code
+ */
+int tinyloop_remove_fd(tinyloop_t *loop, int fd);
+
+/*!
+ * Start, restart or cancel the periodic tick.  If the loop falls behind then the
+ * callback is invoked once for each missed period, so time kept by counting ticks
+ * does not drift.
+ *
+ * \param period_ms	Tick period in milliseconds, or 0 to cancel
+ * \param cb		Callback to invoke on each tick
+ * \param arg		Passed to the callback
+ * \return			Zero on success or -ve error code
+ */
+int tinyloop_set_tick(tinyloop_t *loop, unsigned int period_ms, tinyloop_timer_cb_t cb, void *arg);
+
+/*!
+ * Set or cancel the one-shot deadline timer.  Setting a new deadline replaces any
+ * existing one.
+ *
+ * \param ms		Time from now in milliseconds, or 0 to cancel
+ * \param cb		Callback to invoke when the deadline is reached
+ * \param arg		Passed to the callback
+ * \return			Zero on success or -ve error code
+ */
+int tinyloop_set_deadline(tinyloop_t *loop, unsigned int ms, tinyloop_timer_cb_t cb, void *arg);
+
+/*!
+ * Dispatch events until \see tinyloop_stop is called
+ *
+ * \return			Zero when stopped or -ve error code
+ */
+int tinyloop_run(tinyloop_t *loop);
+
+/*!
+ * Make \see tinyloop_run return once the current batch of events has been handled.
+ * This is safe to call from other threads and from signal handlers.
+ */
+void tinyloop_stop(tinyloop_t *loop);
+
+#endif /* TINYLOOP_H_ */
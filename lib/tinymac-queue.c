@@ -0,0 +1,246 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinymac-queue.c
+ *
+ * MAC command queue for Linux hosts.
+ *
+ * This is a bounded array queue in which each cell carries a sequence number
+ * (after Dmitry Vyukov's MPMC design).  Producers claim a cell by advancing the
+ * enqueue position with compare-and-swap and then publish it by updating the
+ * cell's sequence number, so posting never blocks.  The single consumer is the
+ * MAC thread, which is woken through an eventfd.
+ *
+ */
+
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinymac.h"
+#include "tinymac-queue.h"
+
+typedef enum {
+	tinymacCommand_Send = 0,
+	tinymacCommand_PermitAttach,
+	tinymacCommand_Stats,
+} tinymac_command_type_t;
+
+typedef struct {
+	volatile uint32_t		seq;			/*< Cell sequence number */
+	uint8_t					command;		/*< Command type (\see tinymac_command_type_t) */
+	uint8_t					dest;			/*< Send: destination */
+	uint8_t					type;			/*< Send: packet type and flags, PermitAttach: permit */
+	uint8_t					size;			/*< Send: payload size */
+	uint16_t				validity;		/*< Send: validity period */
+	tinymac_send_cb_t		cb;				/*< Completion callback */
+	void					*ptr;			/*< Stats: destination for snapshot */
+	char					payload[TINYMAC_MAX_PAYLOAD];	/*< Send: payload */
+} tinymac_command_t;
+
+typedef struct {
+	tinymac_command_t		cells[TINYMAC_QUEUE_LEN];
+	uint32_t				enqueue_pos;	/*< Next cell to be claimed by a producer */
+	uint32_t				dequeue_pos;	/*< Next cell to be executed (MAC thread only) */
+	int						fd;				/*< eventfd used to wake the MAC thread */
+} tinymac_queue_t;
+
+static tinymac_queue_t tinymac_queue_;
+static tinymac_queue_t *tinymac_queue = &tinymac_queue_;
+
+/*! Claim a free cell, or return NULL if the queue is full */
+static tinymac_command_t* tinymac_queue_claim(void)
+{
+	uint32_t pos = __atomic_load_n(&tinymac_queue->enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		tinymac_command_t *cell = &tinymac_queue->cells[pos & (TINYMAC_QUEUE_LEN - 1)];
+		int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0) {
+			/* Cell is free - try to claim it */
+			if (__atomic_compare_exchange_n(&tinymac_queue->enqueue_pos, &pos, pos + 1,
+					TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				return cell;
+			}
+			/* Lost the race - pos has been reloaded */
+		} else if (diff < 0) {
+			/* Cell still holds a command from the previous lap */
+			return NULL;
+		} else {
+			/* Another producer claimed this cell */
+			pos = __atomic_load_n(&tinymac_queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*! Make a claimed cell visible to the MAC thread and wake it */
+static void tinymac_queue_publish(tinymac_command_t *cell)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&cell->seq, cell->seq + 1, __ATOMIC_RELEASE);
+	if (write(tinymac_queue->fd, &one, sizeof(one)) < 0) {
+		perror("write");
+	}
+}
+
+int tinymac_queue_init(void)
+{
+	unsigned int n;
+
+	memset(tinymac_queue, 0, sizeof(tinymac_queue_t));
+	for (n = 0; n < TINYMAC_QUEUE_LEN; n++) {
+		tinymac_queue->cells[n].seq = n;
+	}
+
+	tinymac_queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (tinymac_queue->fd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	return 0;
+}
+
+void tinymac_queue_close(void)
+{
+	if (tinymac_queue->fd >= 0) {
+		close(tinymac_queue->fd);
+		tinymac_queue->fd = -1;
+	}
+}
+
+int tinymac_queue_get_fd(void)
+{
+	return tinymac_queue->fd;
+}
+
+void tinymac_queue_handler(void)
+{
+	uint64_t count;
+
+	/* Reset the eventfd before draining, so a command posted while we are running
+	 * wakes us again */
+	if (read(tinymac_queue->fd, &count, sizeof(count)) < 0) {
+		/* Nothing signalled - drain anyway */
+	}
+
+	for (;;) {
+		uint32_t pos = tinymac_queue->dequeue_pos;
+		tinymac_command_t *cell = &tinymac_queue->cells[pos & (TINYMAC_QUEUE_LEN - 1)];
+		int rc;
+
+		if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			/* Empty */
+			break;
+		}
+
+		switch (cell->command) {
+		case tinymacCommand_Send:
+			rc = tinymac_send(cell->dest, cell->type, cell->payload, cell->size, cell->validity, cell->cb);
+			if (rc < 0 && cell->cb) {
+				/* Rejected - tinymac_send won't have called back */
+				cell->cb(rc);
+			}
+			break;
+		case tinymacCommand_PermitAttach:
+#if WITH_TINYMAC_COORDINATOR
+			tinymac_permit_attach(cell->type ? TRUE : FALSE);
+#else
+			ERROR("Not a coordinator\n");
+#endif
+			break;
+		case tinymacCommand_Stats:
+#if WITH_TINYMAC_STATS
+			rc = tinymac_get_stats((tinymac_stats_t*)cell->ptr);
+#else
+			rc = -1;
+#endif
+			if (cell->cb) {
+				cell->cb(rc);
+			}
+			break;
+		default:
+			ERROR("Bad command %u\n", cell->command);
+		}
+
+		/* Release the cell for the next lap */
+		__atomic_store_n(&cell->seq, pos + TINYMAC_QUEUE_LEN, __ATOMIC_RELEASE);
+		tinymac_queue->dequeue_pos = pos + 1;
+	}
+}
+
+int tinymac_post_send(uint8_t dest, uint8_t type, const char *buf, size_t size, uint16_t validity, tinymac_send_cb_t cb)
+{
+	tinymac_command_t *cell;
+
+	if (size > TINYMAC_MAX_PAYLOAD) {
+		ERROR("Packet too large\n");
+		return -1;
+	}
+
+	cell = tinymac_queue_claim();
+	if (!cell) {
+		/* Not reported here - under load this would print for every packet, and
+		 * the caller knows whether the loss matters */
+		return -1;
+	}
+	cell->command = tinymacCommand_Send;
+	cell->dest = dest;
+	cell->type = type;
+	cell->size = (uint8_t)size;
+	cell->validity = validity;
+	cell->cb = cb;
+	memcpy(cell->payload, buf, size);
+	tinymac_queue_publish(cell);
+	return 0;
+}
+
+int tinymac_post_permit_attach(boolean_t permit)
+{
+	tinymac_command_t *cell = tinymac_queue_claim();
+
+	if (!cell) {
+		ERROR("Command queue full\n");
+		return -1;
+	}
+	cell->command = tinymacCommand_PermitAttach;
+	cell->type = permit ? 1 : 0;
+	cell->cb = NULL;
+	tinymac_queue_publish(cell);
+	return 0;
+}
+
+int tinymac_post_stats(tinymac_stats_t *stats, tinymac_send_cb_t cb)
+{
+	tinymac_command_t *cell = tinymac_queue_claim();
+
+	if (!cell) {
+		ERROR("Command queue full\n");
+		return -1;
+	}
+	cell->command = tinymacCommand_Stats;
+	cell->ptr = stats;
+	cell->cb = cb;
+	tinymac_queue_publish(cell);
+	return 0;
+}
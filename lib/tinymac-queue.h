@@ -0,0 +1,92 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinymac-queue.h
+ *
+ * Command queue allowing any thread to drive the MAC.  Commands are posted
+ * without locking and executed by the MAC thread, which must watch the file
+ * descriptor returned by \see tinymac_queue_get_fd and call
+ * \see tinymac_queue_handler when it becomes readable.
+ *
+ */
+
+#ifndef TINYMAC_QUEUE_H_
+#define TINYMAC_QUEUE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "tinymac.h"
+
+/*! Maximum number of commands waiting to be executed (must be a power of two) */
+#define TINYMAC_QUEUE_LEN				64
+
+/*!
+ * Create the command queue
+ *
+ * \return			Zero on success or -ve error code
+ */
+int tinymac_queue_init(void);
+
+/*!
+ * Destroy the command queue.  Commands still queued are discarded without
+ * invoking their callbacks.
+ */
+void tinymac_queue_close(void);
+
+/*!
+ * Returns a file descriptor which becomes readable when commands are waiting
+ */
+int tinymac_queue_get_fd(void);
+
+/*!
+ * Execute all waiting commands.  This must be called from the MAC thread.
+ */
+void tinymac_queue_handler(void);
+
+/*!
+ * Post a \see tinymac_send from any thread.  The payload is copied.
+ *
+ * \param cb		Callback invoked on the MAC thread when the send completes or
+ * 					fails, including if it is rejected by \see tinymac_send.
+ * \return			Zero if the command was queued or -ve if the queue is full
+ */
+int tinymac_post_send(uint8_t dest, uint8_t type, const char *buf, size_t size, uint16_t validity, tinymac_send_cb_t cb);
+
+/*!
+ * Post a \see tinymac_permit_attach from any thread
+ *
+ * \return			Zero if the command was queued or -ve if the queue is full
+ */
+int tinymac_post_permit_attach(boolean_t permit);
+
+/*!
+ * Post a request for a snapshot of the MAC-wide counters (requires WITH_TINYMAC_STATS).
+ * The snapshot is taken between other MAC operations, so it is consistent with the
+ * commands posted before it.
+ *
+ * \param stats		Structure to receive the counters.  This must remain valid until
+ * 					the callback has been invoked.
+ * \param cb		Callback invoked on the MAC thread once the snapshot is complete
+ * \return			Zero if the command was queued or -ve if the queue is full
+ */
+int tinymac_post_stats(tinymac_stats_t *stats, tinymac_send_cb_t cb);
+
+#endif /* TINYMAC_QUEUE_H_ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinymac-store-mmap.c
+ *
+ * Coordinator registry store using a memory-mapped file, for Linux hosts.
+ *
+ * Each slot is held as two copies, each with a sequence number and CRC.  Updates
+ * always overwrite the older copy, so a write interrupted by a crash or power
+ * failure leaves the previous state of the slot readable.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinymac.h"
+#include "tinymac-store.h"
+
+#define STORE_MAGIC			0x544D4143	/* "TMAC" */
+#define STORE_VERSION		2
+
+typedef struct {
+	uint32_t				magic;
+	uint16_t				version;
+	uint16_t				max_nodes;
+	uint8_t					net_id;
+	uint8_t					net_id_valid;
+	uint16_t				crc;
+} PACKED store_header_t;
+
+typedef struct {
+	tinymac_store_node_t	node;
+	uint16_t				seq;
+	uint16_t				crc;
+} PACKED store_record_t;
+
+typedef struct {
+	store_header_t			header;
+	store_record_t			records[TINYMAC_MAX_NODES][2];
+} PACKED store_file_t;
+
+static int store_fd = -1;
+static store_file_t *store = NULL;
+
+static uint16_t store_crc(const void *buf, size_t size)
+{
+	const uint8_t *ptr = (const uint8_t*)buf;
+	uint16_t crc = 0xffff;
+	unsigned int n;
+
+	while (size--) {
+		crc ^= (uint16_t)*ptr++ << 8;
+		for (n = 0; n < 8; n++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static int store_record_valid(const store_record_t *rec)
+{
+	return store_crc(rec, offsetof(store_record_t, crc)) == rec->crc;
+}
+
+/*! Returns the index of the most recent valid copy of a slot, or -1 if neither is valid */
+static int store_current(unsigned int slot)
+{
+	const store_record_t *a = &store->records[slot][0];
+	const store_record_t *b = &store->records[slot][1];
+	int a_ok = store_record_valid(a);
+	int b_ok = store_record_valid(b);
+
+	if (a_ok && b_ok) {
+		return ((int16_t)(b->seq - a->seq) > 0) ? 1 : 0;
+	}
+	return a_ok ? 0 : (b_ok ? 1 : -1);
+}
+
+static int store_sync(const void *ptr, size_t size)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(pagesize - 1);
+
+	return msync((void*)start, (uintptr_t)ptr + size - start, MS_SYNC);
+}
+
+static void store_write_header(void)
+{
+	store->header.crc = store_crc(&store->header, offsetof(store_header_t, crc));
+	store_sync(&store->header, sizeof(store->header));
+}
+
+int tinymac_store_open(const char *path)
+{
+	struct stat st;
+
+	store_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (store_fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(store_fd, &st) < 0 || (st.st_size != sizeof(store_file_t) &&
+			ftruncate(store_fd, sizeof(store_file_t)) < 0)) {
+		perror("ftruncate");
+		close(store_fd);
+		store_fd = -1;
+		return -1;
+	}
+
+	store = (store_file_t*)mmap(NULL, sizeof(store_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+	if (store == MAP_FAILED) {
+		perror("mmap");
+		close(store_fd);
+		store_fd = -1;
+		store = NULL;
+		return -1;
+	}
+
+	if (store->header.magic != STORE_MAGIC || store->header.version != STORE_VERSION ||
+			store->header.max_nodes != TINYMAC_MAX_NODES ||
+			store->header.crc != store_crc(&store->header, offsetof(store_header_t, crc))) {
+		/* New or incompatible file - start again */
+		INFO("Initialising node store %s\n", path);
+		memset(store, 0, sizeof(store_file_t));
+		store->header.magic = STORE_MAGIC;
+		store->header.version = STORE_VERSION;
+		store->header.max_nodes = TINYMAC_MAX_NODES;
+		store_sync(store, sizeof(store_file_t));
+		store_write_header();
+	}
+
+	return 0;
+}
+
+void tinymac_store_close(void)
+{
+	if (store) {
+		munmap(store, sizeof(store_file_t));
+		store = NULL;
+	}
+	if (store_fd >= 0) {
+		close(store_fd);
+		store_fd = -1;
+	}
+}
+
+int tinymac_store_get_net_id(void)
+{
+	if (!store || !store->header.net_id_valid) {
+		return -1;
+	}
+	return store->header.net_id;
+}
+
+int tinymac_store_set_net_id(uint8_t net_id)
+{
+	if (!store) {
+		return -1;
+	}
+	store->header.net_id = net_id;
+	store->header.net_id_valid = 1;
+	store_write_header();
+	return 0;
+}
+
+int tinymac_store_read(unsigned int slot, tinymac_store_node_t *node)
+{
+	int current;
+
+	if (!store || slot >= TINYMAC_MAX_NODES) {
+		return -1;
+	}
+
+	current = store_current(slot);
+	if (current < 0) {
+		return -1;
+	}
+	memcpy(node, &store->records[slot][current].node, sizeof(tinymac_store_node_t));
+	return 0;
+}
+
+int tinymac_store_write(unsigned int slot, const tinymac_store_node_t *node)
+{
+	store_record_t *rec;
+	uint16_t seq = 0;
+	int current;
+
+	if (!store || slot >= TINYMAC_MAX_NODES) {
+		return -1;
+	}
+
+	/* Overwrite the older copy, leaving the current one intact until this
+	 * update has reached the disk */
+	current = store_current(slot);
+	if (current >= 0) {
+		seq = store->records[slot][current].seq + 1;
+	}
+	rec = &store->records[slot][current == 0 ? 1 : 0];
+	memcpy(&rec->node, node, sizeof(tinymac_store_node_t));
+	rec->seq = seq;
+	rec->crc = store_crc(rec, offsetof(store_record_t, crc));
+
+	return store_sync(rec, sizeof(store_record_t));
+}
@@ -0,0 +1,88 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinymac-store.h
+ *
+ * Generic interface to persistent storage for the coordinator node registry
+ *
+ */
+
+#ifndef TINYMAC_STORE_H_
+#define TINYMAC_STORE_H_
+
+#include <stdint.h>
+
+/*! Persistent copy of one slot of the coordinator's node registry */
+typedef struct {
+	uint64_t		uuid;			/*< Unit identifier, or 0 if the slot has never been used */
+	uint16_t		flags;			/*< Node flags (from registration) */
+	uint8_t			addr;			/*< Assigned short address */
+	uint8_t			registered;		/*< Non-zero if the node is currently registered */
+	uint8_t			groups;			/*< Multicast group memberships */
+} tinymac_store_node_t;
+
+/*!
+ * Open (or create) the persistent store.  This must be called by the application
+ * before \see tinymac_init if the coordinator is to resume its previous network.
+ *
+ * \param path		Location of the store (implementation specific)
+ * \return			Zero on success or -ve error code
+ */
+int tinymac_store_open(const char *path);
+
+/*!
+ * Close the persistent store
+ */
+void tinymac_store_close(void);
+
+/*!
+ * Returns the network ID saved by a previous instance
+ *
+ * \return			Network ID or -ve if none saved
+ */
+int tinymac_store_get_net_id(void);
+
+/*!
+ * Save the network ID
+ *
+ * \param net_id	Network ID in use by this coordinator
+ * \return			Zero on success or -ve error code
+ */
+int tinymac_store_set_net_id(uint8_t net_id);
+
+/*!
+ * Read the saved state of a registry slot
+ *
+ * \param slot		Slot index (0 to TINYMAC_MAX_NODES - 1)
+ * \param node		Pointer to structure to receive the saved state
+ * \return			Zero on success or -ve if the slot holds no valid data
+ */
+int tinymac_store_read(unsigned int slot, tinymac_store_node_t *node);
+
+/*!
+ * Update the saved state of a registry slot.  An interrupted update must leave
+ * the previous state of the slot intact.
+ *
+ * \param slot		Slot index (0 to TINYMAC_MAX_NODES - 1)
+ * \param node		Pointer to new state for this slot
+ * \return			Zero on success or -ve error code
+ */
+int tinymac_store_write(unsigned int slot, const tinymac_store_node_t *node);
+
+#endif /* TINYMAC_STORE_H_ */
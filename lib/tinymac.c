@@ -33,20 +33,37 @@
 #include "common.h"
 #include "phy.h"
 #include "tinymac.h"
+#include "tinytrace.h"
+#if WITH_TINYMAC_STORE
+#include "tinymac-store.h"
+#endif
 
 typedef enum {
 	tinymacClientState_Unregistered = 0,
+	tinymacClientState_Backoff,
 	tinymacClientState_BeaconRequest,
+	tinymacClientState_RegistrationBackoff,
 	tinymacClientState_Registering,
 	tinymacClientState_Registered,
 } tinymac_client_state_t;
 
 #if WITH_TINYMAC_COORDINATOR
+/*! Multicast packet held for transmission after the next sync beacon */
+typedef struct {
+	boolean_t				pending;		/*< Packet is waiting to be sent */
+	tinymac_header_t		header;			/*< Header for pending packet */
+	size_t					size;			/*< Size of pending payload */
+	char					payload[TINYMAC_MAX_PAYLOAD];	/*< Pending payload */
+	tinymac_send_cb_t		send_cb;		/*< Callback invoked when sent/expired */
+	tinymac_timer_t			validity_timer;	/*< Validity timeout */
+} tinymac_group_t;
+
 static const char *tinymac_node_states[] = {
 		"Unregistered",
 		"Registered",
 		"SendPending",
 		"WaitAck",
+		"WaitImplicitAck",
 };
 #endif
 
@@ -67,6 +84,19 @@ typedef struct {
 	uint8_t					dseq;			/*< Current outbound data sequence number */
 	uint16_t				slot;			/*< Current beacon slot */
 
+#if WITH_TINYMAC_STATS
+	volatile uint32_t		stats_seq;		/*< Odd while statistics are being updated */
+	tinymac_stats_t			stats;			/*< MAC-wide counters */
+#endif
+
+#if WITH_TINYMAC_AGGREGATE
+	uint8_t					agg_dest;		/*< Destination of the aggregate frame being built */
+	uint8_t					agg_flags;		/*< Frame flags for the aggregate frame */
+	size_t					agg_size;		/*< Size of the aggregate frame so far */
+	char					agg_buf[TINYMAC_MAX_PAYLOAD];	/*< Aggregate frame payload */
+	tinymac_timer_t			agg_timer;		/*< Deadline for the aggregate frame */
+#endif
+
 	/**********/
 	/* Client */
 	/**********/
@@ -74,6 +104,10 @@ typedef struct {
 	tinymac_client_state_t	state;			/*< Current client state for this node */
 	tinymac_node_t			coord;			/*< Client: Associated coordinator */
 	tinymac_timer_t			timer;			/*< Timer for registration/beacon requests */
+	uint8_t					backoff;		/*< Current request backoff exponent */
+	uint8_t					groups;			/*< Multicast group memberships */
+	boolean_t				groups_dirty;	/*< Memberships not yet acked by the coordinator */
+	boolean_t				implicit_ack;	/*< Next frame to the coordinator must carry an implicit ack */
 
 #if WITH_TINYMAC_COORDINATOR
 	/***************/
@@ -83,8 +117,12 @@ typedef struct {
 	uint8_t					bseq;			/*< Current outbound beacon serial number (coordinator) */
 	tinymac_node_t	nodes[TINYMAC_MAX_NODES];	/*< List of known nodes */
 	boolean_t				permit_attach;	/*< Whether or not we are acceptng registration requests */
+	boolean_t				beacon_requested;	/*< An advertisement beacon is due in the next slot */
 	tinymac_reg_cb_t		reg_cb;			/*< Node registration callback */
 	tinymac_reg_cb_t		dereg_cb;		/*< Node deregistration callback */
+	tinymac_registration_request_t	reg_queue[TINYMAC_REG_QUEUE_LEN];	/*< Registration requests awaiting a response */
+	uint8_t					reg_queue_len;	/*< Number of queued registration requests */
+	tinymac_group_t			group_tx[TINYMAC_MAX_GROUPS];	/*< Multicast packets pending */
 #endif
 } tinymac_t;
 
@@ -92,6 +130,10 @@ static tinymac_t tinymac_ctx_;
 static tinymac_t *tinymac_ctx = &tinymac_ctx_;
 
 static int tinymac_phy_send(phy_buf_t *bufs, unsigned int nbufs, uint8_t flags);
+static int tinymac_tx_packet(tinymac_node_t *dest, uint8_t flags_type, const char *buf, size_t size,
+		uint16_t validity, tinymac_send_cb_t cb);
+static int tinymac_tx_packetv(tinymac_node_t *dest, uint8_t flags_type, const phy_buf_t *frags, unsigned int nfrags,
+		uint16_t validity, tinymac_send_cb_t cb);
 
 
 /****************************/
@@ -121,6 +163,94 @@ static void tinymac_despatch_timer(tinymac_timer_t *timer)
 	}
 }
 
+/**************/
+/* Statistics */
+/**************/
+
+#if WITH_TINYMAC_STATS
+/* Statistics are only written by the MAC thread.  Each update is bracketed by
+ * increments of stats_seq, which is odd while the update is in progress, so that
+ * other threads can take consistent snapshots without locking */
+#if defined(__GNUC__) && !defined(__AVR__)
+#define TINYMAC_STATS_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define TINYMAC_STATS_FENCE()		__asm__ __volatile__("" ::: "memory")
+#endif
+
+#define TINYMAC_STAT(...)			do { \
+		tinymac_ctx->stats_seq++; \
+		TINYMAC_STATS_FENCE(); \
+		__VA_ARGS__; \
+		TINYMAC_STATS_FENCE(); \
+		tinymac_ctx->stats_seq++; \
+	} while (0)
+
+/*! Copy statistics for another thread, retrying if the MAC updated them meanwhile */
+static void tinymac_stats_read(void *dest, const void *src, size_t size)
+{
+	uint32_t seq;
+
+	do {
+		while ((seq = tinymac_ctx->stats_seq) & 1) {
+			/* Update in progress */
+		}
+		TINYMAC_STATS_FENCE();
+		memcpy(dest, src, size);
+		TINYMAC_STATS_FENCE();
+	} while (seq != tinymac_ctx->stats_seq);
+}
+
+/*! Record a frame received from a node */
+static void tinymac_stats_rx(tinymac_node_t *node, int rssi)
+{
+	tinymac_node_stats_t *stats = &node->stats;
+
+	TINYMAC_STAT({
+		stats->rx_frames++;
+		if (rssi != PHY_RSSI_NONE) {
+			if (stats->rssi_min == 0 && stats->rssi_max == 0) {
+				/* First sample */
+				stats->rssi_avg = rssi * 16;
+				stats->rssi_min = stats->rssi_max = (int8_t)rssi;
+			} else {
+				/* Exponentially weighted, alpha = 1/8 */
+				stats->rssi_avg += (rssi * 16 - stats->rssi_avg) / 8;
+				if (rssi < stats->rssi_min) {
+					stats->rssi_min = (int8_t)rssi;
+				}
+				if (rssi > stats->rssi_max) {
+					stats->rssi_max = (int8_t)rssi;
+				}
+			}
+		}
+	});
+}
+
+/*! Record the latency of a successful acknowledged send */
+static void tinymac_stats_acked(tinymac_node_t *node)
+{
+	uint32_t now, ms;
+	unsigned int bucket = 0;
+
+	if (node->tx_time_valid && phy_get_time_us(&now) == 0) {
+		ms = (now - node->tx_time) / 1000;
+	} else {
+		/* No microsecond clock - only resolved to the tick */
+		ms = (tinymac_ctx->tick_count - node->tx_tick) * TINYMAC_TICK_MS;
+	}
+
+	while (ms && bucket < TINYMAC_LATENCY_BUCKETS - 1) {
+		ms >>= 1;
+		bucket++;
+	}
+	TINYMAC_STAT(node->stats.latency[bucket]++);
+}
+#else
+#define TINYMAC_STAT(...)
+#define tinymac_stats_rx(node, rssi)
+#define tinymac_stats_acked(node)
+#endif
+
 /*****************/
 /* Node registry */
 /*****************/
@@ -176,6 +306,58 @@ static tinymac_node_t* tinymac_get_free_node(void)
 	}
 	return fallback ? fallback : NULL;
 }
+
+#if WITH_TINYMAC_STORE
+/*! Write the registration state of a node to persistent storage */
+static void tinymac_store_node(tinymac_node_t *node)
+{
+	tinymac_store_node_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.uuid = node->uuid;
+	rec.flags = node->flags;
+	rec.addr = node->addr;
+	rec.registered = (node->state != tinymacNodeState_Unregistered);
+	rec.groups = node->groups;
+	if (tinymac_store_write((unsigned int)(node - tinymac_ctx->nodes), &rec) < 0) {
+		ERROR("Failed to store node %02X\n", node->addr);
+	}
+}
+
+/*! Restore network ID and registrations saved by a previous instance */
+static void tinymac_restore_nodes(void)
+{
+	tinymac_store_node_t rec;
+	tinymac_node_t *node = tinymac_ctx->nodes;
+	unsigned int n;
+	int net_id;
+
+	net_id = tinymac_store_get_net_id();
+	if (net_id < 0) {
+		/* Nothing saved (or no store) - keep the new random network ID */
+		tinymac_store_set_net_id(tinymac_ctx->net_id);
+		return;
+	}
+	tinymac_ctx->net_id = (uint8_t)net_id;
+
+	for (n = 0; n < TINYMAC_MAX_NODES; n++, node++) {
+		if (tinymac_store_read(n, &rec) < 0 || rec.uuid == 0 || rec.addr != node->addr) {
+			continue;
+		}
+
+		/* Registered nodes must call in within their heartbeat period as usual */
+		node->uuid = rec.uuid;
+		node->flags = rec.flags;
+		node->groups = rec.groups;
+		node->last_heard = tinymac_ctx->tick_count;
+		node->state = rec.registered ? tinymacNodeState_Registered : tinymacNodeState_Unregistered;
+		INFO("Restored node %02X for %016" PRIX64 " (%s)\n", node->addr, node->uuid,
+				rec.registered ? "registered" : "unregistered");
+	}
+}
+#else
+#define tinymac_store_node(node)
+#endif
 #else
 static tinymac_node_t* tinymac_get_node_by_addr(uint8_t addr)
 {
@@ -188,6 +370,7 @@ static tinymac_node_t* tinymac_get_node_by_addr(uint8_t addr)
 static void tinymac_deregister_node(tinymac_node_t *node)
 {
 	ERROR("Node %02X has gone away\n", node->addr);
+	TINYTRACE(MAC, TINYTRACE_INFO, tinytraceEvent_MacDeregister, node->addr, 0);
 
 	node->state = tinymacNodeState_Unregistered;
 	if (node == &tinymac_ctx->coord) {
@@ -198,12 +381,14 @@ static void tinymac_deregister_node(tinymac_node_t *node)
 	}
 
 #if WITH_TINYMAC_COORDINATOR
+	if (node != &tinymac_ctx->coord) {
+		tinymac_store_node(node);
+	}
+
 	/* Invoke callback */
 	if (tinymac_ctx->dereg_cb) {
 		tinymac_ctx->dereg_cb((const tinymac_node_t*)node);
 	}
-
-	tinymac_dump_nodes();
 #endif
 }
 
@@ -211,6 +396,17 @@ static void tinymac_deregister_node(tinymac_node_t *node)
 /* Timeout handler callbacks */
 /*****************************/
 
+/*!
+ * Returns a random holdoff (in ticks) from the current backoff window.  The
+ * UUID is mixed in so that nodes without a seeded PRNG still pick different slots.
+ */
+static uint32_t tinymac_backoff_delay(void)
+{
+	unsigned int r = (unsigned int)rand() ^ (unsigned int)tinymac_ctx->params.uuid;
+
+	return r % ((uint32_t)TINYMAC_BACKOFF_WINDOW << tinymac_ctx->backoff);
+}
+
 /*!
  * Timer callback invoked when a beacon request or registration request are
  * not answered in time.
@@ -221,12 +417,44 @@ static void tinymac_request_timeout(void *arg)
 	if (tinymac_ctx->state == tinymacClientState_BeaconRequest || tinymac_ctx->state == tinymacClientState_Registering) {
 		/* Coordinator has gone away */
 		TRACE("Beacon request/registration timeout\n");
+		if (tinymac_ctx->backoff < TINYMAC_BACKOFF_MAX_EXP) {
+			tinymac_ctx->backoff++;
+		}
 		tinymac_deregister_node(&tinymac_ctx->coord);
 	} else {
 		TRACE("Timeout callback skipped\n");
 	}
 }
 
+/*!
+ * Timer callback invoked at the end of the random holdoff preceding a beacon
+ * request or registration request
+ */
+static void tinymac_backoff_timeout(void *arg)
+{
+	if (tinymac_ctx->state == tinymacClientState_Backoff) {
+		TRACE("Sending beacon request\n");
+		tinymac_ctx->state = tinymacClientState_BeaconRequest;
+		tinymac_tx_packet(NULL, (uint16_t)tinymacType_BeaconRequest, NULL, 0, 0, NULL);
+
+		/* Set a timer for beacon request timeout */
+		tinymac_set_timer(&tinymac_ctx->timer, tinymac_request_timeout, NULL, TINYMAC_SECONDS(TINYMAC_BEACON_REQUEST_TIMEOUT));
+	} else if (tinymac_ctx->state == tinymacClientState_RegistrationBackoff) {
+		tinymac_registration_request_t attach;
+
+		INFO("Attempting registration with %02X:%02X\n", tinymac_ctx->net_id, tinymac_ctx->coord.addr);
+		tinymac_ctx->state = tinymacClientState_Registering;
+
+		attach.uuid = tinymac_ctx->params.uuid;
+		attach.flags = tinymac_ctx->params.flags | TINYMAC_ATTACH_FLAGS_DATA_ACK;
+		tinymac_tx_packet(&tinymac_ctx->coord, (uint16_t)tinymacType_RegistrationRequest,
+				(const char*)&attach, sizeof(attach), 0, NULL);
+
+		/* Start callback timer */
+		tinymac_set_timer(&tinymac_ctx->timer, tinymac_request_timeout, NULL, TINYMAC_MILLIS(TINYMAC_REGISTRATION_TIMEOUT));
+	}
+}
+
 /*!
  * Timer callback invoked when a pending send is not completed within the
  * packet's validity period.
@@ -236,6 +464,8 @@ static void tinymac_validity_timeout(void *arg)
 	tinymac_node_t *node = (tinymac_node_t*)arg;
 
 	ERROR("Validity expired for pending send to node %02X\n", node->addr);
+	TINYTRACE(MAC, TINYTRACE_ERROR, tinytraceEvent_MacValidityExpired, node->addr, 0);
+	TINYMAC_STAT(node->stats.validity_expiries++; tinymac_ctx->stats.send_failures++);
 
 	/* Clear pending packet */
 	node->state = tinymacNodeState_Registered;
@@ -247,6 +477,24 @@ static void tinymac_validity_timeout(void *arg)
 	}
 }
 
+#if WITH_TINYMAC_COORDINATOR
+/*!
+ * Timer callback invoked when a multicast packet held for sleeping members is
+ * not sent within its validity period (no sync beacon was due).
+ */
+static void tinymac_group_validity_timeout(void *arg)
+{
+	tinymac_group_t *group = (tinymac_group_t*)arg;
+
+	ERROR("Validity expired for pending send to group %02X\n", group->header.dest_addr);
+
+	group->pending = FALSE;
+	if (group->send_cb) {
+		group->send_cb(-1);
+	}
+}
+#endif
+
 /*!
  * Timer callback invoked when a packet has been sent with AR set and no
  * acknowledgement was received
@@ -256,30 +504,28 @@ static void tinymac_ack_timeout(void *arg)
 	tinymac_node_t *node = (tinymac_node_t*)arg;
 
 	INFO("Ack timeout for node %02X\n", node->addr);
+	TINYTRACE(MAC, TINYTRACE_INFO, tinytraceEvent_MacAckTimeout, node->addr, node->retries);
+	TINYMAC_STAT(node->stats.ack_timeouts++);
 	if (node->retries--) {
 		phy_buf_t bufs[] = {
 				{ (char*)&node->pending_header, sizeof(tinymac_header_t) },
 				{ (char*)node->pending, node->pending_size },
 		};
 
+		TINYMAC_STAT(node->stats.retries++);
+
 		if (node->flags & TINYMAC_ATTACH_FLAGS_SLEEPY) {
 			/* Defer re-send to sleepy node */
-			TRACE("(pending)\n");
 			node->state = tinymacNodeState_SendPending;
 		} else {
 			/* Re-send immediately and schedule another timeout */
-			TRACE("OUT (retry): %04X %02X %02X %02X %02X (%zu)\n",
-					node->pending_header.flags,
-					node->pending_header.net_id,
-					node->pending_header.dest_addr,
-					node->pending_header.src_addr,
-					node->pending_header.seq,
-					node->pending_size);
+			TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacTxRetry, &node->pending_header, node->pending_size);
 			tinymac_set_timer(&node->ack_timer, tinymac_ack_timeout, node, TINYMAC_MILLIS(TINYMAC_ACK_TIMEOUT));
 			tinymac_phy_send(bufs, ARRAY_SIZE(bufs), 0);
 		}
 	} else {
 		/* Invoke callback for failure */
+		TINYMAC_STAT(tinymac_ctx->stats.send_failures++);
 		tinymac_cancel_timer(&node->validity_timer);
 		if (node->send_cb) {
 			node->send_cb(-1);
@@ -294,12 +540,39 @@ static void tinymac_ack_timeout(void *arg)
 /* Transmit functions */
 /**********************/
 
+/*! Sets the implicit ack flag on the first frame to the coordinator following a DataAck
+ * whose payload requested an ack */
+static void tinymac_set_implicit_ack(tinymac_header_t *hdr)
+{
+	if (tinymac_ctx->implicit_ack && hdr->dest_addr == tinymac_ctx->coord.addr) {
+		hdr->flags |= TINYMAC_FLAGS_IMPLICIT_ACK;
+		tinymac_ctx->implicit_ack = FALSE;
+	}
+}
+
 /*! Wrapper around phy_send to handle power state transition */
 static int tinymac_phy_send(phy_buf_t *bufs, unsigned int nbufs, uint8_t flags)
 {
 	int rc;
 
 	rc = phy_send(bufs, nbufs, flags);
+#if WITH_TINYMAC_STATS
+	{
+		/* The first fragment is always the MAC header */
+		tinymac_node_t *node = tinymac_get_node_by_addr(((tinymac_header_t*)bufs[0].buf)->dest_addr);
+
+		TINYMAC_STAT({
+			if (rc < 0) {
+				tinymac_ctx->stats.tx_errors++;
+			} else {
+				tinymac_ctx->stats.tx_frames++;
+				if (node) {
+					node->stats.tx_frames++;
+				}
+			}
+		});
+	}
+#endif
 	if (tinymac_ctx->params.flags & TINYMAC_ATTACH_FLAGS_SLEEPY) {
 		if (rc < 0) {
 			/* Error - standby immediately */
@@ -312,14 +585,48 @@ static int tinymac_phy_send(phy_buf_t *bufs, unsigned int nbufs, uint8_t flags)
 	return rc;
 }
 
+/*! Copy a fragment list into a contiguous buffer, which must be large enough */
+static void tinymac_gather(char *buf, const phy_buf_t *frags, unsigned int nfrags)
+{
+	while (nfrags--) {
+		memcpy(buf, frags->buf, frags->size);
+		buf += frags->size;
+		frags++;
+	}
+}
+
 static int tinymac_tx_packet(tinymac_node_t *dest, uint8_t flags_type, const char *buf, size_t size,
 		uint16_t validity, tinymac_send_cb_t cb)
+{
+	phy_buf_t frag = { (char*)buf, size };
+
+	return tinymac_tx_packetv(dest, flags_type, &frag, 1, validity, cb);
+}
+
+/*!
+ * Send a packet whose payload is given as a list of fragments.  The fragments go
+ * straight to the PHY after the MAC header, and are only copied if the packet has
+ * to be kept for retransmission or for a sleeping node.
+ */
+static int tinymac_tx_packetv(tinymac_node_t *dest, uint8_t flags_type, const phy_buf_t *frags, unsigned int nfrags,
+		uint16_t validity, tinymac_send_cb_t cb)
 {
 	tinymac_header_t hdr;
-	phy_buf_t bufs[] = {
-			{ (char*)&hdr, sizeof(hdr) },
-			{ (char*)buf, size },
-	};
+	phy_buf_t bufs[1 + TINYMAC_MAX_FRAGMENTS];
+	size_t size = 0;
+	unsigned int n;
+	int rc;
+
+	if (nfrags > TINYMAC_MAX_FRAGMENTS) {
+		ERROR("Too many fragments\n");
+		return -1;
+	}
+	bufs[0].buf = (char*)&hdr;
+	bufs[0].size = sizeof(hdr);
+	for (n = 0; n < nfrags; n++) {
+		bufs[1 + n] = frags[n];
+		size += frags[n].size;
+	}
 
 	/* Check size against PHY MTU */
 	if (size > TINYMAC_MAX_PAYLOAD || (size + sizeof(hdr)) > tinymac_ctx->phy_mtu) {
@@ -344,20 +651,25 @@ static int tinymac_tx_packet(tinymac_node_t *dest, uint8_t flags_type, const cha
 			return -1;
 		}
 
+		/* The frame will now be sent or kept, so it can carry an owed implicit ack */
+		tinymac_set_implicit_ack(&hdr);
+
 		if ((flags_type & TINYMAC_FLAGS_ACK_REQUEST) || (dest->flags & TINYMAC_ATTACH_FLAGS_SLEEPY)) {
 			/* Copy packet for (re-)transmission */
-			memcpy(dest->pending, buf, size);
+			tinymac_gather(dest->pending, frags, nfrags);
 			memcpy(&dest->pending_header, &hdr, sizeof(hdr));
 			dest->pending_size = size;
 			dest->send_cb = cb;
 			dest->retries = TINYMAC_MAX_RETRIES;
+#if WITH_TINYMAC_STATS
+			dest->tx_tick = tinymac_ctx->tick_count;
+			dest->tx_time_valid = (phy_get_time_us(&dest->tx_time) == 0) ? TRUE : FALSE;
+#endif
 		}
 
 		/* If destination node is sleepy then defer the transmission (packet contents are
 		 * copied above) */
 		if (dest->flags & TINYMAC_ATTACH_FLAGS_SLEEPY) {
-			TRACE("Pending transmission for node %02X\n", dest->addr);
-
 			/* Start validity period timer.  The node must call in before this
 			 * expires otherwise the send will fail */
 			tinymac_set_timer(&dest->validity_timer, tinymac_validity_timeout, dest, TINYMAC_SECONDS(validity));
@@ -368,8 +680,6 @@ static int tinymac_tx_packet(tinymac_node_t *dest, uint8_t flags_type, const cha
 		/* We are going to send this packet immediately - if an ack is requested then
 		 * start the timer now */
 		if (flags_type & TINYMAC_FLAGS_ACK_REQUEST) {
-			TRACE("Waiting for ack from node %02X\n", dest->addr);
-
 			/* Start a timer for ack receipt and reset retry counter */
 			tinymac_set_timer(&dest->ack_timer, tinymac_ack_timeout, dest, TINYMAC_MILLIS(TINYMAC_ACK_TIMEOUT));
 			dest->state = tinymacNodeState_WaitAck;
@@ -377,9 +687,18 @@ static int tinymac_tx_packet(tinymac_node_t *dest, uint8_t flags_type, const cha
 	}
 
 	/* Send now */
-	/* FIXME: Invoke callback on successful immediate send? */
-	TRACE("OUT: %04X %02X %02X %02X %02X (%zu)\n", hdr.flags, hdr.net_id, hdr.dest_addr, hdr.src_addr, hdr.seq, size);
-	return tinymac_phy_send(bufs, ARRAY_SIZE(bufs), 0);
+	TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacTx, &hdr, size);
+	rc = tinymac_phy_send(bufs, 1 + nfrags, 0);
+	if (dest && (flags_type & TINYMAC_FLAGS_ACK_REQUEST)) {
+		/* Completion is reported when the ack arrives.  A failed send is retried
+		 * by the ack timer, the same as a lost frame */
+		return 0;
+	}
+	if (rc >= 0 && cb) {
+		/* Nothing more to wait for */
+		cb(0);
+	}
+	return rc;
 }
 
 static int tinymac_tx_pending(tinymac_node_t *node)
@@ -399,11 +718,10 @@ static int tinymac_tx_pending(tinymac_node_t *node)
 		bufs[1].size = node->pending_size;
 		if (hdr.flags & TINYMAC_FLAGS_ACK_REQUEST) {
 			/* Start a timer and prepare for a retransmission if we don't get an ACK */
-			TRACE("Waiting for ack from node %02X\n", node->addr);
 			node->state = tinymacNodeState_WaitAck;
 			tinymac_set_timer(&node->ack_timer, tinymac_ack_timeout, node, TINYMAC_MILLIS(TINYMAC_ACK_TIMEOUT));
 		}
-		TRACE("PENDING OUT: %04X %02X %02X %02X %02X (%zu)\n", hdr.flags, hdr.net_id, hdr.dest_addr, hdr.src_addr, hdr.seq, node->pending_size);
+		TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacTxPending, &hdr, node->pending_size);
 		tinymac_phy_send(bufs, ARRAY_SIZE(bufs), 0);
 		if (!(hdr.flags & TINYMAC_FLAGS_ACK_REQUEST)) {
 			/* No ack - required so we assume success */
@@ -416,11 +734,23 @@ static int tinymac_tx_pending(tinymac_node_t *node)
 	return 0;
 }
 
+/*! Returns TRUE if the packet pending for a node can be carried by a DataAck */
+static boolean_t tinymac_can_data_ack(tinymac_node_t *node)
+{
+	uint8_t type = node->pending_header.flags & TINYMAC_FLAGS_TYPE_MASK;
+
+	return (node->flags & TINYMAC_ATTACH_FLAGS_DATA_ACK) &&
+			(type >= tinymacType_RawData || type == tinymacType_Aggregate) &&
+			sizeof(tinymac_header_t) + sizeof(tinymac_data_ack_t) + node->pending_size <= tinymac_ctx->phy_mtu;
+}
+
 static int tinymac_tx_ack(tinymac_node_t *node, uint8_t seq)
 {
 	tinymac_header_t hdr;
+	tinymac_data_ack_t dack;
 	phy_buf_t bufs[] = {
 			{ (char*)&hdr, sizeof(hdr) },
+			{ (char*)&dack, sizeof(dack) },
 			{ NULL, 0 },
 	};
 	int rc;
@@ -431,10 +761,42 @@ static int tinymac_tx_ack(tinymac_node_t *node, uint8_t seq)
 	hdr.src_addr = tinymac_ctx->addr;
 	hdr.dest_addr = node->addr;
 	hdr.seq = seq;
+	tinymac_set_implicit_ack(&hdr);
 	if (node->state == tinymacNodeState_SendPending) {
+		if (tinymac_can_data_ack(node)) {
+			/* Carry the pending packet in the ack itself */
+			hdr.flags = (hdr.flags & ~TINYMAC_FLAGS_TYPE_MASK) | tinymacType_DataAck;
+			dack.flags = (uint8_t)node->pending_header.flags;
+			dack.seq = node->pending_header.seq;
+			bufs[2].buf = node->pending;
+			bufs[2].size = node->pending_size;
+
+			TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacDataAck, &hdr, node->pending_size);
+			rc = tinymac_phy_send(bufs, ARRAY_SIZE(bufs), 0);
+			if (rc < 0) {
+				/* Send failed - packet remains pending */
+				return rc;
+			}
+
+			if (dack.flags & TINYMAC_FLAGS_ACK_REQUEST) {
+				/* Delivery is confirmed by the node's next transmission, which is due
+				 * within its heartbeat period */
+				node->state = tinymacNodeState_WaitImplicitAck;
+				tinymac_set_timer(&node->validity_timer, tinymac_validity_timeout, node,
+						TINYMAC_SECONDS((1 << (node->flags & TINYMAC_ATTACH_HEARTBEAT_MASK)) + TINYMAC_HEARTBEAT_GRACE));
+			} else {
+				/* No ack required so we assume success */
+				node->state = tinymacNodeState_Registered;
+				tinymac_cancel_timer(&node->validity_timer);
+				if (node->send_cb) {
+					node->send_cb(0);
+				}
+			}
+			return rc;
+		}
 		hdr.flags |= TINYMAC_FLAGS_DATA_PENDING;
 	}
-	TRACE("ACK: %04X %02X %02X %02X %02X\n", hdr.flags, hdr.net_id, hdr.dest_addr, hdr.src_addr, hdr.seq);
+	TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacAck, &hdr, 0);
 	rc = tinymac_phy_send(bufs, 1, 0);
 	if (rc < 0) {
 		/* Send failed */
@@ -444,13 +806,43 @@ static int tinymac_tx_ack(tinymac_node_t *node, uint8_t seq)
 	return tinymac_tx_pending(node);
 }
 
+static void tinymac_group_request_cb(int result)
+{
+	if (result < 0) {
+		/* Not acked - send again when the link is next free */
+		tinymac_ctx->groups_dirty = TRUE;
+	}
+}
+
+/*! Send our complete set of group memberships to the coordinator if they have
+ * changed since it last acked them.  If the link to the coordinator is busy this
+ * is retried after the next ack or sync beacon. */
+static void tinymac_tx_group_request(void)
+{
+	tinymac_group_request_t req;
+
+	if (!tinymac_ctx->groups_dirty || tinymac_ctx->state != tinymacClientState_Registered ||
+			tinymac_ctx->coord.state != tinymacNodeState_Registered) {
+		return;
+	}
+	req.groups = tinymac_ctx->groups;
+	if (tinymac_tx_packet(&tinymac_ctx->coord, (uint16_t)tinymacType_GroupRequest | TINYMAC_FLAGS_ACK_REQUEST,
+			(const char*)&req, sizeof(req), 0, tinymac_group_request_cb) == 0) {
+		tinymac_ctx->groups_dirty = FALSE;
+	}
+}
+
 #if WITH_TINYMAC_COORDINATOR
 static int tinymac_tx_beacon(boolean_t periodic)
 {
 	tinymac_header_t hdr;
 	tinymac_beacon_t beacon;
-	uint8_t addrlist[TINYMAC_MAX_NODES];
-	size_t npending = 0;
+	uint8_t addrlist[TINYMAC_MAX_NODES + TINYMAC_MAX_GROUPS];
+	uint8_t bitmap_buf[sizeof(tinymac_beacon_bitmap_t) + (TINYMAC_MAX_NODES + 7) / 8];
+	tinymac_beacon_bitmap_t *bitmap = (tinymac_beacon_bitmap_t*)bitmap_buf;
+	uint8_t min_addr = TINYMAC_ADDR_UNASSIGNED, max_addr = 0;
+	size_t npending = 0, bitmap_size;
+	boolean_t group_pending = FALSE;
 	unsigned int n;
 	phy_buf_t bufs[] = {
 			{ (char*)&hdr, sizeof(hdr) },
@@ -463,6 +855,7 @@ static int tinymac_tx_beacon(boolean_t periodic)
 		return 0;
 	}
 
+	memset(bitmap_buf, 0, sizeof(bitmap_buf));
 	if (periodic) {
 		tinymac_node_t *node;
 
@@ -471,38 +864,198 @@ static int tinymac_tx_beacon(boolean_t periodic)
 		for (n = 0; n < TINYMAC_MAX_NODES; n++, node++) {
 			if (node->state == tinymacNodeState_SendPending) {
 				addrlist[npending++] = node->addr;
+				if (node->addr < min_addr) {
+					min_addr = node->addr;
+				}
+				if (node->addr > max_addr) {
+					max_addr = node->addr;
+				}
+			}
+		}
+
+		/* Append groups with a packet to follow this beacon */
+		for (n = 0; n < TINYMAC_MAX_GROUPS; n++) {
+			if (tinymac_ctx->group_tx[n].pending) {
+				addrlist[npending++] = TINYMAC_ADDR_GROUP_BASE + n;
+				bitmap->groups |= 1 << n;
+				group_pending = TRUE;
 			}
 		}
 	}
 	bufs[2].size = npending;
 
+	/* Switch to a bitmap if that is smaller than the list */
+	bitmap_size = sizeof(tinymac_beacon_bitmap_t);
+	if (min_addr <= max_addr) {
+		bitmap_size += (max_addr - min_addr) / 8 + 1;
+	}
+	if (bitmap_size < npending) {
+		bitmap->base = min_addr;
+		for (n = 0; n < npending && !TINYMAC_IS_GROUP(addrlist[n]); n++) {
+			uint8_t bit = addrlist[n] - min_addr;
+			bitmap->nodes[bit / 8] |= 1 << (bit & 7);
+		}
+		bufs[2].buf = (char*)bitmap_buf;
+		bufs[2].size = bitmap_size;
+	}
+
 	/* Build beacon header */
 	beacon.uuid = tinymac_ctx->params.uuid;
 	beacon.timestamp = tinymac_ctx->slot;
 	beacon.beacon_interval = TINYMAC_BEACON_INTERVAL_NO_BEACON;
 	beacon.flags =
+			(bufs[2].buf == (char*)bitmap_buf ? TINYMAC_BEACON_FLAGS_BITMAP : 0) |
 			(periodic ? TINYMAC_BEACON_FLAGS_SYNC : 0) |
 			(tinymac_ctx->permit_attach ? TINYMAC_BEACON_FLAGS_PERMIT_ATTACH : 0);
 
 	/* Build packet header and send */
-	hdr.flags = TINYMAC_FLAGS_VERSION | tinymacType_Beacon;
+	hdr.flags = TINYMAC_FLAGS_VERSION | tinymacType_Beacon |
+			(group_pending ? TINYMAC_FLAGS_DATA_PENDING : 0);
 	hdr.net_id = tinymac_ctx->net_id;
 	hdr.src_addr = tinymac_ctx->addr;
 	hdr.dest_addr = TINYMAC_ADDR_BROADCAST;
 	hdr.seq = ++tinymac_ctx->bseq;
-	TRACE("BEACON: %04X %02X %02X %02X %02X\n", hdr.flags, hdr.net_id, hdr.dest_addr, hdr.src_addr, hdr.seq);
+	TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacBeacon, &hdr, bufs[1].size + bufs[2].size);
+	TINYMAC_STAT(tinymac_ctx->stats.beacons_tx++);
 	return tinymac_phy_send(bufs, ARRAY_SIZE(bufs), periodic ? PHY_FLAG_IMMEDIATE : 0);
 }
+
+static int tinymac_tx_group(uint8_t dest, uint8_t flags_type, const char *buf, size_t size,
+		uint16_t validity, tinymac_send_cb_t cb)
+{
+	tinymac_group_t *group = &tinymac_ctx->group_tx[dest - TINYMAC_ADDR_GROUP_BASE];
+	tinymac_node_t *node = tinymac_ctx->nodes;
+	tinymac_header_t hdr;
+	boolean_t sleepy = FALSE;
+	unsigned int n;
+	int rc;
+	phy_buf_t bufs[] = {
+			{ (char*)&hdr, sizeof(hdr) },
+			{ (char*)buf, size },
+	};
+
+	/* Check size against PHY MTU */
+	if (size > TINYMAC_MAX_PAYLOAD || (size + sizeof(hdr)) > tinymac_ctx->phy_mtu) {
+		ERROR("Packet too large\n");
+		return -1;
+	}
+
+	if (group->pending) {
+		ERROR("Group %02X is busy\n", dest);
+		return -1;
+	}
+
+	/* Build header - multicast packets are never acknowledged */
+	hdr.flags = TINYMAC_FLAGS_VERSION | (flags_type & ~TINYMAC_FLAGS_ACK_REQUEST);
+	hdr.net_id = tinymac_ctx->net_id;
+	hdr.src_addr = tinymac_ctx->addr;
+	hdr.dest_addr = dest;
+	hdr.seq = ++tinymac_ctx->dseq;
+
+	/* Check for sleeping members */
+	for (n = 0; n < TINYMAC_MAX_NODES; n++, node++) {
+		if (node->state != tinymacNodeState_Unregistered && (node->groups & TINYMAC_GROUP_BIT(dest)) &&
+				(node->flags & TINYMAC_ATTACH_FLAGS_SLEEPY)) {
+			sleepy = TRUE;
+			break;
+		}
+	}
+
+	if (sleepy) {
+		/* Hold the packet until after the next sync beacon, which will tell members
+		 * to stay awake for it */
+		TRACE("Pending transmission for group %02X\n", dest);
+		memcpy(&group->header, &hdr, sizeof(hdr));
+		memcpy(group->payload, buf, size);
+		group->size = size;
+		group->send_cb = cb;
+		group->pending = TRUE;
+		tinymac_set_timer(&group->validity_timer, tinymac_group_validity_timeout, group, TINYMAC_SECONDS(validity));
+		return 0;
+	}
+
+	TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacTx, &hdr, size);
+	rc = tinymac_phy_send(bufs, ARRAY_SIZE(bufs), 0);
+	if (rc >= 0 && cb) {
+		cb(0);
+	}
+	return rc;
+}
+
+/*! Send all multicast packets that were announced in the preceding sync beacon */
+static void tinymac_tx_groups_pending(void)
+{
+	tinymac_group_t *group = tinymac_ctx->group_tx;
+	unsigned int n;
+
+	for (n = 0; n < TINYMAC_MAX_GROUPS; n++, group++) {
+		if (group->pending) {
+			phy_buf_t bufs[] = {
+					{ (char*)&group->header, sizeof(tinymac_header_t) },
+					{ group->payload, group->size },
+			};
+			int rc;
+
+			TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacTxPending, &group->header, group->size);
+			group->pending = FALSE;
+			tinymac_cancel_timer(&group->validity_timer);
+			rc = tinymac_phy_send(bufs, ARRAY_SIZE(bufs), PHY_FLAG_IMMEDIATE);
+			if (group->send_cb) {
+				group->send_cb(rc < 0 ? rc : 0);
+			}
+		}
+	}
+}
 #endif
 
 /********************/
 /* Receive handlers */
 /********************/
 
+/*!
+ * Decode the pending list from a beacon, in either list or bitmap form
+ *
+ * \param beacon	Pointer to received beacon
+ * \param len		Size of the pending list or bitmap
+ * \param groups	Receives the set of groups with a packet following the beacon
+ * \return			TRUE if a packet is pending for this node
+ */
+static boolean_t tinymac_beacon_pending(const tinymac_beacon_t *beacon, size_t len, uint8_t *groups)
+{
+	boolean_t pending = FALSE;
+	unsigned int n;
+
+	if (beacon->flags & TINYMAC_BEACON_FLAGS_BITMAP) {
+		const tinymac_beacon_bitmap_t *bitmap = (const tinymac_beacon_bitmap_t*)beacon->address_list;
+		uint8_t bit = tinymac_ctx->addr - bitmap->base;
+
+		if (len < sizeof(tinymac_beacon_bitmap_t)) {
+			ERROR("Bad beacon bitmap\n");
+			return FALSE;
+		}
+		*groups = bitmap->groups;
+		return tinymac_ctx->addr >= bitmap->base &&
+				bit / 8 < len - sizeof(tinymac_beacon_bitmap_t) &&
+				(bitmap->nodes[bit / 8] & (1 << (bit & 7)));
+	}
+
+	for (n = 0; n < len; n++) {
+		uint8_t addr = beacon->address_list[n];
+
+		if (addr == tinymac_ctx->addr) {
+			pending = TRUE;
+		} else if (TINYMAC_IS_GROUP(addr)) {
+			*groups |= TINYMAC_GROUP_BIT(addr);
+		}
+	}
+	return pending;
+}
+
 static void tinymac_rx_beacon(tinymac_header_t *hdr, size_t size)
 {
 	tinymac_beacon_t *beacon = (tinymac_beacon_t*)hdr->payload;
 
+	TINYMAC_STAT(tinymac_ctx->stats.beacons_rx++);
 	if (tinymac_ctx->params.coordinator) {
 		/* Ignore beacons if we are a coordinator */
 		return;
@@ -515,55 +1068,62 @@ static void tinymac_rx_beacon(tinymac_header_t *hdr, size_t size)
 	TRACE("BEACON from %08" PRIX32 " %s\n", beacon->uuid, (beacon->flags & TINYMAC_BEACON_FLAGS_SYNC) ? "(SYNC)" : "(ADV)");
 #endif
 
-	/* Cancel beacon request timer */
-	if (tinymac_ctx->state == tinymacClientState_BeaconRequest) {
-		TRACE("Canceling beacon request timer\n");
-		tinymac_cancel_timer(&tinymac_ctx->timer);
-	}
-
 	if (beacon->flags & TINYMAC_BEACON_FLAGS_SYNC) {
 		/* FIXME: Sync clock */
 	}
 
 	switch (tinymac_ctx->state) {
 	case tinymacClientState_Unregistered:
+	case tinymacClientState_Backoff:
 	case tinymacClientState_BeaconRequest:
-		if (beacon->flags & TINYMAC_BEACON_FLAGS_PERMIT_ATTACH) {
-			tinymac_registration_request_t attach;
-
-			INFO("Attempting registration with %02X:%02X\n", hdr->net_id, hdr->src_addr);
+		/* Any beacon will do, including one solicited by another node, so cancel our own
+		 * beacon request or its holdoff */
+		TRACE("Canceling beacon request timer\n");
+		tinymac_cancel_timer(&tinymac_ctx->timer);
+		tinymac_ctx->state = tinymacClientState_Unregistered;
 
-			/* Temporarily bind with this network and send an attachment request */
-			tinymac_ctx->state = tinymacClientState_Registering;
+		if (beacon->flags & TINYMAC_BEACON_FLAGS_PERMIT_ATTACH) {
+			/* Temporarily bind with this network */
+			tinymac_ctx->state = tinymacClientState_RegistrationBackoff;
 			tinymac_ctx->net_id = hdr->net_id;
 
-			attach.uuid = tinymac_ctx->params.uuid;
-			attach.flags = tinymac_ctx->params.flags;
-
 			/* "register" this node as our coordinator */
 			tinymac_ctx->coord.state = tinymacNodeState_Registered;
 			tinymac_ctx->coord.addr = hdr->src_addr;
 			tinymac_ctx->coord.uuid = beacon->uuid;
 			tinymac_ctx->coord.flags = 0;
+			tinymac_ctx->coord.rx_seq_valid = FALSE;
+			TINYMAC_STAT(memset(&tinymac_ctx->coord.stats, 0, sizeof(tinymac_node_stats_t)));
 			tinymac_ctx->coord.last_heard = tinymac_ctx->tick_count;
 
-			tinymac_tx_packet(&tinymac_ctx->coord, (uint16_t)tinymacType_RegistrationRequest,
-					(const char*)&attach, sizeof(attach), 0, NULL);
-
-			/* Start callback timer */
-			tinymac_set_timer(&tinymac_ctx->timer, tinymac_request_timeout, NULL, TINYMAC_MILLIS(TINYMAC_REGISTRATION_TIMEOUT));
+			/* Every unregistered node in range heard this beacon, so hold off for a random
+			 * number of ticks before sending the registration request */
+			tinymac_set_timer(&tinymac_ctx->timer, tinymac_backoff_timeout, NULL, tinymac_backoff_delay());
 		}
 		break;
 	case tinymacClientState_Registered: {
-		unsigned int n;
+		uint8_t groups = 0;
+		boolean_t pending = tinymac_beacon_pending(beacon, size - sizeof(tinymac_header_t) - sizeof(tinymac_beacon_t), &groups);
+		boolean_t listen = pending;
+
+		if (pending) {
+			/* The poll requests an ack so that the pending packet can be returned
+			 * in a DataAck */
+			INFO("Polling coordinator for pending data\n");
+			tinymac_tx_packet(&tinymac_ctx->coord, (uint16_t)tinymacType_Poll | TINYMAC_FLAGS_ACK_REQUEST, NULL, 0, 0, NULL);
+		}
+		/* Catch up with group membership changes the coordinator hasn't acked */
+		tinymac_tx_group_request();
+		if (groups & tinymac_ctx->groups) {
+			/* Multicast packet follows the beacon - DATA_PENDING has kept us listening */
+			INFO("Waiting for groups %02X\n", groups & tinymac_ctx->groups);
+			listen = TRUE;
+		}
 
-		/* Check if we are in the address list */
-		for (n = 0; n < size - sizeof(tinymac_header_t) - sizeof(tinymac_beacon_t); n++) {
-			if (beacon->address_list[n] == tinymac_ctx->addr) {
-				INFO("Polling coordinator for pending data\n");
-				tinymac_tx_packet(&tinymac_ctx->coord, (uint16_t)tinymacType_Poll, NULL, 0, 0, NULL);
-				break;
-			}
+		if (!listen && (hdr->flags & TINYMAC_FLAGS_DATA_PENDING) &&
+				(tinymac_ctx->params.flags & TINYMAC_ATTACH_FLAGS_SLEEPY)) {
+			/* Packets following this beacon are for other groups */
+			phy_standby();
 		}
 	} break;
 	default:
@@ -574,12 +1134,20 @@ static void tinymac_rx_beacon(tinymac_header_t *hdr, size_t size)
 static void tinymac_rx_registration_response(tinymac_header_t *hdr, size_t size)
 {
 	tinymac_registration_response_t *addr = (tinymac_registration_response_t*)hdr->payload;
+	size_t count = (size - sizeof(tinymac_header_t)) / sizeof(tinymac_registration_response_t);
 
 	if (tinymac_ctx->params.coordinator) {
 		/* Ignore reg response if we are a coordinator */
 		return;
 	}
 
+	/* Broadcast responses may answer several registration requests - find ours */
+	if (hdr->dest_addr == TINYMAC_ADDR_BROADCAST) {
+		while (--count && addr->uuid != tinymac_ctx->params.uuid) {
+			addr++;
+		}
+	}
+
 #ifdef PRIX64
 	TRACE("REG RESPONSE for %016" PRIX64 " %02X\n", addr->uuid, addr->addr);
 #else
@@ -619,8 +1187,14 @@ static void tinymac_rx_registration_response(tinymac_header_t *hdr, size_t size)
 		/* Attachment - only if we are expecting it */
 		INFO("Accepting new address %02X:%02X\n", hdr->net_id, addr->addr);
 		tinymac_ctx->state = tinymacClientState_Registered;
+		tinymac_ctx->backoff = 0;
+		tinymac_ctx->implicit_ack = FALSE;
 		tinymac_ctx->addr = addr->addr;
 		tinymac_ctx->net_id = hdr->net_id;
+
+		/* Group memberships do not survive re-registration */
+		tinymac_ctx->groups_dirty = tinymac_ctx->groups ? TRUE : FALSE;
+		tinymac_tx_group_request();
 	}
 }
 
@@ -628,8 +1202,7 @@ static void tinymac_rx_registration_response(tinymac_header_t *hdr, size_t size)
 static void tinymac_rx_registration_request(tinymac_header_t *hdr, size_t size)
 {
 	tinymac_registration_request_t *attach = (tinymac_registration_request_t*)hdr->payload;
-	tinymac_registration_response_t resp;
-	tinymac_node_t *node;
+	unsigned int n;
 
 	if (!tinymac_ctx->params.coordinator) {
 		/* Ignore if not a coordinator */
@@ -638,39 +1211,107 @@ static void tinymac_rx_registration_request(tinymac_header_t *hdr, size_t size)
 
 	TRACE("REG REQUEST\n");
 
-	/* Search for existing registration */
-	node = tinymac_get_node_by_uuid(attach->uuid);
-	if (!node) {
-		/* Try to allocated new slot */
-		node = tinymac_get_free_node();
+	/* Requests are answered from the tick handler - a repeat of a request that
+	 * is already queued just updates the flags */
+	for (n = 0; n < tinymac_ctx->reg_queue_len; n++) {
+		if (tinymac_ctx->reg_queue[n].uuid == attach->uuid) {
+			tinymac_ctx->reg_queue[n].flags = attach->flags;
+			return;
+		}
 	}
 
-	if (node) {
-		INFO("Registered node %02X for %016" PRIX64 " with flags %04X\n", node->addr, attach->uuid, attach->flags);
-		node->state = tinymacNodeState_Registered;
-		node->uuid = attach->uuid;
-		node->flags = attach->flags;
-		node->last_heard = tinymac_ctx->tick_count;
+	if (tinymac_ctx->reg_queue_len == TINYMAC_REG_QUEUE_LEN) {
+		/* The node will back off and try again */
+		ERROR("Registration queue full\n");
+		return;
+	}
+	memcpy(&tinymac_ctx->reg_queue[tinymac_ctx->reg_queue_len++], attach, sizeof(tinymac_registration_request_t));
+}
 
-		resp.uuid = attach->uuid;
-		resp.addr = node->addr;
-		resp.status = tinymacRegistrationStatus_Success;
-	} else {
-		ERROR("Network full\n");
-		resp.uuid = attach->uuid;
-		resp.addr = TINYMAC_ADDR_UNASSIGNED;
-		resp.status = tinymacRegistrationStatus_NetworkFull;
+/*!
+ * Answer up to TINYMAC_REG_BATCH queued registration requests in a single
+ * broadcast response.  Called from the tick handler.
+ */
+static void tinymac_process_registrations(void)
+{
+	tinymac_registration_response_t resp[TINYMAC_REG_BATCH];
+	tinymac_node_t *registered[TINYMAC_REG_BATCH];
+	unsigned int n, count;
+
+	count = tinymac_ctx->reg_queue_len;
+	if (count > TINYMAC_REG_BATCH) {
+		count = TINYMAC_REG_BATCH;
+	}
+
+	for (n = 0; n < count; n++) {
+		tinymac_registration_request_t *attach = &tinymac_ctx->reg_queue[n];
+		tinymac_node_t *node;
+
+		/* Search for existing registration */
+		node = tinymac_get_node_by_uuid(attach->uuid);
+		if (!node) {
+			/* Try to allocated new slot */
+			node = tinymac_get_free_node();
+		}
+
+		if (node) {
+			INFO("Registered node %02X for %016" PRIX64 " with flags %04X\n", node->addr, attach->uuid, attach->flags);
+			TINYTRACE(MAC, TINYTRACE_INFO, tinytraceEvent_MacRegister, node->addr, (uint32_t)attach->uuid);
+			node->state = tinymacNodeState_Registered;
+			node->uuid = attach->uuid;
+			node->flags = attach->flags;
+			node->groups = 0;
+			node->rx_seq_valid = FALSE;
+			node->duplicates = 0;
+			TINYMAC_STAT(memset(&node->stats, 0, sizeof(node->stats)));
+			node->last_heard = tinymac_ctx->tick_count;
+			tinymac_store_node(node);
+
+			resp[n].uuid = attach->uuid;
+			resp[n].addr = node->addr;
+			resp[n].status = tinymacRegistrationStatus_Success;
+		} else {
+			ERROR("Network full\n");
+			resp[n].uuid = attach->uuid;
+			resp[n].addr = TINYMAC_ADDR_UNASSIGNED;
+			resp[n].status = tinymacRegistrationStatus_NetworkFull;
+		}
+		registered[n] = node;
 	}
 
+	/* Remove answered requests from the queue */
+	tinymac_ctx->reg_queue_len -= count;
+	memmove(tinymac_ctx->reg_queue, &tinymac_ctx->reg_queue[count],
+			tinymac_ctx->reg_queue_len * sizeof(tinymac_registration_request_t));
+
 	/* Send response */
 	tinymac_tx_packet(NULL, (uint16_t)tinymacType_RegistrationResponse,
-			(const char*)&resp, sizeof(resp), 0, NULL);
+			(const char*)resp, count * sizeof(tinymac_registration_response_t), 0, NULL);
 
-	/* Invoke callback */
-	if (tinymac_ctx->reg_cb) {
-		tinymac_ctx->reg_cb((const tinymac_node_t*)node);
+	/* Invoke callbacks */
+	for (n = 0; n < count; n++) {
+		if (tinymac_ctx->reg_cb && registered[n]) {
+			tinymac_ctx->reg_cb((const tinymac_node_t*)registered[n]);
+		}
+	}
+}
+
+static void tinymac_rx_group_request(tinymac_node_t *node, tinymac_header_t *hdr, size_t size)
+{
+	tinymac_group_request_t *req = (tinymac_group_request_t*)hdr->payload;
+
+	if (!tinymac_ctx->params.coordinator || !node) {
+		/* Ignore if not a coordinator or from an unregistered node */
+		return;
+	}
+
+	TRACE("GROUP REQUEST\n");
+
+	if (node->groups != req->groups) {
+		INFO("Node %02X group memberships %02X\n", node->addr, req->groups);
+		node->groups = req->groups;
+		tinymac_store_node(node);
 	}
-	tinymac_dump_nodes();
 }
 
 static void tinymac_rx_deregistration_request(tinymac_header_t *hdr, size_t size)
@@ -706,14 +1347,149 @@ static void tinymac_rx_deregistration_request(tinymac_header_t *hdr, size_t size
 }
 #endif
 
+/*!
+ * Check a received sequence number against the last one received from the same
+ * node.  Only packets requesting an ack are checked, because only these are ever
+ * retransmitted.  A sender has only one of these in flight at a time, so a
+ * retransmission can only repeat the latest sequence number.  (Sequence numbers
+ * are shared by all of the sender's destinations, so older ones will come round
+ * again in new packets.)
+ *
+ * \return			TRUE if the packet is a duplicate and should not be delivered
+ */
+static boolean_t tinymac_rx_duplicate(tinymac_node_t *node, uint8_t seq)
+{
+	if (node->rx_seq_valid && node->rx_seq == seq) {
+		INFO("Duplicate %02X from node %02X\n", seq, node->addr);
+		TINYTRACE(MAC, TINYTRACE_INFO, tinytraceEvent_MacDuplicate, node->addr, seq);
+		node->duplicates++;
+		TINYMAC_STAT(node->stats.duplicates++);
+		return TRUE;
+	}
+
+	node->rx_seq = seq;
+	node->rx_seq_valid = TRUE;
+	return FALSE;
+}
+
+/*! Handle the acknowledgement part of an Ack or DataAck */
+static void tinymac_rx_ack(tinymac_node_t *node, tinymac_header_t *hdr)
+{
+	if (node && node->state == tinymacNodeState_WaitAck) {
+		if (hdr->seq == node->pending_header.seq) {
+			/* Ack ok, cancel timers */
+			node->state = tinymacNodeState_Registered;
+			tinymac_cancel_timer(&node->ack_timer);
+			tinymac_cancel_timer(&node->validity_timer);
+			tinymac_stats_acked(node);
+
+			/* Callback success */
+			if (node->send_cb) {
+				node->send_cb(0);
+			}
+			if (node == &tinymac_ctx->coord) {
+				/* Link is free again */
+				tinymac_tx_group_request();
+			}
+		} else {
+			ERROR("Bad ack received from %02X\n", hdr->src_addr);
+		}
+	} else {
+		ERROR("Unexpected ACK\n");
+	}
+}
+
+#if WITH_TINYMAC_COORDINATOR
+/*!
+ * Check the first frame received from a node after a DataAck carrying a packet
+ * that requested an ack.  The frame confirms delivery if it has the implicit ack
+ * flag set, otherwise the DataAck is assumed lost and the packet is sent again.
+ */
+static void tinymac_rx_implicit_ack(tinymac_node_t *node, tinymac_header_t *hdr)
+{
+	if (hdr->flags & TINYMAC_FLAGS_IMPLICIT_ACK) {
+		node->state = tinymacNodeState_Registered;
+		tinymac_cancel_timer(&node->validity_timer);
+		tinymac_stats_acked(node);
+		if (node->send_cb) {
+			node->send_cb(0);
+		}
+	} else if (node->retries--) {
+		INFO("No implicit ack from node %02X\n", node->addr);
+		TINYMAC_STAT(node->stats.retries++);
+		node->state = tinymacNodeState_SendPending;
+	} else {
+		/* Node is alive but not accepting the packet - give up on it */
+		TINYMAC_STAT(tinymac_ctx->stats.send_failures++);
+		node->state = tinymacNodeState_Registered;
+		tinymac_cancel_timer(&node->validity_timer);
+		if (node->send_cb) {
+			node->send_cb(-1);
+		}
+	}
+}
+#endif
+
+/*! Pass a received data packet to the upper layer, unpacking aggregate frames */
+static void tinymac_rx_data(tinymac_node_t *node, uint8_t type, const char *buf, size_t size)
+{
+	if (!tinymac_ctx->rx_cb) {
+		return;
+	}
+
+	if (type != tinymacType_Aggregate) {
+		tinymac_ctx->rx_cb((const tinymac_node_t*)node, type, buf, size);
+		return;
+	}
+
+	while (size >= sizeof(tinymac_aggregate_header_t)) {
+		const tinymac_aggregate_header_t *sub = (const tinymac_aggregate_header_t*)buf;
+
+		if (sub->size > size - sizeof(tinymac_aggregate_header_t) ||
+				(sub->type & TINYMAC_FLAGS_TYPE_MASK) < tinymacType_RawData) {
+			ERROR("Bad aggregate frame\n");
+			return;
+		}
+		TINYTRACE(MAC, TINYTRACE_DEBUG, tinytraceEvent_MacRxAggregated, node ? node->addr : TINYMAC_ADDR_UNASSIGNED,
+				((uint32_t)sub->type << 16) | sub->size);
+		tinymac_ctx->rx_cb((const tinymac_node_t*)node, sub->type & TINYMAC_FLAGS_TYPE_MASK, sub->payload, sub->size);
+
+		buf += sizeof(tinymac_aggregate_header_t) + sub->size;
+		size -= sizeof(tinymac_aggregate_header_t) + sub->size;
+	}
+}
+
+/*! Deliver the packet carried by a DataAck and arrange to acknowledge it if required */
+static void tinymac_rx_data_ack(tinymac_node_t *node, tinymac_header_t *hdr, size_t size)
+{
+	tinymac_data_ack_t *dack = (tinymac_data_ack_t*)hdr->payload;
+	uint8_t type = dack->flags & TINYMAC_FLAGS_TYPE_MASK;
+
+	if (!node || (type < tinymacType_RawData && type != tinymacType_Aggregate)) {
+		ERROR("Bad data ack\n");
+		return;
+	}
+	if (dack->flags & TINYMAC_FLAGS_ACK_REQUEST) {
+		/* A repeated DataAck means our implicit ack was lost - ack again but
+		 * don't deliver */
+		tinymac_ctx->implicit_ack = TRUE;
+		if (tinymac_rx_duplicate(node, dack->seq)) {
+			return;
+		}
+	}
+	tinymac_rx_data(node, type, dack->payload, size - sizeof(tinymac_header_t) - sizeof(tinymac_data_ack_t));
+}
+
 static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 {
 	tinymac_header_t *hdr = (tinymac_header_t*)buf;
 	tinymac_node_t *node = NULL;
 	uint8_t type = hdr->flags & TINYMAC_FLAGS_TYPE_MASK;
 
+	TINYMAC_STAT(tinymac_ctx->stats.rx_frames++);
 	if (size < sizeof(tinymac_header_t)) {
 		ERROR("Discarding short packet\n");
+		TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 		return;
 	}
 
@@ -722,17 +1498,20 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 		return;
 	}
 
-	TRACE("IN: %04X %02X %02X %02X %02X (%zu)\n", hdr->flags, hdr->net_id, hdr->dest_addr, hdr->src_addr, hdr->seq, size - sizeof(tinymac_header_t));
+	TINYTRACE_MAC_HDR(TINYTRACE_DEBUG, tinytraceEvent_MacRx, hdr, size - sizeof(tinymac_header_t));
 
 	/*
 	 * Accept packets addressed to the following destinations only:
 	 * a) our own network and short address
 	 * b) our own network and broadcast address
-	 * c) wildcard network and broadcast address
-	 * d) any network and broadcast address only if we are not registered
+	 * c) our own network and the address of a group we have joined
+	 * d) wildcard network and broadcast address
+	 * e) any network and broadcast address only if we are not registered
 	 */
 	if (!(	(hdr->net_id == tinymac_ctx->net_id &&
 			(hdr->dest_addr == tinymac_ctx->addr || hdr->dest_addr == TINYMAC_ADDR_BROADCAST)) ||
+			(hdr->net_id == tinymac_ctx->net_id && TINYMAC_IS_GROUP(hdr->dest_addr) &&
+					(tinymac_ctx->groups & TINYMAC_GROUP_BIT(hdr->dest_addr))) ||
 			(hdr->net_id == TINYMAC_NETWORK_ANY && hdr->dest_addr == TINYMAC_ADDR_BROADCAST) ||
 			(tinymac_ctx->net_id == TINYMAC_NETWORK_ANY && hdr->dest_addr == TINYMAC_ADDR_BROADCAST)) ) {
 		TRACE("Ignoring packet with destination %02X:%02X\n", hdr->net_id, hdr->dest_addr);
@@ -767,11 +1546,15 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 	if (tinymac_ctx->addr != TINYMAC_ADDR_UNASSIGNED && hdr->src_addr != TINYMAC_ADDR_UNASSIGNED) {
 		node = tinymac_get_node_by_addr(hdr->src_addr);
 		if (node) {
-			/* Update last heard */
-			INFO("Updated last_heard for node %02X\n", hdr->src_addr);
 			node->last_heard = tinymac_ctx->tick_count;
 			node->rssi = (int8_t)rssi;
+			tinymac_stats_rx(node, rssi);
 
+#if WITH_TINYMAC_COORDINATOR
+			if (node->state == tinymacNodeState_WaitImplicitAck) {
+				tinymac_rx_implicit_ack(node, hdr);
+			}
+#endif
 			if (hdr->flags & TINYMAC_FLAGS_ACK_REQUEST) {
 				/* Acknowledgement requested */
 				tinymac_tx_ack(node, hdr->seq);
@@ -781,6 +1564,8 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 		} else {
 			/* Address not registered */
 			ERROR("Ignoring unknown source node %02X\n", hdr->src_addr);
+			TINYTRACE_MAC_HDR(TINYTRACE_ERROR, tinytraceEvent_MacDrop, hdr, size - sizeof(tinymac_header_t));
+			TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 #if WITH_TINYMAC_COORDINATOR
 			if (tinymac_ctx->params.coordinator) {
 				/* Fake destination */
@@ -803,12 +1588,13 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 		}
 	}
 
-	if (type >= tinymacType_RawData) {
-		/* Forward non-MAC packets to the upper layer */
-		TRACE("RX DATA (0x%02X)\n", type);
-		if (tinymac_ctx->rx_cb) {
-			tinymac_ctx->rx_cb((const tinymac_node_t*)node, type & TINYMAC_FLAGS_TYPE_MASK, hdr->payload, size - sizeof(tinymac_header_t));
+	if (type >= tinymacType_RawData || type == tinymacType_Aggregate) {
+		/* Forward non-MAC packets to the upper layer.  Retransmissions have already
+		 * been acked above but are not passed up again */
+		if (node && (hdr->flags & TINYMAC_FLAGS_ACK_REQUEST) && tinymac_rx_duplicate(node, hdr->seq)) {
+			return;
 		}
+		tinymac_rx_data(node, type, hdr->payload, size - sizeof(tinymac_header_t));
 	} else {
 		/* Handle MAC control packets */
 		switch (type) {
@@ -816,46 +1602,39 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 			/* Beacon */
 			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_beacon_t)) {
 				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 				return;
 			}
 			tinymac_rx_beacon(hdr, size);
 			break;
 		case tinymacType_Ack:
 			/* Acknowledgement */
-			TRACE("RX ACK\n");
-
-			if (node && node->state == tinymacNodeState_WaitAck) {
-				if (hdr->seq == node->pending_header.seq) {
-					/* Ack ok, cancel timers */
-					TRACE("Valid ack received from %02X for %02X\n", hdr->src_addr, hdr->seq);
-					node->state = tinymacNodeState_Registered;
-					tinymac_cancel_timer(&node->ack_timer);
-					tinymac_cancel_timer(&node->validity_timer);
-
-					/* Callback success */
-					if (node->send_cb) {
-						node->send_cb(0);
-					}
-				} else {
-					ERROR("Bad ack received from %02X\n", hdr->src_addr);
-				}
-			} else {
-				ERROR("Unexpected ACK\n");
+			tinymac_rx_ack(node, hdr);
+			break;
+		case tinymacType_DataAck:
+			/* Acknowledgement carrying a packet for us */
+			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_data_ack_t)) {
+				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
+				return;
 			}
+			tinymac_rx_ack(node, hdr);
+			tinymac_rx_data_ack(node, hdr, size);
 			break;
 		case tinymacType_Poll:
 			/* This just solicits an ack, which happens above */
-			TRACE("POLL\n");
 			break;
 #if WITH_TINYMAC_COORDINATOR
 		case tinymacType_BeaconRequest:
-			/* This solicits an extra beacon */
+			/* This solicits an extra beacon.  Requests are coalesced into a single
+			 * advertisement sent on the next tick */
 			TRACE("BEACON REQUEST\n");
-			tinymac_tx_beacon(FALSE);
+			tinymac_ctx->beacon_requested = TRUE;
 			break;
 		case tinymacType_RegistrationRequest:
 			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_registration_request_t)) {
 				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 				return;
 			}
 			tinymac_rx_registration_request(hdr, size);
@@ -863,21 +1642,32 @@ static void tinymac_recv_cb(const char *buf, size_t size, int rssi)
 		case tinymacType_DeregistrationRequest:
 			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_deregistration_request_t)) {
 				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 				return;
 			}
 			tinymac_rx_deregistration_request(hdr, size);
 			break;
+		case tinymacType_GroupRequest:
+			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_group_request_t)) {
+				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
+				return;
+			}
+			tinymac_rx_group_request(node, hdr, size);
+			break;
 #endif
 		case tinymacType_RegistrationResponse:
 			/* Attach/detach response message */
 			if (size < sizeof(tinymac_header_t) + sizeof(tinymac_registration_response_t)) {
 				ERROR("Discarding short packet\n");
+				TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 				return;
 			}
 			tinymac_rx_registration_response(hdr, size);
 			break;
 		default:
 			ERROR("Unsupported packet type\n");
+			TINYMAC_STAT(tinymac_ctx->stats.rx_dropped++);
 		}
 	}
 }
@@ -901,15 +1691,21 @@ int tinymac_init(const tinymac_params_t *params)
 	}
 	tinymac_ctx->bseq = rand();
 	tinymac_ctx->permit_attach = FALSE;
+	tinymac_ctx->beacon_requested = FALSE;
+	tinymac_ctx->reg_queue_len = 0;
 #endif
 	tinymac_ctx->dseq = rand();
 	tinymac_ctx->coord.state = tinymacNodeState_Unregistered;
+	tinymac_ctx->backoff = 0;
 
 #if WITH_TINYMAC_COORDINATOR
 	if (tinymac_ctx->params.coordinator) {
 		tinymac_ctx->state = tinymacClientState_Registered; /* FIXME: Needed? */
 		tinymac_ctx->net_id = rand();
 		tinymac_ctx->addr = 0x00;
+#if WITH_TINYMAC_STORE
+		tinymac_restore_nodes();
+#endif
 	} else
 #endif
 	{
@@ -946,9 +1742,20 @@ void tinymac_tick_handler(void *arg)
 		/* This is called once per beacon slot (250 ms) - check if a beacon is due in this
 		 * slot and increment the counter */
 		if (((++tinymac_ctx->slot) & ((1 << tinymac_ctx->params.beacon_interval) - 1)) == tinymac_ctx->params.beacon_offset) {
-			/* Beacon due */
+			/* Beacon due - this also answers any outstanding beacon requests */
 			tinymac_tx_beacon(TRUE);
-			TRACE("sync beacon sent\n");
+			tinymac_ctx->beacon_requested = FALSE;
+
+			/* Multicast packets announced in the beacon follow immediately */
+			tinymac_tx_groups_pending();
+		} else if (tinymac_ctx->beacon_requested) {
+			/* One advertisement per slot regardless of the number of requests */
+			tinymac_tx_beacon(FALSE);
+			tinymac_ctx->beacon_requested = FALSE;
+		} else if (tinymac_ctx->reg_queue_len) {
+			/* Registration responses are limited to one frame per slot, and are not sent
+			 * in slots that already carry a beacon */
+			tinymac_process_registrations();
 		}
 
 		/* Do per-node ops */
@@ -971,22 +1778,28 @@ void tinymac_tick_handler(void *arg)
 			tinymac_despatch_timer(&node->ack_timer);
 			tinymac_despatch_timer(&node->validity_timer);
 		}
+		for (n = 0; n < TINYMAC_MAX_GROUPS; n++) {
+			tinymac_despatch_timer(&tinymac_ctx->group_tx[n].validity_timer);
+		}
+#if WITH_TINYMAC_AGGREGATE
+		tinymac_despatch_timer(&tinymac_ctx->agg_timer);
+#endif
 	} else
 #endif
 	{
-		/* Unregistered clients may request a beacon */
+		/* Unregistered clients may request a beacon after a random holdoff */
 		if (tinymac_ctx->state == tinymacClientState_Unregistered) {
-			tinymac_ctx->state = tinymacClientState_BeaconRequest;
-			tinymac_tx_packet(NULL, (uint16_t)tinymacType_BeaconRequest, NULL, 0, 0, NULL);
-
-			/* Set a timer for beacon request timeout */
-			tinymac_set_timer(&tinymac_ctx->timer, tinymac_request_timeout, NULL, TINYMAC_SECONDS(TINYMAC_BEACON_REQUEST_TIMEOUT));
+			tinymac_ctx->state = tinymacClientState_Backoff;
+			tinymac_set_timer(&tinymac_ctx->timer, tinymac_backoff_timeout, NULL, tinymac_backoff_delay());
 		}
 
 		/* Despatch deferred operations */
 		tinymac_despatch_timer(&tinymac_ctx->coord.ack_timer);
 		tinymac_despatch_timer(&tinymac_ctx->coord.validity_timer);
 		tinymac_despatch_timer(&tinymac_ctx->timer);
+#if WITH_TINYMAC_AGGREGATE
+		tinymac_despatch_timer(&tinymac_ctx->agg_timer);
+#endif
 	}
 
 	tinymac_ctx->tick_count++;
@@ -996,6 +1809,16 @@ int tinymac_send(uint8_t dest, uint8_t type,
 		const char *buf, size_t size,
 		uint16_t validity,
 		tinymac_send_cb_t cb)
+{
+	phy_buf_t frag = { (char*)buf, size };
+
+	return tinymac_sendv(dest, type, &frag, 1, validity, cb);
+}
+
+int tinymac_sendv(uint8_t dest, uint8_t type,
+		const phy_buf_t *frags, unsigned int nfrags,
+		uint16_t validity,
+		tinymac_send_cb_t cb)
 {
 	tinymac_node_t *node;
 
@@ -1004,6 +1827,33 @@ int tinymac_send(uint8_t dest, uint8_t type,
 		return -1;
 	}
 
+#if WITH_TINYMAC_COORDINATOR
+	if (tinymac_ctx->params.coordinator && TINYMAC_IS_GROUP(dest)) {
+		char buf[TINYMAC_MAX_PAYLOAD];
+		size_t size = 0;
+		unsigned int n;
+
+		if (validity == 0) {
+			/* Default validity period to one beacon interval */
+			validity = ((1 << tinymac_ctx->params.beacon_interval) * TINYMAC_TICK_MS + 999) / 1000;
+		}
+		if (nfrags == 1) {
+			return tinymac_tx_group(dest, type, frags[0].buf, frags[0].size, validity, cb);
+		}
+
+		/* Group packets may be held, so they are kept whole */
+		for (n = 0; n < nfrags; n++) {
+			size += frags[n].size;
+		}
+		if (size > sizeof(buf)) {
+			ERROR("Packet too large\n");
+			return -1;
+		}
+		tinymac_gather(buf, frags, nfrags);
+		return tinymac_tx_group(dest, type, buf, size, validity, cb);
+	}
+#endif
+
 	node = tinymac_get_node_by_addr(dest);
 	if (!node) {
 		ERROR("Node %02X not registered\n", dest);
@@ -1015,7 +1865,7 @@ int tinymac_send(uint8_t dest, uint8_t type,
 		validity = 1 << (node->flags & TINYMAC_ATTACH_HEARTBEAT_MASK);
 	}
 
-	return tinymac_tx_packet(node, type, buf, size, validity, cb);
+	return tinymac_tx_packetv(node, type, frags, nfrags, validity, cb);
 }
 
 int tinymac_is_registered(void)
@@ -1023,6 +1873,171 @@ int tinymac_is_registered(void)
 	return (tinymac_ctx->state == tinymacClientState_Registered) ? 1 : 0;
 }
 
+#if WITH_TINYMAC_STATS
+int tinymac_get_stats(tinymac_stats_t *stats)
+{
+	tinymac_stats_read(stats, &tinymac_ctx->stats, sizeof(tinymac_stats_t));
+
+	/* Maintained by the PHY */
+	stats->crc_errors = phy_get_crc_errors();
+	return 0;
+}
+
+int tinymac_get_node_stats(uint8_t addr, tinymac_node_stats_t *stats)
+{
+	tinymac_node_t *node = NULL;
+#if WITH_TINYMAC_COORDINATOR
+	unsigned int n;
+
+	/* Slots are not searched by state, which may be changing under us.  Statistics
+	 * remain readable after a node has gone away */
+	if (tinymac_ctx->params.coordinator) {
+		for (n = 0; n < TINYMAC_MAX_NODES; n++) {
+			if (tinymac_ctx->nodes[n].uuid && tinymac_ctx->nodes[n].addr == addr) {
+				node = &tinymac_ctx->nodes[n];
+				break;
+			}
+		}
+	} else
+#endif
+	if (tinymac_ctx->coord.addr == addr) {
+		node = &tinymac_ctx->coord;
+	}
+
+	if (!node) {
+		return -1;
+	}
+	tinymac_stats_read(stats, &node->stats, sizeof(tinymac_node_stats_t));
+	return 0;
+}
+#endif
+
+#if WITH_TINYMAC_AGGREGATE
+/*! Timer callback invoked when the earliest deadline in the aggregate frame expires */
+static void tinymac_aggregate_timeout(void *arg)
+{
+	if (tinymac_flush() < 0 && tinymac_ctx->agg_size) {
+		/* Destination busy - try again on the next tick */
+		tinymac_set_timer(&tinymac_ctx->agg_timer, tinymac_aggregate_timeout, NULL, 1);
+	}
+}
+
+int tinymac_send_aggregate(uint8_t dest, uint8_t type, const char *buf, size_t size, uint16_t deadline)
+{
+	tinymac_aggregate_header_t sub;
+	size_t limit = tinymac_ctx->phy_mtu - sizeof(tinymac_header_t);
+	uint32_t expiry;
+
+	if ((type & TINYMAC_FLAGS_TYPE_MASK) < tinymacType_RawData) {
+		ERROR("Bad type %02X\n", type & TINYMAC_FLAGS_TYPE_MASK);
+		return -1;
+	}
+
+	if (limit > TINYMAC_MAX_PAYLOAD) {
+		limit = TINYMAC_MAX_PAYLOAD;
+	}
+	if (sizeof(sub) + size > limit) {
+		ERROR("Packet too large\n");
+		return -1;
+	}
+
+	/* Send the current frame first if this packet can't be added to it */
+	if (tinymac_ctx->agg_size &&
+			(tinymac_ctx->agg_dest != dest || tinymac_ctx->agg_size + sizeof(sub) + size > limit)) {
+		if (tinymac_flush() < 0) {
+			return -1;
+		}
+	}
+
+	/* Append packet */
+	sub.type = type & TINYMAC_FLAGS_TYPE_MASK;
+	sub.size = (uint8_t)size;
+	memcpy(&tinymac_ctx->agg_buf[tinymac_ctx->agg_size], &sub, sizeof(sub));
+	memcpy(&tinymac_ctx->agg_buf[tinymac_ctx->agg_size + sizeof(sub)], buf, size);
+	tinymac_ctx->agg_size += sizeof(sub) + size;
+	tinymac_ctx->agg_flags |= type & TINYMAC_FLAGS_ACK_REQUEST;
+	tinymac_ctx->agg_dest = dest;
+
+	/* Flush now if there is no room for another packet, otherwise run the timer
+	 * for the earliest deadline */
+	if (tinymac_ctx->agg_size + sizeof(sub) >= limit) {
+		if (tinymac_flush() < 0) {
+			if (!tinymac_ctx->agg_size) {
+				/* Discarded along with the rest of the frame */
+				return -1;
+			}
+			/* Destination busy - the frame is kept, so try again on the next tick */
+			tinymac_set_timer(&tinymac_ctx->agg_timer, tinymac_aggregate_timeout, NULL, 1);
+		}
+		return 0;
+	}
+	expiry = tinymac_ctx->tick_count + TINYMAC_MILLIS(deadline);
+	if (!tinymac_ctx->agg_timer.callback || (int32_t)(expiry - tinymac_ctx->agg_timer.expiry) < 0) {
+		tinymac_set_timer(&tinymac_ctx->agg_timer, tinymac_aggregate_timeout, NULL, TINYMAC_MILLIS(deadline));
+	}
+	return 0;
+}
+
+int tinymac_flush(void)
+{
+	tinymac_node_t *node;
+	int rc;
+
+	if (!tinymac_ctx->agg_size) {
+		return 0;
+	}
+
+	node = tinymac_get_node_by_addr(tinymac_ctx->agg_dest);
+	if (!node) {
+		/* Destination has gone away - discard */
+		ERROR("Node %02X not registered\n", tinymac_ctx->agg_dest);
+		tinymac_ctx->agg_size = 0;
+		tinymac_ctx->agg_flags = 0;
+		tinymac_cancel_timer(&tinymac_ctx->agg_timer);
+		return -1;
+	}
+
+	rc = tinymac_tx_packet(node, tinymacType_Aggregate | tinymac_ctx->agg_flags,
+			tinymac_ctx->agg_buf, tinymac_ctx->agg_size,
+			1 << (node->flags & TINYMAC_ATTACH_HEARTBEAT_MASK), NULL);
+	if (rc < 0) {
+		/* Keep the frame if the destination is busy */
+		return rc;
+	}
+
+	tinymac_ctx->agg_size = 0;
+	tinymac_ctx->agg_flags = 0;
+	tinymac_cancel_timer(&tinymac_ctx->agg_timer);
+	return rc;
+}
+#endif
+
+int tinymac_join_group(uint8_t group)
+{
+	if (!TINYMAC_IS_GROUP(group)) {
+		ERROR("Bad group %02X\n", group);
+		return -1;
+	}
+
+	tinymac_ctx->groups |= TINYMAC_GROUP_BIT(group);
+	tinymac_ctx->groups_dirty = TRUE;
+	tinymac_tx_group_request();
+	return 0;
+}
+
+int tinymac_leave_group(uint8_t group)
+{
+	if (!TINYMAC_IS_GROUP(group)) {
+		ERROR("Bad group %02X\n", group);
+		return -1;
+	}
+
+	tinymac_ctx->groups &= ~TINYMAC_GROUP_BIT(group);
+	tinymac_ctx->groups_dirty = TRUE;
+	tinymac_tx_group_request();
+	return 0;
+}
+
 unsigned int tinymac_get_mtu(void)
 {
 	return phy_get_mtu() - sizeof(tinymac_header_t);
@@ -1060,19 +2075,50 @@ void tinymac_dump_nodes(void)
 	printf("Permit attach: %s\n", tinymac_ctx->permit_attach ? "Yes" : "No");
 	printf("\nKnown nodes:\n\n");
 
-	printf("Addr  UUID              State             RSSI  Last Heard Ago  Heartbeat  Sleepy\n");
-	printf("---------------------------------------------------------------------------------\n");
+	printf("Addr  UUID              State             RSSI  Last Heard Ago  Heartbeat  Dups   Sleepy\n");
+	printf("----------------------------------------------------------------------------------------\n");
 	for (n = 0; n < TINYMAC_MAX_NODES; n++, node++) {
 		if (node->uuid) {
-			printf("%02X    %016" PRIX64 "  %16s  %4d  %14u  %9u  %s\n",
+			printf("%02X    %016" PRIX64 "  %16s  %4d  %14u  %9u  %5u  %s\n",
 					node->addr, node->uuid, tinymac_node_states[node->state],
 					node->rssi,
 					(tinymac_ctx->tick_count - node->last_heard) * TINYMAC_TICK_MS / 1000,
 					(1 << (node->flags & TINYMAC_ATTACH_HEARTBEAT_MASK)),
+					node->duplicates,
 					(node->flags & TINYMAC_ATTACH_FLAGS_SLEEPY) ? "Yes" : "");
 		}
 	}
 
+#if WITH_TINYMAC_STATS
+	{
+		tinymac_stats_t stats;
+		unsigned int b;
+
+		printf("\nLink statistics:\n\n");
+		printf("Addr  Tx Frames  Rx Frames  Retries  Ack T/O  Expired  RSSI Avg/Min/Max  Ack latency (ms 0,1,2-3,4-7,..)\n");
+		printf("---------------------------------------------------------------------------------------------------------\n");
+		node = tinymac_ctx->nodes;
+		for (n = 0; n < TINYMAC_MAX_NODES; n++, node++) {
+			if (node->uuid) {
+				printf("%02X    %9" PRIu32 "  %9" PRIu32 "  %7" PRIu32 "  %7" PRIu32 "  %7" PRIu32 "  %4d/%4d/%4d    ",
+						node->addr, node->stats.tx_frames, node->stats.rx_frames,
+						node->stats.retries, node->stats.ack_timeouts, node->stats.validity_expiries,
+						node->stats.rssi_avg / 16, node->stats.rssi_min, node->stats.rssi_max);
+				for (b = 0; b < TINYMAC_LATENCY_BUCKETS; b++) {
+					printf(" %u", node->stats.latency[b]);
+				}
+				printf("\n");
+			}
+		}
+
+		tinymac_get_stats(&stats);
+		printf("\nTx frames %" PRIu32 " (errors %" PRIu32 "), Rx frames %" PRIu32 " (dropped %" PRIu32 ", CRC errors %" PRIu32 ")\n",
+				stats.tx_frames, stats.tx_errors, stats.rx_frames, stats.rx_dropped, stats.crc_errors);
+		printf("Beacons tx %" PRIu32 " rx %" PRIu32 ", Failed sends %" PRIu32 "\n",
+				stats.beacons_tx, stats.beacons_rx, stats.send_failures);
+	}
+#endif
+
 }
 #endif
 
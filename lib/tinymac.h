@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include "common.h"
+#include "phy.h"
 
 #define TINYMAC_MAX_UUID_STRING				16
 
@@ -35,6 +36,13 @@
 #define TINYMAC_ADDR_UNASSIGNED				0xFF
 #define TINYMAC_NETWORK_ANY					0xFF
 
+/*! Multicast group addresses are TINYMAC_ADDR_GROUP_BASE to
+ * TINYMAC_ADDR_GROUP_BASE + TINYMAC_MAX_GROUPS - 1 */
+#define TINYMAC_ADDR_GROUP_BASE				0xF0
+#define TINYMAC_MAX_GROUPS					8
+#define TINYMAC_IS_GROUP(addr)				((uint8_t)((addr) - TINYMAC_ADDR_GROUP_BASE) < TINYMAC_MAX_GROUPS)
+#define TINYMAC_GROUP_BIT(addr)				(1 << ((addr) - TINYMAC_ADDR_GROUP_BASE))
+
 /*! Tick interval in ms */
 #define TINYMAC_TICK_MS						250
 
@@ -51,6 +59,7 @@ typedef struct {
 #define TINYMAC_FLAGS_VERSION_SHIFT			13
 #define TINYMAC_FLAGS_VERSION_MASK			(7 << 13)
 
+#define TINYMAC_FLAGS_IMPLICIT_ACK			(1 << 8)
 #define TINYMAC_FLAGS_DATA_PENDING			(1 << 7)
 #define TINYMAC_FLAGS_ACK_REQUEST			(1 << 6)
 
@@ -65,9 +74,9 @@ typedef enum {
 	tinymacType_RegistrationRequest,
 	tinymacType_DeregistrationRequest,
 	tinymacType_RegistrationResponse,
-	tinymacType_Reserved7,
-	tinymacType_Reserved8,
-	tinymacType_Reserved9,
+	tinymacType_GroupRequest,
+	tinymacType_Aggregate,
+	tinymacType_DataAck,
 	tinymacType_Reserved10,
 	tinymacType_Reserved11,
 	tinymacType_Reserved12,
@@ -103,6 +112,7 @@ typedef struct {
 #define TINYMAC_BEACON_FLAGS_FSECONDS_SHIFT		6
 #define TINYMAC_BEACON_FLAGS_FSECONDS_MASK		(3 << 6)
 
+#define TINYMAC_BEACON_FLAGS_BITMAP				(1 << 2)
 #define TINYMAC_BEACON_FLAGS_PERMIT_ATTACH		(1 << 1)
 #define TINYMAC_BEACON_FLAGS_SYNC				(1 << 0)
 
@@ -113,11 +123,20 @@ typedef struct {
 
 #define TINYMAC_BEACON_INTERVAL_NO_BEACON		0x0f
 
+/*! Replaces the beacon's address list when TINYMAC_BEACON_FLAGS_BITMAP is set.  The
+ * coordinator uses whichever encoding is smaller. */
+typedef struct {
+	uint8_t			groups;			/*< Groups with a packet following the beacon (\see TINYMAC_GROUP_BIT) */
+	uint8_t			base;			/*< Short address corresponding to bit 0 of nodes[0] */
+	uint8_t			nodes[0];		/*< Bit (addr - base) is set if a packet is pending for addr */
+} PACKED tinymac_beacon_bitmap_t;
+
 typedef struct {
 	uint64_t		uuid;
 	uint16_t		flags;
 } PACKED tinymac_registration_request_t;
 
+#define TINYMAC_ATTACH_FLAGS_DATA_ACK			(1 << 5)
 #define TINYMAC_ATTACH_FLAGS_SLEEPY				(1 << 4)
 #define TINYMAC_ATTACH_HEARTBEAT_SHIFT			0
 #define TINYMAC_ATTACH_HEARTBEAT_MASK			(15 << 0)
@@ -138,6 +157,27 @@ typedef struct {
 	uint8_t			status;
 } PACKED tinymac_registration_response_t;
 
+typedef struct {
+	uint8_t			groups;			/*< Complete set of group memberships (\see TINYMAC_GROUP_BIT) */
+} PACKED tinymac_group_request_t;
+
+/*! Payload of a DataAck, which acknowledges the frame given by the header's
+ * sequence number and carries the packet pending for the acknowledged node.  If
+ * the pending packet requests an ack then the node answers by setting
+ * TINYMAC_FLAGS_IMPLICIT_ACK on its next transmission. */
+typedef struct {
+	uint8_t			flags;			/*< Low byte of the pending packet's header flags (type, ack request) */
+	uint8_t			seq;			/*< Sequence number of the pending packet */
+	char			payload[0];
+} PACKED tinymac_data_ack_t;
+
+/*! Sub-header for each upper layer packet packed into an Aggregate frame */
+typedef struct {
+	uint8_t			type;			/*< Packet type (tinymacType_RawData or above) */
+	uint8_t			size;			/*< Size of following payload */
+	char			payload[0];
+} PACKED tinymac_aggregate_header_t;
+
 typedef enum {
 	tinymacRegistrationStatus_Success = 0,
 	tinymacRegistrationStatus_AccessDenied,
@@ -156,14 +196,27 @@ typedef enum {
 #define TINYMAC_MAX_NODES				32
 /*! Maximum payload length (limited further by the PHY MTU) */
 #define TINYMAC_MAX_PAYLOAD				128
+/*! Maximum number of payload fragments for \see tinymac_sendv */
+#define TINYMAC_MAX_FRAGMENTS			4
 /*! Maximum number of retries when transmitting a packet with ack request set */
 #define TINYMAC_MAX_RETRIES				3
 /*! Time to wait for an acknowledgement response (ms) */
 #define TINYMAC_ACK_TIMEOUT				250
 /*! Time for an unregistered node to wait between beacon request transmissions (seconds) */
 #define TINYMAC_BEACON_REQUEST_TIMEOUT	10
-/*! Time to wait for a registration request to be answered (ms) */
-#define TINYMAC_REGISTRATION_TIMEOUT	1000
+/*! Time to wait for a registration request to be answered (ms).  This must allow for
+ * the request to wait in the coordinator's registration queue */
+#define TINYMAC_REGISTRATION_TIMEOUT	2000
+/*! Initial window for the random holdoff before an unregistered node sends a beacon or
+ * registration request (ticks).  Must be a power of two */
+#define TINYMAC_BACKOFF_WINDOW			4
+/*! Maximum backoff exponent.  The holdoff window doubles after each unanswered request,
+ * up to TINYMAC_BACKOFF_WINDOW << TINYMAC_BACKOFF_MAX_EXP ticks */
+#define TINYMAC_BACKOFF_MAX_EXP			5
+/*! Number of registration requests the coordinator can hold awaiting a response */
+#define TINYMAC_REG_QUEUE_LEN			8
+/*! Maximum number of registration requests answered by each response frame (one per tick) */
+#define TINYMAC_REG_BATCH				4
 /*! Coordinator grace period to allow after heartbeat expiry before assuming a client has gone (seconds) */
 #define TINYMAC_HEARTBEAT_GRACE			2
 /*! Time a sleeping node should listen after transmitting or receiving a packet with
@@ -181,8 +234,43 @@ typedef enum {
 	tinymacNodeState_Registered,
 	tinymacNodeState_SendPending,
 	tinymacNodeState_WaitAck,
+	tinymacNodeState_WaitImplicitAck,
 } tinymac_node_state_t;
 
+/*! Number of buckets in the send-to-ack latency histogram, timed by \see phy_get_time_us.
+ * Bucket 0 counts acks received within 1 ms of the send and bucket n counts those
+ * received 2^(n-1) to 2^n - 1 ms later.  The last bucket also collects anything
+ * slower, which usually means a retry (\see TINYMAC_ACK_TIMEOUT).  If the PHY has
+ * no microsecond clock the latency is timed in ticks, so acks land in either
+ * bucket 0 (same tick) or the last bucket. */
+#define TINYMAC_LATENCY_BUCKETS			8
+
+/*! Link statistics for one node (requires WITH_TINYMAC_STATS) */
+typedef struct {
+	uint32_t				tx_frames;		/*< Frames sent to this node, including acks and retries */
+	uint32_t				rx_frames;		/*< Frames received from this node */
+	uint32_t				retries;		/*< Retransmissions to this node */
+	uint32_t				ack_timeouts;	/*< Acks not received in time */
+	uint32_t				validity_expiries;	/*< Pending sends that expired undelivered */
+	uint32_t				duplicates;		/*< Duplicate frames received and discarded */
+	int16_t					rssi_avg;		/*< Moving average signal strength (dBm * 16) */
+	int8_t					rssi_min;		/*< Weakest signal strength seen (dBm) */
+	int8_t					rssi_max;		/*< Strongest signal strength seen (dBm) */
+	uint16_t				latency[TINYMAC_LATENCY_BUCKETS];	/*< Send-to-ack latency histogram */
+} tinymac_node_stats_t;
+
+/*! MAC-wide counters (requires WITH_TINYMAC_STATS) */
+typedef struct {
+	uint32_t				tx_frames;		/*< Frames passed to the PHY */
+	uint32_t				tx_errors;		/*< Frames the PHY failed to send */
+	uint32_t				rx_frames;		/*< Frames received from the PHY */
+	uint32_t				rx_dropped;		/*< Received frames discarded as malformed or from unknown nodes */
+	uint32_t				beacons_tx;		/*< Beacons sent */
+	uint32_t				beacons_rx;		/*< Beacons received */
+	uint32_t				send_failures;	/*< Unicast sends that completed with an error */
+	uint32_t				crc_errors;		/*< Frames discarded by the PHY due to bad CRC */
+} tinymac_stats_t;
+
 typedef struct {
 	tinymac_timer_cb_t		callback;
 	void					*arg;
@@ -195,6 +283,8 @@ typedef struct {
 	uint16_t				flags;			/*< Node flags (from registration) */
 	uint8_t					addr;			/*< Assigned short address */
 	int8_t					rssi;			/*< Last signal strength if known (dBm), or 0 */
+	uint8_t					groups;			/*< Multicast group memberships (\see TINYMAC_GROUP_BIT) */
+	uint16_t				duplicates;		/*< Number of duplicate packets received and discarded */
 	tinymac_node_state_t	state;			/*< Current node state */
 
 	/* Private elements follow - don't look! */
@@ -207,6 +297,16 @@ typedef struct {
 	tinymac_timer_t			ack_timer;		/*< Timer for ack timeout */
 	tinymac_timer_t			validity_timer;	/*< Validity timeout for deferred sends */
 	uint8_t					retries;		/*< Number of tx tries remaining */
+
+	uint8_t					rx_seq;			/*< Sequence number of the last packet received requesting an ack */
+	boolean_t				rx_seq_valid;	/*< Whether rx_seq has been set since registration */
+
+#if WITH_TINYMAC_STATS
+	tinymac_node_stats_t	stats;			/*< Link statistics (use \see tinymac_get_node_stats) */
+	uint32_t				tx_time;		/*< Time the pending packet was queued (\see phy_get_time_us) */
+	uint32_t				tx_tick;		/*< Time the pending packet was queued (ticks) */
+	boolean_t				tx_time_valid;	/*< tx_time was read from the PHY clock */
+#endif
 } tinymac_node_t;
 
 typedef struct {
@@ -243,18 +343,69 @@ void tinymac_tick_handler(void *arg);
 /*!
  * Send a data packet.
  * NOTE: If used under an OS this function must be called from the same thread that
- * calls the tick handler and the PHY receive handler.
+ * calls the tick handler and the PHY receive handler.  Other threads may use
+ * tinymac_post_send (\see tinymac-queue.h).
  *
- * \param dest		Destination short address
+ * A coordinator may send to a multicast group address.  Group packets are not
+ * acknowledged.  If any member is a sleeping node then the packet is held and sent
+ * once, immediately after the next sync beacon.
+ *
+ * \param dest		Destination short address or group address
  * \param type		Packet type and flags to set (\see tinymac_packet_type_t)
  * \param buf		Pointer to payload data (will be copied if necessary)
  * \param size		Size of payload data
  * \param validity	Validity period (in seconds) for packets sent to a sleeping node
- * \param cb		Callback invoked on successful delivery or expiry of validity period
+ * \param cb		Callback invoked on successful delivery (or transmission if no ack
+ * 					was requested) or on failure.  It is not invoked if this function
+ * 					returns an error.
  * \return			Sequence number or -ve error code
  */
 int tinymac_send(uint8_t dest, uint8_t type, const char *buf, size_t size, uint16_t validity, tinymac_send_cb_t cb);
 
+/*!
+ * Send a data packet whose payload is given as a list of fragments, which are
+ * passed to the PHY as they are.  Otherwise as \see tinymac_send.  The fragments
+ * are only copied if the packet must be kept for retransmission, for a sleeping
+ * node or for a group.
+ *
+ * \param dest		Destination short address or group address
+ * \param type		Packet type and flags to set (\see tinymac_packet_type_t)
+ * \param frags		Payload fragments, in order
+ * \param nfrags	Number of fragments (at most TINYMAC_MAX_FRAGMENTS)
+ * \param validity	Validity period (in seconds) for packets sent to a sleeping node
+ * \param cb		Callback as for \see tinymac_send
+ * \return			Sequence number or -ve error code
+ */
+int tinymac_sendv(uint8_t dest, uint8_t type, const phy_buf_t *frags, unsigned int nfrags,
+		uint16_t validity, tinymac_send_cb_t cb);
+
+/*!
+ * Queue a data packet for aggregation (requires WITH_TINYMAC_AGGREGATE).
+ * Packets for the same destination are packed into a single frame, which is
+ * sent when it is full, when a packet for a different destination is queued,
+ * when the earliest deadline expires or when \see tinymac_flush is called.  The
+ * frame requests an ack if any of the packets in it did.
+ * NOTE: If used under an OS this function must be called from the same thread that
+ * calls the tick handler and the PHY receive handler.
+ *
+ * \param dest		Destination short address
+ * \param type		Packet type and flags to set (\see tinymac_packet_type_t)
+ * \param buf		Pointer to payload data (will be copied)
+ * \param size		Size of payload data
+ * \param deadline	Maximum time to hold the packet before sending (ms)
+ * \return			0 if the packet was sent or is queued (a full frame for a busy
+ * 					destination is retried each tick), or -ve error code if it
+ * 					was discarded
+ */
+int tinymac_send_aggregate(uint8_t dest, uint8_t type, const char *buf, size_t size, uint16_t deadline);
+
+/*!
+ * Send any packets queued by \see tinymac_send_aggregate now
+ *
+ * \return			0 on success (or nothing to send) or -ve error code
+ */
+int tinymac_flush(void);
+
 /*!
  * Check if we are connected to a coordinator
  *
@@ -262,6 +413,24 @@ int tinymac_send(uint8_t dest, uint8_t type, const char *buf, size_t size, uint1
  */
 int tinymac_is_registered(void);
 
+/*!
+ * Join a multicast group.  The node's group memberships are sent to the coordinator
+ * now if registered, and again after each registration.  If the coordinator can't
+ * be updated straight away it is retried until it acks.
+ *
+ * \param group		Group address (\see TINYMAC_ADDR_GROUP_BASE)
+ * \return			0 on success or -ve error code if the group is invalid
+ */
+int tinymac_join_group(uint8_t group);
+
+/*!
+ * Leave a multicast group.  The coordinator is updated as for \see tinymac_join_group.
+ *
+ * \param group		Group address (\see TINYMAC_ADDR_GROUP_BASE)
+ * \return			0 on success or -ve error code if the group is invalid
+ */
+int tinymac_leave_group(uint8_t group);
+
 /*!
  * Returns the maximum payload size that may be transmitted for the
  * selected PHY
@@ -294,6 +463,29 @@ void tinymac_register_dereg_cb(tinymac_reg_cb_t cb);
  */
 const tinymac_node_t* tinymac_get_node(uint64_t uuid);
 
+/*!
+ * Take a snapshot of the MAC-wide counters (requires WITH_TINYMAC_STATS).
+ * This may be called from any thread and does not block the MAC.
+ *
+ * \param stats		Pointer to structure to receive the counters
+ * \return			0 on success or -ve error code
+ */
+int tinymac_get_stats(tinymac_stats_t *stats);
+
+/*!
+ * Take a snapshot of the link statistics for a node (requires WITH_TINYMAC_STATS).
+ * This may be called from any thread and does not block the MAC.
+ *
+ * \param addr		Short address of the node (the coordinator's address on a client)
+ * \param stats		Pointer to structure to receive the statistics
+ * \return			0 on success or -ve error code if the address is not known
+ */
+int tinymac_get_node_stats(uint8_t addr, tinymac_node_stats_t *stats);
+
+/*!
+ * Print the network status and node table to stdout.  This is for diagnostic
+ * use on request and is not called by the MAC itself.
+ */
 void tinymac_dump_nodes(void);
 
 
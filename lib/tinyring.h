@@ -0,0 +1,132 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinyring.h
+ *
+ * Lock-free ring of preallocated packet buffers for passing packets from
+ * exactly one producer thread to exactly one consumer thread.
+ *
+ * The producer fills a buffer in place (\see tinyring_alloc), then publishes it
+ * (\see tinyring_push).  The consumer handles buffers in place
+ * (\see tinyring_peek) and then returns them (\see tinyring_pop).  The consumer
+ * only needs waking when a push finds the ring empty, provided it always drains
+ * the ring before it sleeps.
+ *
+ */
+
+#ifndef TINYRING_H_
+#define TINYRING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+/*! Number of buffers per ring (must be a power of two) */
+#ifndef TINYRING_LEN
+#define TINYRING_LEN					64
+#endif
+
+/*! Payload capacity of each buffer */
+#ifndef TINYRING_BUF_SIZE
+#define TINYRING_BUF_SIZE				128
+#endif
+
+/*! Assumed cache line size, used to keep producer and consumer state apart */
+#define TINYRING_CACHE_LINE				64
+
+typedef struct {
+	uint8_t					addr;		/*< Node address */
+	uint8_t					type;		/*< Packet type */
+	uint16_t				size;		/*< Payload size */
+	char					data[TINYRING_BUF_SIZE];
+} tinyring_buf_t;
+
+typedef struct {
+	uint32_t				head;		/*< Buffers pushed (written by producer) */
+	char					pad1[TINYRING_CACHE_LINE - sizeof(uint32_t)];
+	uint32_t				tail;		/*< Buffers popped (written by consumer) */
+	char					pad2[TINYRING_CACHE_LINE - sizeof(uint32_t)];
+	tinyring_buf_t			bufs[TINYRING_LEN];
+} tinyring_t;
+
+static inline void tinyring_init(tinyring_t *ring)
+{
+	ring->head = ring->tail = 0;
+}
+
+/*!
+ * Producer: get the next free buffer
+ *
+ * \return			Pointer to the buffer or NULL if the ring is full
+ */
+static inline tinyring_buf_t* tinyring_alloc(tinyring_t *ring)
+{
+	uint32_t head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TINYRING_LEN) {
+		return NULL;
+	}
+	return &ring->bufs[head & (TINYRING_LEN - 1)];
+}
+
+/*!
+ * Producer: publish the buffer returned by the last call to \see tinyring_alloc
+ *
+ * \return			TRUE if the ring was empty, so the consumer must be woken
+ */
+static inline boolean_t tinyring_push(tinyring_t *ring)
+{
+	uint32_t head = ring->head;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in tinyring_peek: either the consumer sees this
+	 * buffer before it sleeps or we see that it has drained the ring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == head) ? TRUE : FALSE;
+}
+
+/*!
+ * Consumer: get the oldest published buffer
+ *
+ * \return			Pointer to the buffer or NULL if the ring is empty
+ */
+static inline tinyring_buf_t* tinyring_peek(tinyring_t *ring)
+{
+	uint32_t tail = ring->tail;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+			return NULL;
+		}
+	}
+	return &ring->bufs[tail & (TINYRING_LEN - 1)];
+}
+
+/*!
+ * Consumer: return the buffer obtained from \see tinyring_peek to the producer
+ */
+static inline void tinyring_pop(tinyring_t *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* TINYRING_H_ */
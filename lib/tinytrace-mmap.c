@@ -0,0 +1,118 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinytrace-mmap.c
+ *
+ * Trace buffer in a memory-mapped file, for Linux hosts.  Any number of reader
+ * processes may map the same file to decode records as they are written.
+ *
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinytrace.h"
+
+static int trace_fd = -1;
+static size_t trace_size = 0;
+static tinytrace_header_t *trace = NULL;
+static tinytrace_record_t *trace_records = NULL;
+
+int tinytrace_open(const char *path, unsigned int nrecords)
+{
+	unsigned int n = 1;
+
+	/* Round up to a power of two so the index is a mask */
+	while (n < nrecords) {
+		n <<= 1;
+	}
+	trace_size = sizeof(tinytrace_header_t) + n * sizeof(tinytrace_record_t);
+
+	trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (ftruncate(trace_fd, trace_size) < 0) {
+		perror("ftruncate");
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+
+	trace = (tinytrace_header_t*)mmap(NULL, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, 0);
+	if (trace == MAP_FAILED) {
+		perror("mmap");
+		close(trace_fd);
+		trace_fd = -1;
+		trace = NULL;
+		return -1;
+	}
+
+	trace->magic = TINYTRACE_MAGIC;
+	trace->version = TINYTRACE_VERSION;
+	trace->record_size = sizeof(tinytrace_record_t);
+	trace->nrecords = n;
+	trace->head = 0;
+	trace_records = (tinytrace_record_t*)(trace + 1);
+	return 0;
+}
+
+void tinytrace_close(void)
+{
+	if (trace) {
+		munmap(trace, trace_size);
+		trace = NULL;
+		trace_records = NULL;
+	}
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+void tinytrace_write(uint8_t subsys, uint8_t level, uint16_t event, uint32_t a, uint32_t b)
+{
+	tinytrace_record_t *rec;
+	struct timespec ts;
+	uint32_t head;
+
+	if (!trace) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	head = trace->head;
+	rec = &trace_records[head & (trace->nrecords - 1)];
+	rec->timestamp = (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	rec->event = event;
+	rec->subsys = subsys;
+	rec->level = level;
+	rec->a = a;
+	rec->b = b;
+
+	/* Publish the record to readers */
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,141 @@
+/*!
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * tinytrace.h
+ *
+ * Binary event trace.  Fixed size records are written to a ring buffer, which
+ * is decoded later or by a separate reader process (see tools/trace-dump).
+ *
+ * Tracing is compiled in with WITH_TINYTRACE.  Each subsystem has its own
+ * compile-time level (TINYTRACE_LEVEL_MAC etc.) and trace points above that
+ * level generate no code.
+ *
+ */
+
+#ifndef TINYTRACE_H_
+#define TINYTRACE_H_
+
+#include <stdint.h>
+
+#define TINYTRACE_OFF					0
+#define TINYTRACE_ERROR					1
+#define TINYTRACE_INFO					2
+#define TINYTRACE_DEBUG					3
+
+#ifndef TINYTRACE_LEVEL_PHY
+#define TINYTRACE_LEVEL_PHY				TINYTRACE_OFF
+#endif
+#ifndef TINYTRACE_LEVEL_MAC
+#define TINYTRACE_LEVEL_MAC				TINYTRACE_OFF
+#endif
+#ifndef TINYTRACE_LEVEL_APP
+#define TINYTRACE_LEVEL_APP				TINYTRACE_OFF
+#endif
+
+typedef enum {
+	tinytraceSubsys_PHY = 0,
+	tinytraceSubsys_MAC,
+	tinytraceSubsys_APP,
+} tinytrace_subsys_t;
+
+/*! Trace event identifiers.  Events marked (hdr) carry a MAC header packed by
+ * \see TINYTRACE_MAC_HDR */
+typedef enum {
+	tinytraceEvent_PhyCrcError = 0,	/*< a = frame size */
+
+	tinytraceEvent_MacRx = 0x10,	/*< (hdr) Frame received */
+	tinytraceEvent_MacTx,			/*< (hdr) Frame sent */
+	tinytraceEvent_MacTxRetry,		/*< (hdr) Frame re-sent after ack timeout */
+	tinytraceEvent_MacTxPending,	/*< (hdr) Deferred frame sent to sleeping node */
+	tinytraceEvent_MacAck,			/*< (hdr) Ack sent */
+	tinytraceEvent_MacDataAck,		/*< (hdr) Ack carrying pending frame sent */
+	tinytraceEvent_MacBeacon,		/*< (hdr) Beacon sent */
+	tinytraceEvent_MacAckTimeout,	/*< a = node address, b = retries remaining */
+	tinytraceEvent_MacValidityExpired,	/*< a = node address */
+	tinytraceEvent_MacDuplicate,	/*< a = node address, b = sequence number */
+	tinytraceEvent_MacRegister,		/*< a = node address, b = low word of UUID */
+	tinytraceEvent_MacDeregister,	/*< a = node address */
+	tinytraceEvent_MacDrop,			/*< (hdr) Frame discarded */
+	tinytraceEvent_MacRxAggregated,	/*< a = source address, b = type:size of packet unpacked from an aggregate frame */
+
+	tinytraceEvent_App = 0x100,		/*< First application-defined event */
+} tinytrace_event_t;
+
+/*! One trace record */
+typedef struct {
+	uint32_t			timestamp;		/*< Time of event (microseconds, wraps) */
+	uint16_t			event;			/*< Event ID (\see tinytrace_event_t) */
+	uint8_t				subsys;			/*< Originating subsystem (\see tinytrace_subsys_t) */
+	uint8_t				level;			/*< Trace level */
+	uint32_t			a;				/*< Event specific */
+	uint32_t			b;				/*< Event specific */
+} tinytrace_record_t;
+
+#define TINYTRACE_MAGIC					0x54525443	/* "TRTC" */
+#define TINYTRACE_VERSION				1
+
+/*! Ring buffer header, followed by nrecords records.  Record n is at index
+ * n % nrecords, and records head - nrecords + 1 to head - 1 are valid */
+typedef struct {
+	uint32_t			magic;
+	uint16_t			version;
+	uint16_t			record_size;	/*< sizeof(tinytrace_record_t) */
+	uint32_t			nrecords;		/*< Number of records (power of two) */
+	volatile uint32_t	head;			/*< Total number of records written */
+} tinytrace_header_t;
+
+/*! Pack a MAC header for a trace record: a = flags:net_id:dest, b = src:seq:size */
+#define TINYTRACE_HDR_A(hdr)			(((uint32_t)(hdr)->flags << 16) | ((uint32_t)(hdr)->net_id << 8) | (hdr)->dest_addr)
+#define TINYTRACE_HDR_B(hdr, size)		(((uint32_t)(hdr)->src_addr << 24) | ((uint32_t)(hdr)->seq << 16) | ((size) & 0xffff))
+
+#if WITH_TINYTRACE
+#define TINYTRACE(subsys, level, event, a, b)	do { \
+		if ((level) <= TINYTRACE_LEVEL_##subsys) { \
+			tinytrace_write(tinytraceSubsys_##subsys, (level), (event), (a), (b)); \
+		} \
+	} while (0)
+#else
+#define TINYTRACE(subsys, level, event, a, b)
+#endif
+
+#define TINYTRACE_MAC_HDR(level, event, hdr, size) \
+		TINYTRACE(MAC, level, event, TINYTRACE_HDR_A(hdr), TINYTRACE_HDR_B(hdr, size))
+
+/*!
+ * Open (or create) a trace buffer.  The buffer is shared with reader processes,
+ * so it survives a crash of the writer.
+ *
+ * \param path		Location of the buffer (implementation specific)
+ * \param nrecords	Capacity in records (rounded up to a power of two)
+ * \return			Zero on success or -ve error code
+ */
+int tinytrace_open(const char *path, unsigned int nrecords);
+
+/*!
+ * Close the trace buffer.  Trace points become no-ops.
+ */
+void tinytrace_close(void);
+
+/*!
+ * Append a record.  Use \see TINYTRACE rather than calling this directly.  There must
+ * be only one writer thread per buffer.
+ */
+void tinytrace_write(uint8_t subsys, uint8_t level, uint16_t event, uint32_t a, uint32_t b);
+
+#endif /* TINYTRACE_H_ */
@@ -0,0 +1,441 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * mqttsn-broker.c
+ *
+ * Minimal MQTT-SN broker over UDP, to stand in for a real broker when testing
+ * and benchmarking the gateways without network access.
+ *
+ * Clients are identified by their UDP source address.  Topic IDs are shared by
+ * all clients (a topic has the same ID whoever registers it), and pre-defined
+ * topic IDs are taken to be these IDs.  Publishes are passed to subscribers at
+ * the lower of the publish and subscription QoS.  QoS 1 publishes to subscribers
+ * are not retried, retained messages and wills are not supported, and sleeping
+ * clients are treated as disconnected.
+ *
+ * Usage: mqttsn-broker [-p port] [-v]
+ *
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mqttsn.h"
+
+#define DEFAULT_PORT		1883
+#define MAX_CLIENTS			256
+#define MAX_TOPICS			256
+#define MAX_TOPIC_NAME		64
+#define MAX_PACKET			255
+
+typedef struct {
+	struct sockaddr_in		sa;				/*< Client address, or port 0 if unused */
+	boolean_t				connected;
+	uint16_t				next_id;		/*< Last message ID used for publishes to this client */
+	char					client_id[MQTTSN_MAX_CLIENT_ID + 1];
+} client_t;
+
+typedef struct {
+	char					name[MAX_TOPIC_NAME];	/*< Topic name, or empty if unused */
+	uint8_t					subscribers[MAX_CLIENTS / 8];	/*< Bitmap of subscribed clients */
+	uint8_t					qos1[MAX_CLIENTS / 8];		/*< Bitmap of QoS 1 subscriptions */
+} topic_t;
+
+static int sock;
+static boolean_t verbose = FALSE;
+static volatile boolean_t quit = FALSE;
+static client_t clients[MAX_CLIENTS];
+static topic_t topics[MAX_TOPICS];
+
+/* Counters for the summary printed on exit */
+static unsigned long n_published;		/*< Publishes received from clients */
+static unsigned long n_delivered;		/*< Publishes sent to subscribers */
+
+#define BIT_IS_SET(map, n)				((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define BIT_SET(map, n)					((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define BIT_CLEAR(map, n)				((map)[(n) >> 3] &= ~(1 << ((n) & 7)))
+
+#define CLIENT_INDEX(client)			((unsigned int)((client) - clients))
+#define TOPIC_ID(topic)					((uint16_t)((topic) - topics) + 1)
+
+static void break_handler(int signum)
+{
+	quit = TRUE;
+}
+
+static client_t* client_find(const struct sockaddr_in *sa, boolean_t add)
+{
+	client_t *free_client = NULL;
+	unsigned int n;
+
+	for (n = 0; n < MAX_CLIENTS; n++) {
+		client_t *client = &clients[n];
+
+		if (client->sa.sin_port == sa->sin_port && client->sa.sin_addr.s_addr == sa->sin_addr.s_addr) {
+			return client;
+		}
+		if (!free_client && client->sa.sin_port == 0) {
+			free_client = client;
+		}
+	}
+	if (add && free_client) {
+		free_client->sa = *sa;
+		return free_client;
+	}
+	return NULL;
+}
+
+static topic_t* topic_find_name(const char *name, size_t len, boolean_t add)
+{
+	topic_t *free_topic = NULL;
+	unsigned int n;
+
+	if (len == 0 || len >= MAX_TOPIC_NAME) {
+		return NULL;
+	}
+	for (n = 0; n < MAX_TOPICS; n++) {
+		topic_t *topic = &topics[n];
+
+		if (strlen(topic->name) == len && memcmp(topic->name, name, len) == 0) {
+			return topic;
+		}
+		if (!free_topic && topic->name[0] == '\0') {
+			free_topic = topic;
+		}
+	}
+	if (add && free_topic) {
+		memcpy(free_topic->name, name, len);
+		free_topic->name[len] = '\0';
+		return free_topic;
+	}
+	return NULL;
+}
+
+static topic_t* topic_find_id(uint16_t id)
+{
+	if (id == 0 || id > MAX_TOPICS || topics[id - 1].name[0] == '\0') {
+		return NULL;
+	}
+	return &topics[id - 1];
+}
+
+static void client_send(const client_t *client, char *buf, uint8_t msg_type, size_t size)
+{
+	mqttsn_header_t *hdr = (mqttsn_header_t*)buf;
+
+	hdr->length = size;
+	hdr->msg_type = msg_type;
+	if (sendto(sock, buf, size, 0, (const struct sockaddr*)&client->sa, sizeof(client->sa)) < 0) {
+		perror("sendto");
+	}
+}
+
+static void client_clear(client_t *client)
+{
+	unsigned int n;
+
+	for (n = 0; n < MAX_TOPICS; n++) {
+		BIT_CLEAR(topics[n].subscribers, CLIENT_INDEX(client));
+		BIT_CLEAR(topics[n].qos1, CLIENT_INDEX(client));
+	}
+}
+
+static void connect_handler(client_t *client, const char *buf, size_t size)
+{
+	const mqttsn_connect_t *connect = (const mqttsn_connect_t*)buf;
+	mqttsn_connack_t connack;
+	size_t len;
+
+	if (size < sizeof(mqttsn_connect_t)) {
+		return;
+	}
+	if (connect->flags & MQTTSN_FLAG_CLEAN_SESSION) {
+		client_clear(client);
+	}
+	len = size - sizeof(mqttsn_connect_t);
+	if (len > MQTTSN_MAX_CLIENT_ID) {
+		len = MQTTSN_MAX_CLIENT_ID;
+	}
+	memcpy(client->client_id, connect->client_id, len);
+	client->client_id[len] = '\0';
+	client->connected = TRUE;
+	if (verbose) {
+		printf("%s:%u connected as %s\n", inet_ntoa(client->sa.sin_addr), ntohs(client->sa.sin_port),
+				client->client_id);
+	}
+
+	connack.return_code = MQTTSN_RC_ACCEPTED;
+	client_send(client, (char*)&connack, MQTTSN_CONNACK, sizeof(connack));
+}
+
+static void register_handler(client_t *client, const char *buf, size_t size)
+{
+	const mqttsn_register_t *reg = (const mqttsn_register_t*)buf;
+	mqttsn_regack_t regack;
+	topic_t *topic;
+
+	if (size < sizeof(mqttsn_register_t)) {
+		return;
+	}
+	topic = topic_find_name(reg->topic_name, size - sizeof(mqttsn_register_t), TRUE);
+
+	regack.topic_id = topic ? mqttsn_htons(TOPIC_ID(topic)) : 0;
+	regack.msg_id = reg->msg_id;
+	regack.return_code = topic ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_INVALID_TOPIC;
+	client_send(client, (char*)&regack, MQTTSN_REGACK, sizeof(regack));
+}
+
+static void subscribe_handler(client_t *client, const char *buf, size_t size, boolean_t subscribe)
+{
+	const mqttsn_subscribe_t *sub = (const mqttsn_subscribe_t*)buf;
+	topic_t *topic = NULL;
+	boolean_t qos1 = ((sub->flags & MQTTSN_FLAG_QOS_MASK) != MQTTSN_FLAG_QOS_0) ? TRUE : FALSE;
+
+	if (size < offsetof(mqttsn_subscribe_t, topic)) {
+		return;
+	}
+	switch (sub->flags & MQTTSN_FLAG_TOPIC_ID_MASK) {
+	case MQTTSN_FLAG_TOPIC_ID_NORM:
+		/* No wildcards - the name is taken literally */
+		topic = topic_find_name(sub->topic.topic_name, size - offsetof(mqttsn_subscribe_t, topic), subscribe);
+		break;
+	case MQTTSN_FLAG_TOPIC_ID_PRE:
+		if (size >= sizeof(mqttsn_subscribe_t)) {
+			topic = topic_find_id(mqttsn_ntohs(sub->topic.topic_id));
+		}
+		break;
+	default:
+		break;
+	}
+	if (topic) {
+		if (subscribe) {
+			BIT_SET(topic->subscribers, CLIENT_INDEX(client));
+			if (qos1) {
+				BIT_SET(topic->qos1, CLIENT_INDEX(client));
+			} else {
+				BIT_CLEAR(topic->qos1, CLIENT_INDEX(client));
+			}
+		} else {
+			BIT_CLEAR(topic->subscribers, CLIENT_INDEX(client));
+			BIT_CLEAR(topic->qos1, CLIENT_INDEX(client));
+		}
+	}
+
+	if (subscribe) {
+		mqttsn_suback_t suback;
+
+		/* QoS 2 is granted as QoS 1 */
+		suback.flags = qos1 ? MQTTSN_FLAG_QOS_1 : MQTTSN_FLAG_QOS_0;
+		suback.topic_id = topic ? mqttsn_htons(TOPIC_ID(topic)) : 0;
+		suback.msg_id = sub->msg_id;
+		suback.return_code = topic ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_INVALID_TOPIC;
+		client_send(client, (char*)&suback, MQTTSN_SUBACK, sizeof(suback));
+	} else {
+		mqttsn_unsuback_t unsuback;
+
+		unsuback.msg_id = sub->msg_id;
+		client_send(client, (char*)&unsuback, MQTTSN_UNSUBACK, sizeof(unsuback));
+	}
+}
+
+static void publish_handler(client_t *client, const char *buf, size_t size)
+{
+	const mqttsn_publish_t *publish = (const mqttsn_publish_t*)buf;
+	char out[MAX_PACKET];
+	mqttsn_publish_t *fwd = (mqttsn_publish_t*)out;
+	uint8_t qos, id_type;
+	topic_t *topic = NULL;
+	size_t len;
+	unsigned int n;
+
+	if (size < sizeof(mqttsn_publish_t)) {
+		return;
+	}
+	len = size - sizeof(mqttsn_publish_t);
+	qos = publish->flags & MQTTSN_FLAG_QOS_MASK;
+	id_type = publish->flags & MQTTSN_FLAG_TOPIC_ID_MASK;
+	if (id_type == MQTTSN_FLAG_TOPIC_ID_NORM || id_type == MQTTSN_FLAG_TOPIC_ID_PRE) {
+		topic = topic_find_id(mqttsn_ntohs(publish->topic_id));
+	}
+
+	if (qos == MQTTSN_FLAG_QOS_1 || qos == MQTTSN_FLAG_QOS_2) {
+		mqttsn_puback_t puback;
+
+		/* QoS 2 is not supported, but is acknowledged as QoS 1 so the sender
+		 * gives up on it rather than retrying */
+		puback.topic_id = publish->topic_id;
+		puback.msg_id = publish->msg_id;
+		puback.return_code = (!client->connected) ? MQTTSN_RC_NOT_SUPPORTED :
+				topic ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_INVALID_TOPIC;
+		client_send(client, (char*)&puback, MQTTSN_PUBACK, sizeof(puback));
+	}
+	if (!topic || (!client->connected && qos != MQTTSN_FLAG_QOS_M1)) {
+		return;
+	}
+	n_published++;
+
+	/* Fan out to subscribers */
+	fwd->topic_id = mqttsn_htons(TOPIC_ID(topic));
+	memcpy(fwd->data, publish->data, len);
+	for (n = 0; n < MAX_CLIENTS; n++) {
+		if (!BIT_IS_SET(topic->subscribers, n) || !clients[n].connected) {
+			continue;
+		}
+		if (qos == MQTTSN_FLAG_QOS_1 && BIT_IS_SET(topic->qos1, n)) {
+			if (++clients[n].next_id == 0) {
+				clients[n].next_id = 1;
+			}
+			fwd->flags = MQTTSN_FLAG_QOS_1 | MQTTSN_FLAG_TOPIC_ID_NORM;
+			fwd->msg_id = mqttsn_htons(clients[n].next_id);
+		} else {
+			fwd->flags = MQTTSN_FLAG_QOS_0 | MQTTSN_FLAG_TOPIC_ID_NORM;
+			fwd->msg_id = 0;
+		}
+		client_send(&clients[n], out, MQTTSN_PUBLISH, sizeof(mqttsn_publish_t) + len);
+		n_delivered++;
+	}
+}
+
+static void packet_handler(const struct sockaddr_in *sa, const char *buf, size_t size)
+{
+	const mqttsn_header_t *hdr = (const mqttsn_header_t*)buf;
+	client_t *client;
+
+	if (size < sizeof(mqttsn_header_t) || hdr->length < sizeof(mqttsn_header_t) || hdr->length > size) {
+		/* Short, or uses the 3 byte length form */
+		return;
+	}
+	size = hdr->length;
+
+	/* Only CONNECT and QoS -1 PUBLISH are accepted from unknown clients */
+	client = client_find(sa, (hdr->msg_type == MQTTSN_CONNECT || hdr->msg_type == MQTTSN_PUBLISH) ? TRUE : FALSE);
+	if (!client) {
+		return;
+	}
+
+	switch (hdr->msg_type) {
+	case MQTTSN_CONNECT:
+		connect_handler(client, buf, size);
+		break;
+	case MQTTSN_REGISTER:
+		register_handler(client, buf, size);
+		break;
+	case MQTTSN_SUBSCRIBE:
+		subscribe_handler(client, buf, size, TRUE);
+		break;
+	case MQTTSN_UNSUBSCRIBE:
+		subscribe_handler(client, buf, size, FALSE);
+		break;
+	case MQTTSN_PUBLISH:
+		publish_handler(client, buf, size);
+		break;
+	case MQTTSN_PINGREQ: {
+		mqttsn_pingresp_t pingresp;
+
+		client_send(client, (char*)&pingresp, MQTTSN_PINGRESP, sizeof(pingresp));
+	} break;
+	case MQTTSN_DISCONNECT: {
+		mqttsn_disconnect_t disconnect;
+
+		client->connected = FALSE;
+		if (verbose) {
+			printf("%s disconnected\n", client->client_id);
+		}
+		client_send(client, (char*)&disconnect, MQTTSN_DISCONNECT, sizeof(mqttsn_header_t));
+	} break;
+	case MQTTSN_PUBACK:
+	case MQTTSN_REGACK:
+	case MQTTSN_PINGRESP:
+		break;
+	default:
+		if (verbose) {
+			printf("unsupported message type 0x%02X from %s\n", hdr->msg_type, client->client_id);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction new_sa;
+	struct sockaddr_in sa;
+	unsigned int port = DEFAULT_PORT;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:v")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Break out of recvfrom on SIGINT/SIGTERM and print the summary */
+	new_sa.sa_handler = break_handler;
+	sigemptyset(&new_sa.sa_mask);
+	new_sa.sa_flags = 0;
+	sigaction(SIGINT, &new_sa, NULL);
+	sigaction(SIGTERM, &new_sa, NULL);
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	while (!quit) {
+		char buf[MAX_PACKET];
+		socklen_t addrlen = sizeof(sa);
+		int size;
+
+		size = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&sa, &addrlen);
+		if (size < 0) {
+			if (errno != EINTR) {
+				perror("recvfrom");
+			}
+			continue;
+		}
+		packet_handler(&sa, buf, size);
+	}
+
+	printf("%lu publishes received, %lu delivered\n", n_published, n_delivered);
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * mqttsn-load.c
+ *
+ * MQTT-SN load driver for benchmarking a gateway on the PC simulator.  This joins
+ * the network as a node, subscribes to a topic of its own and publishes to it,
+ * timing each publish until it comes back from the broker.  Once all publishes
+ * are done it prints the throughput and latency percentiles and exits.
+ *
+ * By default one publish is outstanding at a time.  With -w more may be, and
+ * with -r publishes are sent at a fixed rate regardless of what comes back.
+ * Run several instances to load the gateway with several nodes.
+ *
+ * Usage: mqttsn-load [-n count] [-q qos] [-r rate] [-w window] [-s size]
+ *
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinymac.h"
+#include "tinyloop.h"
+#include "phy.h"
+#include "mqttsn-client.h"
+
+/*! Period for pacing publishes and polling the client */
+#define PUMP_TICK_MS		10
+/*! Time without progress after which outstanding publishes are counted as lost */
+#define STALL_US			1000000
+/*! Time to wait for stragglers after the last publish */
+#define DRAIN_US			2000000
+
+#define TOPIC_PUB			0
+#define TOPIC_SUB			1
+
+/*! Payload header - the rest of the payload is padding */
+typedef struct {
+	uint32_t				seq;			/*< Publish number */
+	uint32_t				t_sent;			/*< Time sent (us) */
+} __attribute__((packed)) bench_payload_t;
+
+static tinyloop_t *loop;
+static mqttsn_c_t _ctx;
+static mqttsn_c_t *ctx = &_ctx;
+static char topic_name[32];
+static mqttsn_c_topic_t topics[3];
+
+/* Settings */
+static unsigned int count = 1000;
+static int qos = 0;
+static unsigned int rate = 0;			/*< Publishes per second, or 0 to be limited by window only */
+static int window = -1;				/*< Publishes outstanding, or 0 for no limit */
+static unsigned int size = 16;
+
+/* Results */
+static uint32_t t_start, t_last_tx, t_last_rx, t_progress;
+static unsigned int n_sent, n_received, n_given_up, n_dups;
+static uint8_t *seen;
+static uint32_t *latency;
+static unsigned int n_ticks;
+static boolean_t running = FALSE;
+
+static void break_handler(int signum)
+{
+	tinyloop_stop(loop);
+}
+
+static uint32_t bench_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000000u + (uint32_t)(ts.tv_nsec / 1000);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(void)
+{
+	uint32_t elapsed = t_last_rx - t_start;
+
+	printf("%u sent, %u received, %u lost, %u duplicates (QoS %d, %u byte payload)\n",
+			n_sent, n_received, n_sent - n_received, n_dups, qos, size);
+	if (n_received == 0) {
+		return;
+	}
+	printf("%.1f msg/s\n", elapsed ? n_received * 1000000.0 / elapsed : 0.0);
+
+	qsort(latency, n_received, sizeof(uint32_t), compare_u32);
+	printf("latency ms: min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+			latency[0] / 1000.0,
+			latency[(n_received - 1) * 50 / 100] / 1000.0,
+			latency[(n_received - 1) * 90 / 100] / 1000.0,
+			latency[(n_received - 1) * 99 / 100] / 1000.0,
+			latency[n_received - 1] / 1000.0);
+}
+
+/*! Send as many publishes as the rate and window allow */
+static void pump(void)
+{
+	char buf[MQTTSN_MAX_PACKET];
+	bench_payload_t *payload = (bench_payload_t*)buf;
+	uint32_t now = bench_now_us();
+
+	while (n_sent < count) {
+		if (window && (int)(n_sent - n_received - n_given_up) >= window) {
+			break;
+		}
+		if (rate && (uint64_t)n_sent * 1000000u > (uint64_t)rate * (now - t_start)) {
+			break;
+		}
+		if (qos > 0 && !mqttsn_c_publish_window(ctx)) {
+			break;
+		}
+
+		payload->seq = n_sent;
+		payload->t_sent = now;
+		if (!mqttsn_c_publish(ctx, TOPIC_PUB, qos, buf, size)) {
+			break;
+		}
+		n_sent++;
+		t_last_tx = now;
+	}
+}
+
+static void publish_handler(mqttsn_c_t *ctx, unsigned int topic_index, const char *data, size_t len)
+{
+	const bench_payload_t *payload = (const bench_payload_t*)data;
+	uint32_t now = bench_now_us();
+
+	if (topic_index != TOPIC_SUB || len < sizeof(bench_payload_t) || payload->seq >= n_sent) {
+		return;
+	}
+	if (seen[payload->seq]) {
+		n_dups++;
+		return;
+	}
+	seen[payload->seq] = 1;
+	latency[n_received++] = now - payload->t_sent;
+	t_last_rx = t_progress = now;
+
+	pump();
+}
+
+static void rx_handler(const tinymac_node_t *node, uint8_t type, const char *buf, size_t len)
+{
+	if (type == tinymacType_MQTTSN) {
+		mqttsn_c_handler(ctx, buf, len);
+	}
+}
+
+static int packet_send(const phy_buf_t *bufs, unsigned int nbufs)
+{
+	return tinymac_sendv(0, tinymacType_MQTTSN, bufs, nbufs, 0, NULL);
+}
+
+static void phy_handler(int fd, uint32_t events, void *arg)
+{
+	phy_event_handler();
+}
+
+static void tick_handler(void *arg)
+{
+	uint32_t now = bench_now_us();
+
+	if (++n_ticks >= TINYMAC_TICK_MS / PUMP_TICK_MS) {
+		n_ticks = 0;
+		tinymac_tick_handler(NULL);
+	}
+	mqttsn_c_handler(ctx, NULL, 0);
+
+	if (!running) {
+		if (mqttsn_c_get_state(ctx) == mqttsnConnected) {
+			printf("connected - publishing to %s\n", topic_name);
+			running = TRUE;
+			t_start = t_last_rx = t_progress = now;
+			pump();
+		}
+		return;
+	}
+
+	if (n_sent == count && (n_received == count || now - t_last_tx > DRAIN_US)) {
+		tinyloop_stop(loop);
+		return;
+	}
+	if (now - t_progress > STALL_US) {
+		/* Give up on whatever is outstanding so the window opens again */
+		n_given_up = n_sent - n_received;
+		t_progress = now;
+	}
+	pump();
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction new_sa, old_sa;
+	char idstr[MQTTSN_MAX_CLIENT_ID];
+	int opt;
+	tinymac_params_t params = {
+			.flags = 5, /* specify hearbeat interval */
+	};
+
+	while ((opt = getopt(argc, argv, "n:q:r:w:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qos = atoi(optarg);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n count] [-q qos] [-r rate] [-w window] [-s size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count == 0 || qos < 0 || qos > 1 || window < -1 ||
+			size < sizeof(bench_payload_t) || size > MQTTSN_MAX_PACKET - sizeof(mqttsn_publish_t)) {
+		fprintf(stderr, "Need count > 0, QoS 0 or 1, and size %u to %u\n", (unsigned int)sizeof(bench_payload_t),
+				(unsigned int)(MQTTSN_MAX_PACKET - sizeof(mqttsn_publish_t)));
+		return 1;
+	}
+	if (window < 0) {
+		/* Closed loop unless a rate was given */
+		window = rate ? 0 : 1;
+	}
+	seen = (uint8_t*)calloc(count, sizeof(uint8_t));
+	latency = (uint32_t*)calloc(count, sizeof(uint32_t));
+	if (!seen || !latency) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	loop = tinyloop_create();
+	if (!loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return 1;
+	}
+
+	new_sa.sa_handler = break_handler;
+	sigemptyset(&new_sa.sa_mask);
+	new_sa.sa_flags = 0;
+	sigaction(SIGINT, &new_sa, &old_sa);
+
+	/* Initialise comms */
+	srand(time(NULL) + getpid());
+	phy_init();
+	params.uuid = rand();
+	tinymac_init(&params);
+	tinymac_register_recv_cb(rx_handler);
+
+	/* Each instance uses its own topic so that several can run at once */
+	snprintf(idstr, sizeof(idstr), "bench%04X", (uint16_t)(params.uuid & 0xffff));
+	snprintf(topic_name, sizeof(topic_name), "tinyhan/bench/%04X", (uint16_t)(params.uuid & 0xffff));
+	topics[TOPIC_PUB].topic = topic_name;
+	topics[TOPIC_PUB].flags = MQTTSN_REG_PUBLISH;
+	topics[TOPIC_SUB].topic = topic_name;
+	topics[TOPIC_SUB].flags = MQTTSN_REG_SUBSCRIBE | (qos & MQTTSN_REG_QOS_MASK);
+	mqttsn_c_init(ctx, idstr, topics, NULL);
+	mqttsn_c_set_sendv_callback(ctx, packet_send);
+	mqttsn_c_set_publish_callback(ctx, publish_handler);
+	mqttsn_c_connect(ctx);
+
+	/* watch tinymac PHY fd */
+	if (tinyloop_add_fd(loop, phy_get_fd(), TINYLOOP_IN, phy_handler, NULL) < 0) {
+		return 1;
+	}
+
+	/* Pacing, MAC and client timers */
+	if (tinyloop_set_tick(loop, PUMP_TICK_MS, tick_handler, NULL) < 0) {
+		return 1;
+	}
+
+	if (tinyloop_run(loop) < 0) {
+		return 1;
+	}
+
+	report();
+	mqttsn_c_disconnect(ctx, 0);
+	tinyloop_destroy(loop);
+	sigaction(SIGINT, &old_sa, NULL);
+	free(latency);
+	free(seen);
+
+	return 0;
+}
@@ -25,15 +25,18 @@
  */
 
 #include <stdlib.h>
-#include <poll.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <string.h>
 
 #include "common.h"
 #include "tinymac.h"
+#include "tinyloop.h"
 #include "phy.h"
 #include "ansi.h"
 
+static tinyloop_t *loop;
+
 static double timestamp(void)
 {
 	struct timeval tv;
@@ -43,7 +46,7 @@ static double timestamp(void)
 
 #define log(f, hdr, ...)		printf("%0.2f: %04X N: %02X D:%02X S:%02X [%03u] - " f ATTR_RESET "\n", timestamp(), hdr->flags, hdr->net_id, hdr->dest_addr, hdr->src_addr, hdr->seq, ##__VA_ARGS__)
 
-void rx_func(const char *buf, size_t size)
+static void rx_func(const char *buf, size_t size, int rssi)
 {
 	const tinymac_header_t *hdr = (const tinymac_header_t*)buf;
 
@@ -55,8 +58,9 @@ void rx_func(const char *buf, size_t size)
 	switch (hdr->flags & TINYMAC_FLAGS_TYPE_MASK) {
 	case tinymacType_Beacon: {
 		const tinymac_beacon_t *beacon = (const tinymac_beacon_t*)hdr->payload;
-		char pending[256];
+		char pending[3 * (256 + TINYMAC_MAX_GROUPS) + 3];	/* Room for every address */
 		char *ptr;
+		size_t len;
 		unsigned int n;
 
 		if (size < sizeof(tinymac_header_t) + sizeof(tinymac_beacon_t)) {
@@ -65,21 +69,42 @@ void rx_func(const char *buf, size_t size)
 		}
 
 		/* Build address list */
+		len = size - sizeof(tinymac_header_t) - sizeof(tinymac_beacon_t);
 		ptr = pending;
 		ptr += sprintf(ptr, "{");
-		for (n = 0; n < size - sizeof(tinymac_header_t) - sizeof(tinymac_beacon_t); n++) {
-			ptr += sprintf(ptr, "%02X ", beacon->address_list[n]);
+		if (beacon->flags & TINYMAC_BEACON_FLAGS_BITMAP) {
+			const tinymac_beacon_bitmap_t *bitmap = (const tinymac_beacon_bitmap_t*)beacon->address_list;
+
+			if (len < sizeof(tinymac_beacon_bitmap_t)) {
+				log(BG_RED FG_WHITE "SHORT (Beacon bitmap)", hdr);
+				return;
+			}
+			/* Addresses are unpacked from the bitmap, followed by the groups */
+			for (n = 0; n < (len - sizeof(tinymac_beacon_bitmap_t)) * 8 && bitmap->base + n < 256; n++) {
+				if (bitmap->nodes[n / 8] & (1 << (n & 7))) {
+					ptr += sprintf(ptr, "%02X ", bitmap->base + n);
+				}
+			}
+			for (n = 0; n < TINYMAC_MAX_GROUPS; n++) {
+				if (bitmap->groups & TINYMAC_GROUP_BIT(TINYMAC_ADDR_GROUP_BASE + n)) {
+					ptr += sprintf(ptr, "%02X ", TINYMAC_ADDR_GROUP_BASE + n);
+				}
+			}
+		} else {
+			for (n = 0; n < len; n++) {
+				ptr += sprintf(ptr, "%02X ", beacon->address_list[n]);
+			}
 		}
 		ptr += sprintf(ptr, "}");
 
 		if (beacon->flags & TINYMAC_BEACON_FLAGS_PERMIT_ATTACH) {
 			log(FG_GREEN "%s Beacon from %02X %016llX (Attach permitted): %s", hdr,
 					(beacon->flags & TINYMAC_BEACON_FLAGS_SYNC) ? "Sync" : "Advertisement",
-					hdr->net_id, beacon->uuid, pending);
+					hdr->net_id, (unsigned long long)beacon->uuid, pending);
 		} else {
 			log(FG_YELLOW "%s Beacon from %02X %016llX: %s", hdr,
 					(beacon->flags & TINYMAC_BEACON_FLAGS_SYNC) ? "Sync" : "Advertisement",
-					hdr->net_id, beacon->uuid, pending);
+					hdr->net_id, (unsigned long long)beacon->uuid, pending);
 		}
 	} break;
 	case tinymacType_BeaconRequest: {
@@ -94,7 +119,7 @@ void rx_func(const char *buf, size_t size)
 			log(BG_RED FG_WHITE "SHORT (registration request)", hdr);
 			return;
 		}
-		log("Registration request from %016llX", hdr, attach->uuid);
+		log("Registration request from %016llX", hdr, (unsigned long long)attach->uuid);
 	} break;
 	case tinymacType_DeregistrationRequest: {
 		const tinymac_deregistration_request_t *detach = (const tinymac_deregistration_request_t*)hdr->payload;
@@ -102,7 +127,7 @@ void rx_func(const char *buf, size_t size)
 			log(BG_RED FG_WHITE "SHORT (detach request)", hdr);
 			return;
 		}
-		log("Detachment request from %016llX (reason=%u)", hdr, detach->uuid, detach->reason);
+		log("Detachment request from %016llX (reason=%u)", hdr, (unsigned long long)detach->uuid, detach->reason);
 	} break;
 	case tinymacType_RegistrationResponse: {
 		const tinymac_registration_response_t *addr = (const tinymac_registration_response_t*)hdr->payload;
@@ -110,12 +135,12 @@ void rx_func(const char *buf, size_t size)
 			log(BG_RED FG_WHITE "SHORT (address update)", hdr);
 			return;
 		}
-		log(BG_GREEN FG_RED "Address assignment %02X %02X to device %016llX", hdr, hdr->net_id, addr->addr, addr->uuid);
+		log(BG_GREEN FG_RED "Address assignment %02X %02X to device %016llX", hdr, hdr->net_id, addr->addr, (unsigned long long)addr->uuid);
 	} break;
 	case tinymacType_Poll: {
 		log(BG_BLUE FG_WHITE "Poll request", hdr);
 	} break;
-	case tinymacType_Data: {
+	case tinymacType_RawData: {
 		log("Data", hdr);
 	} break;
 	default:
@@ -123,23 +148,42 @@ void rx_func(const char *buf, size_t size)
 	}
 }
 
+static void break_handler(int signum)
+{
+	tinyloop_stop(loop);
+}
+
+static void phy_handler(int fd, uint32_t events, void *arg)
+{
+	phy_event_handler();
+}
+
 int main(int argc, char **argv)
 {
-	phy_init();
-	phy_register_recv_cb(rx_func);
+	struct sigaction new_sa;
+
+	loop = tinyloop_create();
+	if (!loop) {
+		fprintf(stderr, "Unable to create event loop\n");
+		return 1;
+	}
 
-	while (1) {
-		struct pollfd pfd;
-		int rc;
+	new_sa.sa_handler = break_handler;
+	sigemptyset(&new_sa.sa_mask);
+	new_sa.sa_flags = 0;
+	sigaction(SIGINT, &new_sa, NULL);
 
-		/* Wait for activity */
-		memset(&pfd, 0, sizeof(pfd));
-		pfd.fd = phy_get_fd();
-		pfd.events = POLLIN;
-		rc = poll(&pfd, 1, 1000);
+	phy_init();
+	phy_register_recv_cb(rx_func);
 
-		phy_event_handler();
+	/* Wait for activity */
+	if (tinyloop_add_fd(loop, phy_get_fd(), TINYLOOP_IN, phy_handler, NULL) < 0) {
+		return 1;
+	}
+	if (tinyloop_run(loop) < 0) {
+		return 1;
 	}
 
+	tinyloop_destroy(loop);
 	return 0;
 }
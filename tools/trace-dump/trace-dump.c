@@ -0,0 +1,190 @@
+/*
+ * Copyright 2013-2014 Mike Stirling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of the Tiny Home Area Network stack.
+ *
+ * http://www.tinyhan.co.uk/
+ *
+ * trace-dump.c
+ *
+ * Decodes a binary trace buffer written by tinytrace-mmap.c.  This may be run
+ * while the writer is active, and with -f follows new records as they arrive.
+ *
+ * Usage: trace-dump [-f] <trace file>
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tinytrace.h"
+
+static const char *subsys_names[] = {
+		"PHY",
+		"MAC",
+		"APP",
+};
+
+static const char *level_names[] = {
+		"",
+		"ERR",
+		"INF",
+		"DBG",
+};
+
+static const char *event_name(uint16_t event)
+{
+	switch (event) {
+	case tinytraceEvent_PhyCrcError:		return "CRC ERROR";
+	case tinytraceEvent_MacRx:				return "RX";
+	case tinytraceEvent_MacTx:				return "TX";
+	case tinytraceEvent_MacTxRetry:			return "TX RETRY";
+	case tinytraceEvent_MacTxPending:		return "TX PENDING";
+	case tinytraceEvent_MacAck:				return "ACK";
+	case tinytraceEvent_MacDataAck:			return "DATA ACK";
+	case tinytraceEvent_MacBeacon:			return "BEACON";
+	case tinytraceEvent_MacAckTimeout:		return "ACK TIMEOUT";
+	case tinytraceEvent_MacValidityExpired:	return "EXPIRED";
+	case tinytraceEvent_MacDuplicate:		return "DUPLICATE";
+	case tinytraceEvent_MacRegister:		return "REGISTER";
+	case tinytraceEvent_MacDeregister:		return "DEREGISTER";
+	case tinytraceEvent_MacDrop:			return "DROP";
+	case tinytraceEvent_MacRxAggregated:	return "RX AGG";
+	default:
+		return NULL;
+	}
+}
+
+static void print_record(const tinytrace_record_t *rec)
+{
+	const char *name = event_name(rec->event);
+
+	printf("%10u.%06u %s %s ", rec->timestamp / 1000000, rec->timestamp % 1000000,
+			rec->subsys < ARRAY_SIZE(subsys_names) ? subsys_names[rec->subsys] : "???",
+			rec->level < ARRAY_SIZE(level_names) ? level_names[rec->level] : "???");
+	if (name) {
+		printf("%-12s", name);
+	} else if (rec->event >= tinytraceEvent_App) {
+		printf("APP+%-8u", rec->event - tinytraceEvent_App);
+	} else {
+		printf("%-12u", rec->event);
+	}
+
+	switch (rec->event) {
+	case tinytraceEvent_MacRx:
+	case tinytraceEvent_MacTx:
+	case tinytraceEvent_MacTxRetry:
+	case tinytraceEvent_MacTxPending:
+	case tinytraceEvent_MacAck:
+	case tinytraceEvent_MacDataAck:
+	case tinytraceEvent_MacBeacon:
+	case tinytraceEvent_MacDrop:
+		/* Unpack MAC header (see TINYTRACE_HDR_A/B) */
+		printf(" %04X N:%02X D:%02X S:%02X [%03u] (%u)\n",
+				rec->a >> 16, (rec->a >> 8) & 0xff, rec->a & 0xff,
+				rec->b >> 24, (rec->b >> 16) & 0xff, rec->b & 0xffff);
+		break;
+	case tinytraceEvent_MacRxAggregated:
+		printf(" S:%02X T:%02X (%u)\n", rec->a, rec->b >> 16, rec->b & 0xffff);
+		break;
+	default:
+		printf(" %08X %08X\n", rec->a, rec->b);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const tinytrace_header_t *trace;
+	const tinytrace_record_t *records;
+	tinytrace_header_t hdr;
+	boolean_t follow = FALSE;
+	const char *path;
+	struct stat st;
+	uint32_t next, head, mask;
+	int fd;
+
+	if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+		follow = TRUE;
+		argv++;
+		argc--;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s [-f] <trace file>\n", argv[0]);
+		return 1;
+	}
+	path = argv[1];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+			read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		return 1;
+	}
+	if (hdr.magic != TINYTRACE_MAGIC || hdr.version != TINYTRACE_VERSION ||
+			hdr.record_size != sizeof(tinytrace_record_t) || !hdr.nrecords ||
+			(hdr.nrecords & (hdr.nrecords - 1)) ||
+			(size_t)st.st_size < sizeof(hdr) + hdr.nrecords * sizeof(tinytrace_record_t)) {
+		fprintf(stderr, "%s: incompatible trace file\n", path);
+		return 1;
+	}
+
+	trace = (const tinytrace_header_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (trace == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	records = (const tinytrace_record_t*)(trace + 1);
+	mask = hdr.nrecords - 1;
+
+	/* Start from the oldest record that can't be overwritten while we read it */
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	next = (head > mask) ? head - mask : 0;
+
+	do {
+		while (next != head) {
+			tinytrace_record_t rec = records[next & mask];
+
+			/* Discard the copy if the writer lapped us while we made it */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+			if (head - next > mask) {
+				printf("... %u records lost\n", head - mask - next);
+				next = head - mask;
+				continue;
+			}
+			print_record(&rec);
+			next++;
+		}
+		if (follow) {
+			fflush(stdout);
+			usleep(100000);
+			head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+		}
+	} while (follow);
+
+	munmap((void*)trace, st.st_size);
+	close(fd);
+	return 0;
+}